@@ -1,11 +1,335 @@
 #include "Json.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
 #include <stdlib.h> 
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <ostream>
 #include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define JSON_SSE2
+#include <emmintrin.h>
+#endif
 
 namespace Json
 {
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Node pools
+	// Every block starts with the heap that owns it, then the node; free blocks are linked
+	// through the node's space.  Each thread has a heap with a free list per block size,
+	// refilled from what other threads have sent back and then from a slab.  A heap
+	// outlives its thread: it is kept for the next thread that starts, so blocks still in
+	// use elsewhere always have somewhere to go back to.
+	//////////////////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		const size_t poolClasses = 9;
+		const size_t blockSizes[poolClasses] = { 32, 48, 64, 80, 96, 128, 160, 192, 256 };	// with the header
+		const size_t blockHeader = sizeof(void *);
+		const size_t slabSize = 64 * 1024;
+		const size_t remoteBatch = 64;
+		const unsigned char noClass = 0xff;
+
+		// the class for each size in 16 byte steps
+		struct ClassTable
+		{
+			ClassTable()
+			{
+				for(size_t step = 0, c = 0; step < sizeof(classes); ++step)
+				{
+					while(c < poolClasses && blockSizes[c] < step * 16) ++c;
+					classes[step] = c < poolClasses ? (unsigned char) c : noClass;
+				}
+			}
+			unsigned char classes[256 / 16 + 1];
+		};
+		const ClassTable classTable;
+
+		unsigned char classFor(size_t size)
+		{
+			size += blockHeader;
+			return size <= 256 ? classTable.classes[(size + 15) / 16] : noClass;
+		}
+
+		void *& nextOf(void * node)				{ return *(void **) node; }
+
+		struct PoolHeap
+		{
+			struct Class
+			{
+				void * free;					// nodes, used by the owner only
+				std::atomic<void *> remote;		// nodes sent back by other threads
+				char * carve;					// the unused end of the newest slab
+				char * carveEnd;
+				std::atomic<size_t> blocks;		// written by the owner only, read for stats
+				std::atomic<size_t> inUse;		// less those other threads have sent back
+				std::atomic<size_t> sentBack;
+			};
+
+			PoolHeap()
+			{
+				for(auto& pool : classes)
+				{
+					pool.free = nullptr;
+					pool.remote = nullptr;
+					pool.carve = pool.carveEnd = nullptr;
+					pool.blocks = 0;
+					pool.inUse = 0;
+					pool.sentBack = 0;
+				}
+			}
+
+			Class classes[poolClasses];
+			std::vector<void *> slabs;
+		};
+
+		// every heap ever made, never freed so blocks can be returned at any time
+		struct PoolRegistry
+		{
+			std::mutex lock;
+			std::vector<PoolHeap *> heaps;
+			std::vector<PoolHeap *> spare;		// their threads have finished
+		};
+		PoolRegistry& poolRegistry()
+		{
+			static PoolRegistry * registry = new PoolRegistry;
+			return *registry;
+		}
+
+		// frees bound for another thread's heap, kept until there's a batch
+		struct Outbox
+		{
+			PoolHeap * owner;
+			void * head;
+			void * tail;
+			size_t count;
+		};
+
+		thread_local PoolHeap * localHeap = nullptr;
+		thread_local bool poolFinished = false;
+		thread_local Outbox outboxes[poolClasses];
+
+		void send(Outbox& outbox, unsigned char c)
+		{
+			if(!outbox.count) return;
+			std::atomic<void *>& remote = outbox.owner->classes[c].remote;
+			void * head = remote.load(std::memory_order_relaxed);
+			do
+			{
+				nextOf(outbox.tail) = head;
+			} while(!remote.compare_exchange_weak(head, outbox.head, std::memory_order_release, std::memory_order_relaxed));
+			outbox.owner->classes[c].sentBack.fetch_add(outbox.count, std::memory_order_relaxed);
+			outbox.head = outbox.tail = nullptr;
+			outbox.count = 0;
+		}
+
+		// sends what's left and hands the heap on when its thread finishes
+		struct HeapRelease
+		{
+			~HeapRelease()
+			{
+				for(unsigned char c = 0; c < poolClasses; ++c) send(outboxes[c], c);
+				poolFinished = true;
+				if(!localHeap) return;
+				std::lock_guard<std::mutex> guard(poolRegistry().lock);
+				poolRegistry().spare.push_back(localHeap);
+				localHeap = nullptr;
+			}
+		};
+
+		void releaseAtExit()
+		{
+			static thread_local HeapRelease release;
+			(void) release;
+		}
+
+		PoolHeap * heapForThread()
+		{
+			if(localHeap || poolFinished) return localHeap;
+			releaseAtExit();
+			PoolRegistry& registry = poolRegistry();
+			std::lock_guard<std::mutex> guard(registry.lock);
+			if(!registry.spare.empty())
+			{
+				localHeap = registry.spare.back();
+				registry.spare.pop_back();
+			}
+			else
+			{
+				localHeap = new PoolHeap;
+				registry.heaps.push_back(localHeap);
+			}
+			return localHeap;
+		}
+
+		// only the owner writes its counts
+		void adjust(std::atomic<size_t>& count, ptrdiff_t by)
+		{
+			count.store(count.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+		}
+
+		void * refill(PoolHeap * heap, unsigned char c)
+		{
+			PoolHeap::Class& pool = heap->classes[c];
+			void * returned = pool.remote.exchange(nullptr, std::memory_order_acquire);
+			if(returned)
+			{
+				pool.free = nextOf(returned);
+				adjust(pool.inUse, 1);
+				return returned;
+			}
+
+			if(pool.carveEnd - pool.carve < (ptrdiff_t) blockSizes[c])
+			{
+				pool.carve = (char *) ::operator new(slabSize);
+				pool.carveEnd = pool.carve + slabSize;
+				heap->slabs.push_back(pool.carve);
+			}
+			char * block = pool.carve;
+			pool.carve += blockSizes[c];
+			*(PoolHeap **) block = heap;
+			adjust(pool.blocks, 1);
+			adjust(pool.inUse, 1);
+			return block + blockHeader;
+		}
+
+		void * poolAllocate(size_t size)
+		{
+#ifndef JSON_NO_POOL
+			unsigned char c = classFor(size);
+			PoolHeap * heap = c != noClass ? heapForThread() : nullptr;
+			if(heap)
+			{
+				PoolHeap::Class& pool = heap->classes[c];
+				void * node = pool.free;
+				if(!node) return refill(heap, c);
+				pool.free = nextOf(node);
+				adjust(pool.inUse, 1);
+				return node;
+			}
+
+			// too big, or the thread is finishing
+			char * block = (char *) ::operator new(size + blockHeader);
+			*(PoolHeap **) block = nullptr;
+			return block + blockHeader;
+#else
+			return ::operator new(size);
+#endif
+		}
+
+		void poolFree(void * node, size_t size)
+		{
+#ifndef JSON_NO_POOL
+			if(!node) return;
+			char * block = (char *) node - blockHeader;
+			PoolHeap * owner = *(PoolHeap **) block;
+			if(!owner)
+			{
+				::operator delete(block);
+				return;
+			}
+			unsigned char c = classFor(size);
+			if(owner == localHeap)
+			{
+				PoolHeap::Class& pool = owner->classes[c];
+				nextOf(node) = pool.free;
+				pool.free = node;
+				adjust(pool.inUse, -1);
+				return;
+			}
+
+			Outbox& outbox = outboxes[c];
+			if(outbox.owner != owner)
+			{
+				if(!outbox.owner) releaseAtExit();
+				send(outbox, c);
+				outbox.owner = owner;
+			}
+			nextOf(node) = outbox.head;
+			outbox.head = node;
+			if(!outbox.tail) outbox.tail = node;
+			if(++outbox.count == remoteBatch || poolFinished) send(outbox, c);
+#else
+			::operator delete(node);
+#endif
+		}
+
+		// for the containers inside values
+		template<typename T>
+		struct PoolAllocator
+		{
+			typedef T value_type;
+
+			PoolAllocator() {}
+			template<typename U> PoolAllocator(const PoolAllocator<U>&) {}
+
+			T * allocate(size_t count)					{ return (T *) poolAllocate(count * sizeof(T)); }
+			void deallocate(T * ptr, size_t count)		{ poolFree(ptr, count * sizeof(T)); }
+
+			template<typename U> bool operator==(const PoolAllocator<U>&) const	{ return true; }
+			template<typename U> bool operator!=(const PoolAllocator<U>&) const	{ return false; }
+		};
+	}
+
+	void * Value::operator new(size_t size)
+	{
+		return poolAllocate(size);
+	}
+
+	void Value::operator delete(void * ptr, size_t size)
+	{
+		poolFree(ptr, size);
+	}
+
+	std::vector<PoolStats> poolStats()
+	{
+		std::vector<PoolStats> rtn;
+		for(size_t c = 0; c < poolClasses; ++c)
+		{
+			PoolStats stats = { blockSizes[c] - blockHeader, 0, 0 };
+			rtn.push_back(stats);
+		}
+		std::lock_guard<std::mutex> guard(poolRegistry().lock);
+		for(PoolHeap * heap : poolRegistry().heaps)
+		{
+			for(size_t c = 0; c < poolClasses; ++c)
+			{
+				rtn[c].blocks += heap->classes[c].blocks.load(std::memory_order_relaxed);
+				// sent back before read, so no more than were handed out
+				size_t sentBack = heap->classes[c].sentBack.load(std::memory_order_acquire);
+				rtn[c].inUse += heap->classes[c].inUse.load(std::memory_order_relaxed) - sentBack;
+			}
+		}
+		return rtn;
+	}
+
 	//////////////////////////////////////////////////////////////////////////////////////
 	// null value class
 	//////////////////////////////////////////////////////////////////////////////////////
@@ -14,20 +338,19 @@ namespace Json
 	public:
 		NullValue() {}
 		virtual bool isNull() const override { return true; }
-		virtual std::string toString() const;
+		virtual void write(Writer& writer) const override { writer.writeNull(); }
 	};
-	std::string NullValue::toString() const
-	{
-		return "null";
-	}
 
 	// some default values
 	namespace
 	{
 		typedef std::shared_ptr<Value> SharedValue;
-		typedef std::map<std::string, SharedValue> Object;
+		typedef std::map<std::string, SharedValue, std::less<std::string>, PoolAllocator<std::pair<const std::string, SharedValue>>> Object;
 		typedef std::vector<SharedValue> Array;
 
+		// with its reference count in a pool too
+		SharedValue share(Value * val)			{ return SharedValue(val, std::default_delete<Value>(), PoolAllocator<Value>()); }
+
 		Object emptyObject;
 		Array emptyArray;
 		std::string emptyString = "";
@@ -46,12 +369,14 @@ namespace Json
 	bool Value::isNull() const		{ return false; }
 	bool Value::isObject() const	{ return false; }
 	bool Value::isArray() const		{ return false; }
+	bool Value::isBytes() const		{ return false; }
 
 	// The accessors will assert if you try and access them incorrectly
 	int Value::asInt() const										{ assert(false); return 0; }
 	float Value::asFloat() const									{ assert(false); return 0.0f; }
 	const std::string& Value::asString() const						{ assert(false); return emptyString; }
 	bool Value::asBool() const										{ assert(false); return true; }
+	const std::string& Value::asBytes() const						{ assert(false); return emptyString; }
 	void Value::add(const std::string& key, Value * val)			{ assert(false);}
 	void Value::remove(const std::string& key)						{ assert(false); }
 	Value& Value::get(const std::string& key)						{ assert(false); return theNullValue; }
@@ -63,6 +388,21 @@ namespace Json
 	const Value& Value::operator[](unsigned int key) const			{ assert(false); return theNullValue; }
 	unsigned int Value::size() const								{ assert(false); return 0; }
 
+	// Only packed arrays have contiguous storage, everything else gets an empty span
+	Span<int> Value::asIntSpan() const								{ return Span<int>(); }
+	Span<float> Value::asFloatSpan() const							{ return Span<float>(); }
+	void Value::forEachMember(const MemberVisitor& visit) const		{ assert(false); }
+
+	std::string Value::toString() const
+	{
+		std::string rtn;
+		{
+			Writer writer([&rtn](const char * data, size_t size) { rtn.append(data, size); return true; }, 256);
+			writer.write(*this);
+		}
+		return rtn;
+	}
+
 	//////////////////////////////////////////////////////////////////////////////////////
 	// Integer value class
 	//////////////////////////////////////////////////////////////////////////////////////
@@ -72,16 +412,10 @@ namespace Json
 		IntValue(int value) : value(value) {}
 		virtual bool isInt() const override { return true; }
 		virtual int asInt() const override { return value; }
-		virtual std::string toString() const;
+		virtual void write(Writer& writer) const override { writer.writeInt(value); }
 	private:
 		int value;
 	};
-	std::string IntValue::toString() const
-	{
-		std::stringstream ss;
-		ss << value;
-		return ss.str();
-	}
 
 	//////////////////////////////////////////////////////////////////////////////////////
 	// Float value class
@@ -92,16 +426,10 @@ namespace Json
 		FloatValue(float value) : value(value) {}
 		virtual bool isFloat() const override { return true; }
 		virtual float asFloat() const override { return value; }
-		virtual std::string toString() const override;
+		virtual void write(Writer& writer) const override { writer.writeFloat(value); }
 	private:
 		float value;
 	};
-	std::string FloatValue::toString() const
-	{
-		std::stringstream ss;
-		ss << value;
-		return ss.str();
-	}
 
 	//////////////////////////////////////////////////////////////////////////////////////
 	// String value class
@@ -112,10 +440,50 @@ namespace Json
 		StringValue(const std::string& value) : value(value) {}
 		virtual bool isString() const { return true; }
 		virtual const std::string& asString() const override { return value; }
-		virtual std::string toString() const override { return "\"" + value + "\""; }
+		virtual void write(Writer& writer) const override { writer.writeString(value); }
+	private:
+		std::string value;
+	};
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Bytes value class
+	// JSON has no binary type, so the bytes are written as base64url text without padding
+	// (the conversion RFC 8949 gives for CBOR byte strings)
+	//////////////////////////////////////////////////////////////////////////////////////
+	class BytesValue : public Value
+	{
+	public:
+		BytesValue(const std::string& value) : value(value) {}
+		virtual bool isBytes() const override { return true; }
+		virtual const std::string& asBytes() const override { return value; }
+		virtual void write(Writer& writer) const override;
 	private:
 		std::string value;
 	};
+	namespace
+	{
+		std::string base64url(const std::string& value)
+		{
+			static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+			std::string text;
+			text.reserve((value.size() * 4 + 2) / 3);
+			for(size_t i = 0; i < value.size(); i += 3)
+			{
+				size_t left = std::min<size_t>(3, value.size() - i);
+				unsigned int bits = (unsigned char) value[i] << 16;
+				if(left > 1) bits |= (unsigned char) value[i + 1] << 8;
+				if(left > 2) bits |= (unsigned char) value[i + 2];
+				for(size_t d = 0; d <= left; ++d) text += digits[(bits >> (18 - 6 * d)) & 0x3f];
+			}
+			return text;
+		}
+	}
+	void BytesValue::write(Writer& writer) const
+	{
+		// the text is a temporary, so it mustn't be passed through
+		std::string text = base64url(value);
+		writer.writeStringCopy(text.data(), text.size());
+	}
 
 	//////////////////////////////////////////////////////////////////////////////////////
 	// Bool value class
@@ -126,13 +494,47 @@ namespace Json
 		BoolValue(bool value) : value(value) {}
 		virtual bool isBool() const { return true; }
 		virtual bool asBool() const override { return value; }
-		virtual std::string toString() const override;
+		virtual void write(Writer& writer) const override { writer.writeBool(value); }
 	private:
 		bool value;
 	};
-	std::string BoolValue::toString() const
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Teardown
+	// A container being destroyed hands its child containers to a list rather than letting
+	// them go inside its destructor, and the outermost one works through the list, so
+	// freeing a tree takes the same stack however deep it is.
+	//////////////////////////////////////////////////////////////////////////////////////
+	namespace
 	{
-		return value ? "true" : "false";
+		thread_local Array * dismantling = nullptr;	// the list of the teardown under way
+
+		void defer(SharedValue& child, Array& pending)
+		{
+			if(child && (child->isObject() || child->isArray())) pending.push_back(std::move(child));
+		}
+
+		// children moves the container's child containers onto the list it is given
+		template<typename Children>
+		void tearDown(Children children)
+		{
+			if(dismantling)
+			{
+				children(*dismantling);
+				return;
+			}
+			Array pending;
+			children(pending);
+			if(pending.empty()) return;
+			dismantling = &pending;
+			while(!pending.empty())
+			{
+				SharedValue last = std::move(pending.back());
+				pending.pop_back();
+				last.reset();	// adds its own children
+			}
+			dismantling = nullptr;
+		}
 	}
 
 	//////////////////////////////////////////////////////////////////////////////////////
@@ -142,78 +544,326 @@ namespace Json
 	{
 	public:
 		ObjectValue() {}
+		~ObjectValue()		{ tearDown([this](Array& pending) { for(auto& member : value) defer(member.second, pending); }); }
 		virtual bool isObject() const override { return true; }
 
-		virtual std::string toString() const override;
-		virtual void add(const std::string& key, Value * val)  override			{ value[key] = SharedValue(val); }
+		virtual void write(Writer& writer) const override;
+		virtual void add(const std::string& key, Value * val)  override			{ value[key] = share(val); }
 		virtual void remove(const std::string& key) override					{ value.erase(key); }
 		virtual Value& get(const std::string& key) override						{ return const_cast<Value &>(static_cast<const Value &>(*this).get(key)); }
 		virtual const Value& get(const std::string& key) const override;
 		virtual Value& operator[](const std::string& key) override				{ return get(key); }
 		virtual const Value& operator[](const std::string& key) const override	{ return get(key); }
+		virtual unsigned int size() const override								{ return value.size(); }
+		virtual void forEachMember(const MemberVisitor& visit) const override;
+
+		const Object& members() const											{ return value; }
+
+		// move other's members in, replacing any with the same key as add() does
+		void merge(ObjectValue& other);
 
 	private:
 		Object value;
 	};
 	const Value& ObjectValue::get(const std::string& key) const
 	{
-		if(value.find(key) == value.end())
+		auto found = value.find(key);
+		if(found == value.end())
 		{
 			return theNullValue; 
 		}
 		else 
 		{
-			return *(value.find(key)->second);
+			return *found->second;
 		}
 	}
-	std::string ObjectValue::toString() const
+	void ObjectValue::merge(ObjectValue& other)
 	{
-		std::stringstream ss;
-		ss << "{";
-		const char * comma = "";
+		if(value.empty())
+		{
+			value.swap(other.value);
+			return;
+		}
+		// both maps are in key order, so one pass builds the result with every insert at the end
+		Object merged;
+		auto mine = value.begin();
+		auto theirs = other.value.begin();
+		while(mine != value.end() || theirs != other.value.end())
+		{
+			if(theirs == other.value.end() || (mine != value.end() && mine->first < theirs->first))
+			{
+				merged.emplace_hint(merged.end(), mine->first, std::move(mine->second));
+				++mine;
+				continue;
+			}
+			if(mine != value.end() && !(theirs->first < mine->first)) ++mine;	// same key, theirs wins
+			merged.emplace_hint(merged.end(), theirs->first, std::move(theirs->second));
+			++theirs;
+		}
+		value.swap(merged);
+		other.value.clear();
+	}
+	void ObjectValue::forEachMember(const MemberVisitor& visit) const
+	{
+		for(auto& member : value)
+		{
+			visit(member.first.data(), member.first.size(), *member.second);
+		}
+	}
+	void ObjectValue::write(Writer& writer) const
+	{
+		writer.startObject();
 		auto end = value.end();
 		for(auto itr = value.begin(); itr != end; ++itr)
 		{
-			ss << comma;
-			ss << "\"" << itr->first << "\":" << itr->second->toString();
-			comma = ",";
+			writer.writeKey(itr->first);
+			itr->second->write(writer);
 		}
-		ss << "}";
-		return ss.str();
+		writer.endObject();
 	}
 
 	//////////////////////////////////////////////////////////////////////////////////////
 	// array value class
+	// Arrays whose elements are all ints, all floats or all bools are stored packed in a
+	// plain vector rather than as one heap allocated value per element.  The first
+	// element decides the packing; adding anything else unpacks the array again.
+	// Indexing a packed array, const or not, leaves it packed: the element is boxed the
+	// first time it is asked for and the box is kept, so references to it stay valid.
 	//////////////////////////////////////////////////////////////////////////////////////
 	class ArrayValue : public Value
 	{
 	public:
-		ArrayValue() {}
+		ArrayValue() : storage(eEmpty), boxes(nullptr) {}
+		~ArrayValue();
 		virtual bool isArray() const override								{ return true; }
-		virtual Array& asArray()											{ return value; }
-		virtual const Array& asArray() const								{ return value; }
-		virtual std::string toString() const override;
-		virtual void add(Value * val) override								{ value.push_back(SharedValue(val)); }
-		virtual Value& operator[](unsigned int key) override				{ return *value[key]; }
-		virtual const Value& operator[](unsigned int key) const override	{ return *value[key]; }
-		virtual unsigned int size() const override							{ return value.size(); }
+		virtual void write(Writer& writer) const override;
+		virtual void add(Value * val) override;
+		virtual Value& operator[](unsigned int key) override				{ return isPacked() ? box(key) : *value[key]; }
+		virtual const Value& operator[](unsigned int key) const override	{ return isPacked() ? box(key) : *value[key]; }
+		virtual unsigned int size() const override;
+		virtual Span<int> asIntSpan() const override;
+		virtual Span<float> asFloatSpan() const override;
+
+		bool isPacked() const												{ return storage >= eInts; }
+
+		// move other's elements onto the end, packed only if both were packed alike
+		void append(ArrayValue& other);
+
+		// write elements [begin, end) without boxing them
+		void writeRange(Writer& writer, unsigned int begin, unsigned int end) const;
+
+		// pass each element to fn, packed ones as temporaries that last for the call
+		template<typename Fn> void visit(Fn fn) const;
+
+		// append without allocating a value (used by the parser)
+		void addInt(int val);
+		void addFloat(float val);
+		void addBool(bool val);
+
 	private:
+		enum Storage
+		{
+			eEmpty = 0,
+			eBoxed,
+			eInts,
+			eFloats,
+			eBools
+		};
+
+		// a slot per packed element for its box, each filled with a compare and swap so
+		// readers on several threads share one box
+		struct Boxes
+		{
+			explicit Boxes(size_t count) : slots(new std::atomic<Value *>[count]()), count(count) {}
+			~Boxes()	{ for(size_t i = 0; i < count; ++i) delete slots[i].load(std::memory_order_relaxed); }
+			std::unique_ptr<std::atomic<Value *>[]> slots;
+			size_t count;
+		};
+
+		Value& box(unsigned int key) const;
+		void dropBoxes();
+		void unpack();
+
+		Storage storage;
 		Array value;
+		mutable std::atomic<Boxes *> boxes;
+		std::vector<int> ints;
+		std::vector<float> floats;
+		std::vector<bool> bools;	// bitset
 	};
-	std::string ArrayValue::toString() const
+	ArrayValue::~ArrayValue()
 	{
-		std::stringstream ss;
-		ss << "[";
-		const char * comma = "";
-		auto end = value.end();
-		for(auto itr = value.begin(); itr != end; ++itr)
+		dropBoxes();
+		tearDown([this](Array& pending) { for(auto& element : value) defer(element, pending); });
+	}
+	void ArrayValue::add(Value * val)
+	{
+		// the caller may still hold val, so it is kept as it is
+		unpack();
+		storage = eBoxed;
+		value.push_back(share(val));
+	}
+	void ArrayValue::addInt(int val)
+	{
+		if(storage == eEmpty) storage = eInts;
+		if(storage != eInts) return add(newInt(val));
+		dropBoxes();
+		ints.push_back(val);
+	}
+	void ArrayValue::addFloat(float val)
+	{
+		if(storage == eEmpty) storage = eFloats;
+		if(storage != eFloats) return add(newFloat(val));
+		dropBoxes();
+		floats.push_back(val);
+	}
+	void ArrayValue::addBool(bool val)
+	{
+		if(storage == eEmpty) storage = eBools;
+		if(storage != eBools) return add(newBool(val));
+		dropBoxes();
+		bools.push_back(val);
+	}
+	void ArrayValue::append(ArrayValue& other)
+	{
+		if(other.storage == eEmpty) return;
+		dropBoxes();
+		other.dropBoxes();
+		if(storage == eEmpty)
 		{
-			ss << comma;
-			ss << (*itr)->toString();
-			comma = ",";
+			std::swap(storage, other.storage);
+			value.swap(other.value);
+			ints.swap(other.ints);
+			floats.swap(other.floats);
+			bools.swap(other.bools);
+			return;
+		}
+		if(storage != other.storage)
+		{
+			unpack();
+			other.unpack();
+		}
+		switch(storage)
+		{
+		case eInts:		ints.insert(ints.end(), other.ints.begin(), other.ints.end()); break;
+		case eFloats:	floats.insert(floats.end(), other.floats.begin(), other.floats.end()); break;
+		case eBools:	bools.insert(bools.end(), other.bools.begin(), other.bools.end()); break;
+		default:		value.insert(value.end(), std::make_move_iterator(other.value.begin()), std::make_move_iterator(other.value.end())); break;
+		}
+		other.storage = eEmpty;
+		other.value.clear();
+		other.ints.clear();
+		other.floats.clear();
+		other.bools.clear();
+	}
+	unsigned int ArrayValue::size() const
+	{
+		switch(storage)
+		{
+		case eInts:		return ints.size();
+		case eFloats:	return floats.size();
+		case eBools:	return bools.size();
+		default:		return value.size();
+		}
+	}
+	Span<int> ArrayValue::asIntSpan() const
+	{
+		return storage == eInts ? Span<int>(ints.data(), ints.size()) : Span<int>();
+	}
+	Span<float> ArrayValue::asFloatSpan() const
+	{
+		return storage == eFloats ? Span<float>(floats.data(), floats.size()) : Span<float>();
+	}
+	Value& ArrayValue::box(unsigned int key) const
+	{
+		Boxes * all = boxes.load(std::memory_order_acquire);
+		if(!all)
+		{
+			std::unique_ptr<Boxes> made(new Boxes(size()));
+			if(boxes.compare_exchange_strong(all, made.get(), std::memory_order_acq_rel, std::memory_order_acquire)) all = made.release();
+		}
+
+		std::atomic<Value *>& slot = all->slots[key];
+		Value * rtn = slot.load(std::memory_order_acquire);
+		if(rtn) return *rtn;
+		std::unique_ptr<Value> made(storage == eInts ? newInt(ints[key]) : storage == eFloats ? newFloat(floats[key]) : newBool(bools[key]));
+		// another reader may have got there first
+		if(slot.compare_exchange_strong(rtn, made.get(), std::memory_order_acq_rel, std::memory_order_acquire)) rtn = made.release();
+		return *rtn;
+	}
+	void ArrayValue::dropBoxes()
+	{
+		delete boxes.exchange(nullptr, std::memory_order_relaxed);
+	}
+	void ArrayValue::unpack()
+	{
+		if(!isPacked())
+		{
+			return;
+		}
+		// boxes already handed out become the elements, so references to them stay valid
+		Array elements;
+		elements.reserve(size());
+		for(unsigned int i = 0; i < size(); ++i)
+		{
+			Value& element = box(i);
+			boxes.load(std::memory_order_relaxed)->slots[i].store(nullptr, std::memory_order_relaxed);
+			elements.push_back(share(&element));
+		}
+		dropBoxes();
+		value.swap(elements);
+		storage = eBoxed;
+		std::vector<int>().swap(ints);
+		std::vector<float>().swap(floats);
+		std::vector<bool>().swap(bools);
+	}
+	void ArrayValue::write(Writer& writer) const
+	{
+		writer.startArray();
+		writeRange(writer, 0, size());
+		writer.endArray();
+	}
+	void ArrayValue::writeRange(Writer& writer, unsigned int begin, unsigned int end) const
+	{
+		for(unsigned int i = begin; i < end; ++i)
+		{
+			switch(storage)
+			{
+			case eInts:		writer.writeInt(ints[i]); break;
+			case eFloats:	writer.writeFloat(floats[i]); break;
+			case eBools:	writer.writeBool(bools[i]); break;
+			default:		value[i]->write(writer); break;
+			}
+		}
+	}
+
+	template<typename Fn>
+	void ArrayValue::visit(Fn fn) const
+	{
+		switch(storage)
+		{
+		case eInts:		for(int val : ints) fn(IntValue(val)); break;
+		case eFloats:	for(float val : floats) fn(FloatValue(val)); break;
+		case eBools:	for(bool val : bools) fn(BoolValue(val)); break;
+		default:		for(auto& element : value) fn(*element); break;
+		}
+	}
+
+	namespace
+	{
+		// Walks the elements of any array.  Packed ones are passed as temporaries, so a walk
+		// neither writes to the tree nor allocates a box per element; keep a pointer only
+		// to a container.
+		template<typename Fn>
+		void forEachElement(const Value& array, Fn fn)
+		{
+			if(const ArrayValue * arr = dynamic_cast<const ArrayValue *>(&array))
+			{
+				arr->visit(fn);
+				return;
+			}
+			for(unsigned int i = 0; i < array.size(); ++i) fn(array[i]);
 		}
-		ss << "]";
-		return ss.str();
 	}
 
 	//////////////////////////////////////////////////////////////////////////////////////
@@ -223,467 +873,5471 @@ namespace Json
 	Value * newFloat(float value)				{ return new FloatValue(value); }
 	Value * newString(const std::string& value)	{ return new StringValue(value); }
 	Value * newBool(bool value)					{ return new BoolValue(value); }
+	Value * newBytes(const std::string& value)	{ return new BytesValue(value); }
 	Value * newObject()							{ return new ObjectValue(); }
 	Value * newArray()							{ return new ArrayValue(); }
-	Value * newNull()							{ return &theNullValue; }
+	Value * newNull()							{ return new NullValue(); }
 
-	//////////////////////////////////////////////////////////////////////////////////////
-	// Implement the parser
-	//////////////////////////////////////////////////////////////////////////////////////
 	namespace
 	{
-		// lexer
-		struct Token
+		bool needsEscape(const char * str, size_t size)
 		{
-			enum Type
+			for(const char * end = str + size; str != end; ++str)
 			{
-				eOpenObject = 0,	// {
-				eCloseObject,		// }
-				eOpenArray,			// [
-				eCloseArray,		// ]
-				eColon,				// :
-				eComma,				// ,
+				unsigned char c = *str;
+				if(c < 0x20 || c == '"' || c == '\\') return true;
+			}
+			return false;
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Writer
+	// Output is gathered in a fixed size buffer that is handed to the sink whenever it
+	// fills up.  A comma is needed before anything that follows a complete value, which
+	// is all the state the writer needs to keep, however deep the document.
+	//////////////////////////////////////////////////////////////////////////////////////
+	Writer::Writer(const Sink& sink, size_t capacity)
+		: sink(sink)
+		, threshold(0)
+		, storage(capacity > 16 ? capacity : 16)
+		, buffer(&storage[0])
+		, capacity(storage.size())
+		, used(0)
+		, needComma(false)
+		, failed(false)
+	{}
+	Writer::Writer(const Sink& sink, char * buffer, size_t capacity)
+		: sink(sink)
+		, threshold(0)
+		, buffer(buffer)
+		, capacity(capacity)
+		, used(0)
+		, needComma(false)
+		, failed(false)
+	{
+		assert(capacity > 0);
+	}
+	Writer::~Writer()
+	{
+		flush();
+	}
+	void Writer::write(const Value& val)
+	{
+		val.write(*this);
+	}
+	void Writer::startObject()
+	{
+		separate();
+		put('{');
+		needComma = false;
+	}
+	void Writer::endObject()
+	{
+		put('}');
+		needComma = true;
+	}
+	void Writer::startArray()
+	{
+		separate();
+		put('[');
+		needComma = false;
+	}
+	void Writer::endArray()
+	{
+		put(']');
+		needComma = true;
+	}
+	void Writer::writeKey(const std::string& key)
+	{
+		writeKey(key.data(), key.size());
+	}
+	void Writer::writeKey(const char * key, size_t size)
+	{
+		separate();
+		putEscaped(key, size);
+		put(':');
+		needComma = false;
+	}
+	void Writer::writeRawKey(const char * text, size_t size)
+	{
+		separate();
+		put(text, size);
+		needComma = false;
+	}
+	void Writer::writeInt(int value)
+	{
+		separate();
+		char text[16];
+		put(text, sprintf(text, "%d", value));
+	}
+	void Writer::writeFloat(float value)
+	{
+		separate();
+		char text[32];
+		put(text, sprintf(text, "%g", value));
+	}
+	void Writer::writeDouble(double value)
+	{
+		separate();
+		char text[32];
+		put(text, sprintf(text, "%.17g", value));
+	}
+	void Writer::writeString(const std::string& value)
+	{
+		writeString(value.data(), value.size());
+	}
+	void Writer::writeString(const char * value, size_t size)
+	{
+		separate();
+		putEscaped(value, size);
+	}
+	void Writer::writeStringCopy(const char * value, size_t size)
+	{
+		separate();
+		putEscaped(value, size, false);
+	}
+	void Writer::writeBool(bool value)
+	{
+		separate();
+		if(value) put("true", 4);
+		else put("false", 5);
+	}
+	void Writer::writeNull()
+	{
+		separate();
+		put("null", 4);
+	}
+	void Writer::passThrough(const Sink& reference, size_t threshold)
+	{
+		this->reference = reference;
+		this->threshold = threshold;
+	}
+	void Writer::flush()
+	{
+		if(used > 0 && !failed && !sink(buffer, used))
+		{
+			refused();
+		}
+		used = 0;
+	}
+	void Writer::refused()
+	{
+		// stop filling the caller's buffer, the rest of the output goes nowhere
+		failed = true;
+		buffer = discard;
+		capacity = sizeof(discard);
+	}
+	void Writer::separate()
+	{
+		if(needComma) put(',');
+		needComma = true;
+	}
+	void Writer::put(const char * data, size_t size)
+	{
+		if(size > capacity - used)
+		{
+			flush();
+			if(size >= capacity)
+			{
+				// too big to buffer, hand it straight over
+				if(!failed && !sink(data, size)) refused();
+				return;
+			}
+		}
+		memcpy(buffer + used, data, size);
+		used += size;
+	}
+	void Writer::putEscaped(const char * str, size_t size, bool lasting)
+	{
+		put('"');
+		if(lasting && reference && size >= threshold && !needsEscape(str, size))
+		{
+			flush();
+			if(!failed && !reference(str, size)) refused();
+			put('"');
+			return;
+		}
+		const char * run = str;
+		const char * end = run + size;
+		for(const char * itr = run; itr != end; ++itr)
+		{
+			unsigned char c = *itr;
+			if(c >= 0x20 && c != '"' && c != '\\')
+			{
+				continue;
+			}
+			put(run, itr - run);
+			run = itr + 1;
+			put('\\');
+			switch(c)
+			{
+			case '"':	put('"'); break;
+			case '\\':	put('\\'); break;
+			case '\b':	put('b'); break;
+			case '\f':	put('f'); break;
+			case '\n':	put('n'); break;
+			case '\r':	put('r'); break;
+			case '\t':	put('t'); break;
+			default:
+				{
+					char text[8];
+					put(text, sprintf(text, "u%04x", c));
+				}
+				break;
+			}
+		}
+		put(run, end - run);
+		put('"');
+	}
+
+	Writer::Sink fileSink(int fd)
+	{
+		return [fd](const char * data, size_t size) -> bool
+		{
+			while(size > 0)
+			{
+#ifdef _WIN32
+				int written = _write(fd, data, (unsigned int) size);
+#else
+				ssize_t written = ::write(fd, data, size);
+#endif
+				if(written < 0)
+				{
+					if(errno == EINTR) continue;
+					return false;
+				}
+				data += written;
+				size -= written;
+			}
+			return true;
+		};
+	}
+	Writer::Sink streamSink(std::ostream& out)
+	{
+		std::ostream * stream = &out;
+		return [stream](const char * data, size_t size) -> bool
+		{
+			stream->write(data, size);
+			return !stream->fail();
+		};
+	}
+
+	size_t measure(const Value& val)
+	{
+		// the same writer that produces the output counts it, so the two can't disagree
+		size_t total = 0;
+		char buffer[512];
+		{
+			Writer writer([&total](const char *, size_t size) { total += size; return true; }, buffer, sizeof(buffer));
+			writer.write(val);
+		}
+		return total;
+	}
+	size_t serializeInto(const Value& val, char * buf, size_t len)
+	{
+		if(len == 0)
+		{
+			return measure(val);
+		}
+		// the writer only flushes before it is finished if the output doesn't fit in buf
+		struct State
+		{
+			size_t written;
+			bool finished;
+			bool overflowed;
+		} state = { 0, false, false };
+		State * s = &state;
+		{
+			Writer writer([s](const char *, size_t size)
+			{
+				s->written = size;
+				s->overflowed = !s->finished;
+				return s->finished;
+			}, buf, len);
+			writer.write(val);
+			state.finished = true;
+		}
+		return state.overflowed ? measure(val) : state.written;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Gather list
+	// Copied output is appended to one scratch string, so chunks record offsets until
+	// it has stopped growing and only then become pointers.
+	//////////////////////////////////////////////////////////////////////////////////////
+	GatherList::GatherList(const Value& val, size_t threshold)
+		: total(0)
+	{
+		const char * copied = nullptr; // marks a chunk that lives in scratch
+		{
+			Writer writer([&](const char * data, size_t size)
+			{
+				if(!pieces.empty() && pieces.back().data == copied)
+				{
+					pieces.back().size += size;
+				}
+				else
+				{
+					Chunk chunk = { copied, size };
+					pieces.push_back(chunk);
+				}
+				scratch.append(data, size);
+				return true;
+			}, 4096);
+			writer.passThrough([&](const char * data, size_t size)
+			{
+				Chunk chunk = { data, size };
+				pieces.push_back(chunk);
+				return true;
+			}, threshold);
+			writer.write(val);
+		}
+		size_t offset = 0;
+		for(auto& chunk : pieces)
+		{
+			if(chunk.data == copied)
+			{
+				chunk.data = scratch.data() + offset;
+				offset += chunk.size;
+			}
+			total += chunk.size;
+		}
+	}
+	bool GatherList::writeTo(int fd) const
+	{
+#ifdef _WIN32
+		Writer::Sink sink = fileSink(fd);
+		for(auto& chunk : pieces)
+		{
+			if(!sink(chunk.data, chunk.size)) return false;
+		}
+		return true;
+#else
+#ifdef IOV_MAX
+		const size_t batch = IOV_MAX;
+#else
+		const size_t batch = 1024;
+#endif
+		std::vector<iovec> vecs(pieces.size());
+		for(size_t i = 0; i < pieces.size(); ++i)
+		{
+			vecs[i].iov_base = const_cast<char *>(pieces[i].data);
+			vecs[i].iov_len = pieces[i].size;
+		}
+		size_t next = 0;
+		while(next < vecs.size())
+		{
+			size_t count = std::min(batch, vecs.size() - next);
+			ssize_t written = writev(fd, &vecs[next], (int) count);
+			if(written < 0)
+			{
+				if(errno == EINTR) continue;
+				return false;
+			}
+			// skip whatever was written, which may end part way through a chunk
+			while(next < vecs.size() && (size_t) written >= vecs[next].iov_len)
+			{
+				written -= vecs[next].iov_len;
+				++next;
+			}
+			if(written > 0)
+			{
+				vecs[next].iov_base = (char *) vecs[next].iov_base + written;
+				vecs[next].iov_len -= written;
+			}
+		}
+		return true;
+#endif
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Thread pool
+	// Every range knows its batch, so any thread can run any range and a thread waiting
+	// for its own batch runs whatever it finds meanwhile.  queued counts the ranges in all
+	// the deques so idle threads can sleep until there is something to take.
+	//////////////////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		struct Batch
+		{
+			const Executor::Task * task;
+			size_t grain;
+			std::atomic<size_t> remaining;	// indexes not yet run
+		};
+
+		struct Range
+		{
+			Batch * batch;
+			size_t begin;
+			size_t end;
+		};
+	}
+
+	struct ThreadPool::State
+	{
+		struct Worker
+		{
+			std::mutex lock;
+			std::deque<Range> ranges;
+		};
+
+		// the deques, one per worker and a last one shared by outside callers
+		std::vector<std::unique_ptr<Worker>> workers;
+		std::vector<std::thread> threads;
+		std::atomic<size_t> queued;
+		std::atomic<unsigned int> sleepers;
+		std::mutex lock;
+		std::condition_variable wake;
+		std::atomic<bool> stop;
+
+		static thread_local State * current;	// the pool and deque of a worker thread
+		static thread_local size_t self;
+
+		void push(size_t slot, const Range& range)
+		{
+			{
+				std::lock_guard<std::mutex> guard(workers[slot]->lock);
+				workers[slot]->ranges.push_back(range);
+			}
+			++queued;
+			if(sleepers)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				wake.notify_all();
+			}
+		}
+
+		// the newest range from our own deque, else the oldest from someone else's
+		bool take(size_t slot, Range& range)
+		{
+			for(size_t i = 0; i < workers.size(); ++i)
+			{
+				Worker& victim = *workers[(slot + i) % workers.size()];
+				std::lock_guard<std::mutex> guard(victim.lock);
+				if(victim.ranges.empty()) continue;
+				if(i == 0)
+				{
+					range = victim.ranges.back();
+					victim.ranges.pop_back();
+				}
+				else
+				{
+					range = victim.ranges.front();
+					victim.ranges.pop_front();
+				}
+				--queued;
+				return true;
+			}
+			return false;
+		}
+
+		bool runOne(size_t slot)
+		{
+			Range range;
+			if(!take(slot, range)) return false;
+			Batch * batch = range.batch;
+			while(range.end - range.begin > batch->grain)
+			{
+				size_t middle = range.begin + (range.end - range.begin) / 2;
+				Range rest = { batch, middle, range.end };
+				push(slot, rest);
+				range.end = middle;
+			}
+			(*batch->task)(range.begin, range.end);
+			size_t count = range.end - range.begin;
+			if(batch->remaining.fetch_sub(count) == count)
+			{
+				// the batch may be gone once its owner sees it finish, so only the pool is touched
+				std::lock_guard<std::mutex> guard(lock);
+				wake.notify_all();
+			}
+			return true;
+		}
+
+		// sleep until there is work or done() holds
+		template<typename Done>
+		void idle(Done done)
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			++sleepers;
+			wake.wait(guard, [&]() { return queued > 0 || done(); });
+			--sleepers;
+		}
+
+		void work(size_t slot)
+		{
+			current = this;
+			self = slot;
+			for(;;)
+			{
+				if(runOne(slot)) continue;
+				idle([this]() { return stop.load(); });
+				if(stop) return;
+			}
+		}
+	};
+
+	thread_local ThreadPool::State * ThreadPool::State::current = nullptr;
+	thread_local size_t ThreadPool::State::self = 0;
+
+	ThreadPool::ThreadPool(unsigned int threads) : state(new State)
+	{
+		if(threads == 0) threads = std::thread::hardware_concurrency();
+		if(threads == 0) threads = 1;
+		state->queued = 0;
+		state->sleepers = 0;
+		state->stop = false;
+		for(unsigned int i = 0; i < threads; ++i)
+		{
+			state->workers.push_back(std::unique_ptr<State::Worker>(new State::Worker));
+		}
+		for(unsigned int i = 0; i + 1 < threads; ++i)
+		{
+			state->threads.push_back(std::thread([this, i]() { state->work(i); }));
+		}
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> guard(state->lock);
+			state->stop = true;
+			state->wake.notify_all();
+		}
+		for(auto& thread : state->threads)
+		{
+			thread.join();
+		}
+	}
+
+	unsigned int ThreadPool::concurrency() const
+	{
+		return (unsigned int) state->workers.size();
+	}
+
+	void ThreadPool::run(size_t count, const Task& task, size_t grain)
+	{
+		if(count == 0) return;
+		if(grain == 0) grain = 1;
+		if(state->workers.size() == 1 || count <= grain)
+		{
+			task(0, count);
+			return;
+		}
+
+		Batch batch;
+		batch.task = &task;
+		batch.grain = grain;
+		batch.remaining = count;
+		size_t slot = State::current == state.get() ? State::self : state->workers.size() - 1;
+		Range all = { &batch, 0, count };
+		state->push(slot, all);
+		while(batch.remaining)
+		{
+			if(!state->runOne(slot)) state->idle([&batch]() { return batch.remaining == 0; });
+		}
+	}
+
+	namespace
+	{
+		ThreadPool& builtinExecutor()
+		{
+			static ThreadPool pool;
+			return pool;
+		}
+
+		std::atomic<Executor *> installedExecutor(nullptr);
+	}
+
+	Executor& defaultExecutor()
+	{
+		Executor * executor = installedExecutor;
+		return executor ? *executor : builtinExecutor();
+	}
+
+	void setDefaultExecutor(Executor * executor)
+	{
+		installedExecutor = executor;
+	}
+
+	namespace
+	{
+		// a thread count asks for a pool of that size, made on first use and then kept
+		Executor& executorFor(unsigned int threads)
+		{
+			if(threads == 0) return defaultExecutor();
+			static std::mutex lock;
+			static std::map<unsigned int, std::unique_ptr<ThreadPool>> pools;
+			std::lock_guard<std::mutex> guard(lock);
+			std::unique_ptr<ThreadPool>& pool = pools[threads];
+			if(!pool) pool.reset(new ThreadPool(threads));
+			return *pool;
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Reclaimer
+	//////////////////////////////////////////////////////////////////////////////////////
+	struct Reclaimer::State
+	{
+		std::mutex lock;
+		std::condition_variable wake;		// the thread, when there's work or it should stop
+		std::condition_variable drained;	// callers of drain()
+		std::vector<Value *> queue;
+		size_t busy;						// values taken off the queue and not yet freed
+		bool stop;
+		std::thread thread;
+
+		void run()
+		{
+#ifdef _WIN32
+			SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(SCHED_IDLE)
+			sched_param param = sched_param();
+			pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+			std::unique_lock<std::mutex> guard(lock);
+			for(;;)
+			{
+				wake.wait(guard, [this]() { return stop || !queue.empty(); });
+				if(queue.empty()) return;
+				std::vector<Value *> batch;
+				batch.swap(queue);
+				busy = batch.size();
+				guard.unlock();
+				for(Value * val : batch) delete val;
+				guard.lock();
+				busy = 0;
+				if(queue.empty()) drained.notify_all();
+			}
+		}
+	};
+
+	Reclaimer::Reclaimer() : state(new State)
+	{
+		state->busy = 0;
+		state->stop = false;
+		state->thread = std::thread([this]() { state->run(); });
+	}
+
+	Reclaimer::~Reclaimer()
+	{
+		{
+			std::lock_guard<std::mutex> guard(state->lock);
+			state->stop = true;
+			state->wake.notify_all();
+		}
+		state->thread.join();
+	}
+
+	void Reclaimer::dispose(UniqueValue val)
+	{
+		dispose(val.release());
+	}
+
+	void Reclaimer::dispose(Value * val)
+	{
+		if(!val) return;
+		std::lock_guard<std::mutex> guard(state->lock);
+		state->queue.push_back(val);
+		if(state->queue.size() == 1) state->wake.notify_one();
+	}
+
+	void Reclaimer::drain()
+	{
+		std::unique_lock<std::mutex> guard(state->lock);
+		state->drained.wait(guard, [this]() { return state->queue.empty() && state->busy == 0; });
+	}
+
+	Reclaimer& backgroundReclaimer()
+	{
+		static Reclaimer reclaimer;
+		return reclaimer;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Parallel serialisation
+	// Containers with at least grain children are cut into runs of about grain children
+	// that are serialised into their own strings on separate threads.  Large children
+	// are cut up the same way so a small root holding one huge array still spreads out.
+	// The brackets, keys and commas between runs are kept as literal pieces and the
+	// whole lot is joined in order, giving exactly the serial output.
+	//////////////////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		const unsigned int grain = 1024;
+
+		class ParallelPlan
+		{
+		public:
+			explicit ParallelPlan(const Value& root)
+			{
+				if(root.isArray() || root.isObject())
+				{
+					container(root);
+				}
+				else
+				{
+					job([&root](Writer& writer) { writer.write(root); });
+				}
+			}
+
+			// serialise every job on the executor
+			void run(Executor& executor)
+			{
+				results.assign(jobs.size(), std::string());
+				executor.run(jobs.size(), [this](size_t begin, size_t end)
+				{
+					for(size_t i = begin; i < end; ++i)
+					{
+						std::string& out = results[i];
+						Writer writer([&out](const char * data, size_t size) { out.append(data, size); return true; }, 16 * 1024);
+						jobs[i](writer);
+					}
+				});
+			}
+
+			// hand each piece of output to the sink in order
+			bool emit(const Writer::Sink& sink) const
+			{
+				for(auto& piece : pieces)
+				{
+					const std::string& text = piece.job < 0 ? piece.text : results[piece.job];
+					if(!text.empty() && !sink(text.data(), text.size())) return false;
+				}
+				return true;
+			}
+
+		private:
+			struct Piece
+			{
+				std::string text;	// literal output, unless
+				int job;			// the index of the job that produces it
+			};
+
+			static bool isLarge(const Value& val)
+			{
+				return (val.isArray() || val.isObject()) && val.size() >= grain;
+			}
+
+			void literal(const std::string& text)
+			{
+				if(pieces.empty() || pieces.back().job >= 0)
+				{
+					Piece piece = { text, -1 };
+					pieces.push_back(piece);
+				}
+				else
+				{
+					pieces.back().text += text;
+				}
+			}
+			void job(const std::function<void(Writer&)>& fn)
+			{
+				Piece piece = { std::string(), (int) jobs.size() };
+				pieces.push_back(piece);
+				jobs.push_back(fn);
+			}
+
+			// the library's own arrays and objects are split over their storage, anything
+			// else that derives from Value (e.g. StaticValue) through its interface
+			void container(const Value& val)
+			{
+				if(val.isArray())
+				{
+					array(val);
+				}
+				else if(const ObjectValue * obj = dynamic_cast<const ObjectValue *>(&val))
+				{
+					members(obj->members().begin(), obj->members().end());
+				}
+				else
+				{
+					std::vector<std::pair<std::string, const Value *> > found;
+					val.forEachMember([&found](const char * key, size_t size, const Value& member)
+					{
+						found.push_back(std::make_pair(std::string(key, size), &member));
+					});
+					gathered.push_back(std::move(found));
+					members(gathered.back().begin(), gathered.back().end());
+				}
+			}
+
+			void array(const Value& val)
+			{
+				const ArrayValue * arr = dynamic_cast<const ArrayValue *>(&val);
+				literal("[");
+				bool packed = arr && arr->isPacked();
+				unsigned int size = val.size();
+				unsigned int begin = 0;
+				for(unsigned int i = 0; i <= size; ++i)
+				{
+					// close the current run at the end, at a large child or when it is full
+					bool large = i < size && !packed && isLarge(val[i]);
+					if(i == size || large || i - begin == grain)
+					{
+						if(i > begin)
+						{
+							if(begin > 0) literal(",");
+							job([&val, arr, begin, i](Writer& writer)
+							{
+								if(arr) arr->writeRange(writer, begin, i);
+								else	for(unsigned int e = begin; e < i; ++e) val[e].write(writer);
+							});
+						}
+						begin = i;
+					}
+					if(large)
+					{
+						if(i > 0) literal(",");
+						container(val[i]);
+						begin = i + 1;
+					}
+				}
+				literal("]");
+			}
+
+			// members in key order, from an Object or a gathered list of them
+			template<typename Itr>
+			void members(Itr first, Itr last)
+			{
+				literal("{");
+				auto begin = first;
+				unsigned int count = 0;
+				for(auto itr = first; ; ++itr)
+				{
+					bool end = itr == last;
+					bool large = !end && isLarge(*itr->second);
+					if(end || large || count == grain)
+					{
+						if(count > 0)
+						{
+							if(begin != first) literal(",");
+							auto from = begin;
+							auto to = itr;
+							job([from, to](Writer& writer)
+							{
+								for(auto member = from; member != to; ++member)
+								{
+									writer.writeKey(member->first);
+									member->second->write(writer);
+								}
+							});
+						}
+						begin = itr;
+						count = 0;
+					}
+					if(end)
+					{
+						break;
+					}
+					if(large)
+					{
+						std::string key = itr != first ? "," : "";
+						{
+							Writer writer([&key](const char * data, size_t size) { key.append(data, size); return true; }, 256);
+							writer.writeKey(itr->first);
+						}
+						literal(key);
+						container(*itr->second);
+						begin = std::next(itr);
+					}
+					else
+					{
+						++count;
+					}
+				}
+				literal("}");
+			}
+
+			std::vector<Piece> pieces;
+			std::vector<std::function<void(Writer&)> > jobs;
+			std::vector<std::string> results;
+			std::deque<std::vector<std::pair<std::string, const Value *> > > gathered;	// members of objects the plan doesn't know
+		};
+
+	}
+
+	std::string toStringParallel(const Value& val, unsigned int threads)
+	{
+		return toStringParallel(val, executorFor(threads));
+	}
+	bool writeParallel(const Value& val, const Writer::Sink& sink, unsigned int threads)
+	{
+		return writeParallel(val, sink, executorFor(threads));
+	}
+	std::string toStringParallel(const Value& val, Executor& executor)
+	{
+		ParallelPlan plan(val);
+		plan.run(executor);
+		std::string rtn;
+		plan.emit([&rtn](const char * data, size_t size) { rtn.append(data, size); return true; });
+		return rtn;
+	}
+	bool writeParallel(const Value& val, const Writer::Sink& sink, Executor& executor)
+	{
+		ParallelPlan plan(val);
+		plan.run(executor);
+		return plan.emit(sink);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Implement the parser
+	//////////////////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		// lexer
+		struct Token
+		{
+			enum Type
+			{
+				eOpenObject = 0,	// {
+				eCloseObject,		// }
+				eOpenArray,			// [
+				eCloseArray,		// ]
+				eColon,				// :
+				eComma,				// ,
 				eTrue,
 				eFalse,
 				eNull,
 				eString,
-				eInt,
-				eFloat,
-				eError,
-				eEnd
+				eInt,
+				eFloat,
+				eError,
+				eEnd
+			};
+
+			Token() : type(eError) {}
+			Token(Type type) : type(type) {}
+			Token(Type type, const std::string& value) 
+				: type(type), value(value) {}
+
+			Type type;
+			std::string value;
+
+			std::string toString();
+		};
+
+		std::string Token::toString()
+		{
+			switch(type)
+			{
+			case	eOpenObject:	return "eOpenObject"; break;
+			case	eCloseObject:	return "eCloseObject"; break;
+			case	eOpenArray:		return "eOpenArray"; break;
+			case	eCloseArray:	return "eCloseArray"; break;
+			case	eColon:			return "eColon"; break;
+			case	eComma:			return "eComma"; break;
+			case	eTrue:			return "eTrue"; break;
+			case	eFalse:			return "eFalse"; break;
+			case	eNull:			return "eNull"; break;
+			case	eString:		return "eString"; break;
+			case	eInt:			return "eInt"; break;
+			case	eFloat:			return "eFloat"; break;
+			case	eError:			return "eError"; break;
+			case	eEnd:			return "eEnd"; break;
+			default: return "unknown"; break;
+			}
+		}
+
+		// acts like a generator for the tokens
+		class TokenStream
+		{
+		public:
+			TokenStream(const std::string& str)
+				: src(str)
+				, itr(src.begin())
+				, hasErrorMsg(false)
+			{}
+			bool isFinished() const;
+			void advance();
+			Token current();
+			bool hasError() const;
+			const std::string& getError() const;
+
+		private:
+			Token scanTrue();
+			Token scanFalse();
+			Token scanNull();
+			Token scanString();
+			unsigned int scanHex();
+			Token scanNumber();
+			bool isNumber();
+
+			Token next();
+			void error(const std::string& message);
+
+			Token currentToken;
+			std::string src;
+			std::string::iterator itr; // current position
+			bool hasErrorMsg;
+			std::string errorMsg;
+		};
+		// public
+		bool TokenStream::isFinished() const
+		{
+			return itr == src.end();
+		}
+		void TokenStream::advance()
+		{
+			if(!isFinished()) currentToken = next();
+		}
+		Token TokenStream::current()
+		{
+			return currentToken;
+		}
+		bool TokenStream::hasError() const
+		{
+			return hasErrorMsg;
+		}
+		const std::string& TokenStream::getError() const
+		{
+			return errorMsg;
+		}
+		// private
+		Token TokenStream::next()
+		{
+			assert(!isFinished());
+
+			Token rtn;
+			while(isspace(*itr)) ++itr;
+			switch(*itr)
+			{
+			case '{': rtn = Token(Token::eOpenObject); break;
+			case '}': rtn = Token(Token::eCloseObject); break;
+			case '[': rtn = Token(Token::eOpenArray); break;
+			case ']': rtn = Token(Token::eCloseArray); break;
+			case ':': rtn = Token(Token::eColon); break;
+			case ',': rtn = Token(Token::eComma); break;
+			case 't': rtn = scanTrue(); break;
+			case 'f': rtn = scanFalse(); break;
+			case 'n': rtn = scanNull(); break;
+			case '"': rtn = scanString(); break;
+			default:
+				if(isNumber())
+				{
+					rtn = scanNumber();
+				}
+				else
+				{
+					// TODO: log some error information here
+					rtn = Token(Token::eError);
+				}
+				break;
+			}
+			++ itr;
+			return rtn;
+		}
+		Token TokenStream::scanTrue()
+		{
+			if(*++itr == 'r' && *++itr == 'u' && *++itr == 'e')
+			{
+				return Token(Token::eTrue);
+			}
+			else
+			{
+				error("Failed to parse token: 'true'");
+				return Token(Token::eError);
+			}
+		}
+		Token TokenStream::scanFalse()
+		{
+			if(*++itr == 'a' && *++itr == 'l' && *++itr == 's' && *++itr == 'e')
+			{
+				return Token(Token::eFalse);
+			}
+			else
+			{
+				error("Failed to parse token: 'false'");
+				return Token(Token::eError);
+			}
+		}
+		Token TokenStream::scanNull()
+		{
+			if(*++itr == 'u' && *++itr == 'l' && *++itr == 'l')
+			{
+				return Token(Token::eNull);
+			}
+			else
+			{
+				error("Failed to parse token: 'null'");
+				return Token(Token::eError);
+			}
+		}
+		Token TokenStream::scanString()
+		{
+			std::string s;
+			++itr;
+			while(itr != src.end() && *itr != '"')
+			{
+				if(*itr != '\\')
+				{
+					s += *itr++;
+					continue;
+				}
+				if(++itr == src.end())
+				{
+					break;
+				}
+				switch(*itr++)
+				{
+				case '"':	s += '"'; break;
+				case '\\':	s += '\\'; break;
+				case '/':	s += '/'; break;
+				case 'b':	s += '\b'; break;
+				case 'f':	s += '\f'; break;
+				case 'n':	s += '\n'; break;
+				case 'r':	s += '\r'; break;
+				case 't':	s += '\t'; break;
+				case 'u':
+					{
+						unsigned int code = scanHex();
+						if(code >= 0xd800 && code < 0xdc00 && src.end() - itr >= 6 && itr[0] == '\\' && itr[1] == 'u')
+						{
+							itr += 2;
+							code = 0x10000 + ((code - 0xd800) << 10) + (scanHex() - 0xdc00);
+						}
+						Detail::appendUtf8(s, code);
+					}
+					break;
+				default:
+					error("Invalid escape sequence in string.");
+					return Token(Token::eError);
+				}
+			}
+			if(itr == src.end())
+			{
+				error("Reached end of characters while parsing string.");
+				--itr;
+				return Token(Token::eError);
+			}
+			return Token(Token::eString, s);
+		}
+		unsigned int TokenStream::scanHex()
+		{
+			unsigned int code = 0;
+			for(int i = 0; i < 4 && itr != src.end(); ++i, ++itr)
+			{
+				char c = *itr;
+				code <<= 4;
+				if(c >= '0' && c <= '9') code |= c - '0';
+				else if(c >= 'a' && c <= 'f') code |= c - 'a' + 10;
+				else if(c >= 'A' && c <= 'F') code |= c - 'A' + 10;
+				else error("Invalid \\u escape in string.");
+			}
+			return code;
+		}
+		Token TokenStream::scanNumber()
+		{
+			// TODO: This methood does not handle the exponential part of a number
+			bool hasDot = false;
+			std::stringstream s;
+			if(*itr == '-') 
+			{ 
+				s << '-';
+				++itr;
+			}
+			while(isdigit(*itr) || (!hasDot && *itr == '.'))
+			{
+				if(!hasDot && *itr == '.')
+				{
+					hasDot = true;
+					s << *itr;
+				}
+				else if(isdigit(*itr))
+				{
+					s << *itr;
+				}
+				else
+				{
+					error("Encountered illegal character while parsing number");
+				}
+				++itr;
+			}
+			--itr; // YUCK! try and get rid of this.
+			if(hasError())
+			{
+				return Token(Token::eError);
+			}
+			if(hasDot)
+			{
+				return Token(Token::eFloat, s.str());
+			}
+			else
+			{
+				return Token(Token::eInt, s.str());
+			}
+		}
+		bool TokenStream::isNumber()
+		{
+			return isdigit(*itr) != 0 || *itr == '-';
+		}
+		void TokenStream::error(const std::string& message)
+		{
+			errorMsg = message;
+			hasErrorMsg = true;
+		}
+
+		// builds the value tree from the parser's events
+		class TreeBuilder : public BaseHandler
+		{
+		public:
+			TreeBuilder() : root(nullptr) {}
+			~TreeBuilder()								{ delete root; }
+
+			bool null()									{ return add(newNull()); }
+			bool boolean(bool value);
+			bool integer(int value);
+			bool number(double value);
+			bool string(const char * data, size_t size)	{ return add(newString(std::string(data, size))); }
+			bool bytes(const char * data, size_t size)	{ return add(newBytes(std::string(data, size))); }	// binary formats only
+			bool key(const char * data, size_t size)	{ keys.push_back(std::string(data, size)); return true; }
+			bool startObject()							{ return push(newObject()); }
+			bool endObject()							{ stack.pop_back(); return true; }
+			bool startArray()							{ return push(newArray()); }
+			bool endArray()								{ stack.pop_back(); return true; }
+
+			// the client code owns the result
+			Value * release()							{ Value * rtn = root; root = nullptr; return rtn; }
+
+		private:
+			ArrayValue * array()						{ return !stack.empty() && stack.back()->isArray() ? static_cast<ArrayValue *>(stack.back()) : nullptr; }
+			bool add(Value * val);
+			bool push(Value * val)						{ add(val); stack.push_back(val); return true; }
+
+			Value * root;
+			std::vector<Value *> stack;		// the containers being filled
+			std::vector<std::string> keys;	// the key of each value going into an object
+		};
+		bool TreeBuilder::add(Value * val)
+		{
+			if(stack.empty())
+			{
+				root = val;
+			}
+			else if(stack.back()->isObject())
+			{
+				stack.back()->add(keys.back(), val);
+				keys.pop_back();
+			}
+			else
+			{
+				stack.back()->add(val);
+			}
+			return true;
+		}
+		// numbers and bools go straight into arrays so homogeneous arrays stay packed
+		bool TreeBuilder::boolean(bool value)
+		{
+			if(ArrayValue * arr = array()) arr->addBool(value);
+			else add(newBool(value));
+			return true;
+		}
+		bool TreeBuilder::integer(int value)
+		{
+			if(ArrayValue * arr = array()) arr->addInt(value);
+			else add(newInt(value));
+			return true;
+		}
+		bool TreeBuilder::number(double value)
+		{
+			if(ArrayValue * arr = array()) arr->addFloat((float) value);
+			else add(newFloat((float) value));
+			return true;
+		}
+	}
+
+	UniqueValue parse(const std::string& src)
+	{
+		std::string error;
+		UniqueValue rtn = parse(src, error);
+		if(!rtn)
+		{
+			// TODO: have error reporting as a switch or return somekind of error value or message on the null value
+			fprintf(stderr, "Error: %s\n", error.c_str());
+			return UniqueValue(newNull());
+		}
+		return rtn;
+	}
+	UniqueValue parse(const std::string& src, std::string& error)
+	{
+		TreeBuilder builder;
+		BasicParser<TreeBuilder> parser(builder);
+		if(!parser.parse(src))
+		{
+			error = parser.getError() + " (at offset " + std::to_string(parser.getOffset()) + ")";
+			return UniqueValue();
+		}
+		return UniqueValue(builder.release());
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Parallel parsing
+	// Outside strings a chunk's brackets and commas mean the same wherever it starts, and
+	// inside strings only quotes matter, so scanning a chunk once while counting brackets
+	// on both sides of its quotes answers for either starting state.  A backslash
+	// escapes whatever follows it; valid JSON only has them in strings, and anything
+	// invalid fails one of the element parses and goes back to the serial parser.
+	//////////////////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		const size_t minParallelParse = 1 << 20;	// smaller documents aren't worth the threads
+		const size_t minParseChunk = 64 * 1024;
+
+		struct ChunkScan
+		{
+			bool oddQuotes;		// flips the string state
+			int outsideDepth;	// depth change counting the brackets seen as outside strings
+			int insideDepth;	// and counting the others, for a chunk that starts in a string
+			bool inString;		// worked out from the chunks before
+			int depth;
+		};
+
+		// whether the character at itr is escaped, from the backslashes before it
+		bool escapedAt(const char * begin, const char * itr)
+		{
+			bool escaped = false;
+			while(itr != begin && *--itr == '\\') escaped = !escaped;
+			return escaped;
+		}
+
+		void scanChunk(const char * begin, const char * itr, const char * end, ChunkScan& scan)
+		{
+			bool escaped = escapedAt(begin, itr);
+			bool inside = false;
+			int depth[2] = { 0, 0 };
+			for(; itr != end; ++itr)
+			{
+				if(escaped)
+				{
+					escaped = false;
+					continue;
+				}
+				switch(*itr)
+				{
+				case '\\':	escaped = true; break;
+				case '"':	inside = !inside; break;
+				case '[':
+				case '{':	++depth[inside]; break;
+				case ']':
+				case '}':	--depth[inside]; break;
+				}
+			}
+			scan.oddQuotes = inside;
+			scan.outsideDepth = depth[0];
+			scan.insideDepth = depth[1];
+		}
+
+		// the first comma between elements of the top level container in [itr, end)
+		const char * firstSplit(const char * begin, const char * itr, const char * end, const ChunkScan& scan)
+		{
+			bool escaped = escapedAt(begin, itr);
+			bool inString = scan.inString;
+			int depth = scan.depth;
+			for(; itr != end; ++itr)
+			{
+				char c = *itr;
+				if(escaped)
+				{
+					escaped = false;
+				}
+				else if(inString)
+				{
+					if(c == '\\') escaped = true;
+					else if(c == '"') inString = false;
+				}
+				else if(c == '"')			inString = true;
+				else if(c == '[' || c == '{')	++depth;
+				else if(c == ']' || c == '}')	--depth;
+				else if(c == ',' && depth == 1)	return itr;
+			}
+			return nullptr;
+		}
+	}
+
+	UniqueValue parseParallel(const std::string& src, unsigned int threads)
+	{
+		return parseParallel(src, executorFor(threads));
+	}
+
+	UniqueValue parseParallel(const std::string& src, Executor& executor)
+	{
+		const char * begin = src.data();
+		const char * first = begin;
+		const char * last = begin + src.size();
+		while(first != last && Detail::isSpace(*first)) ++first;
+		while(last != first && Detail::isSpace(last[-1])) --last;
+		bool isObject = first != last && *first == '{';
+		if(src.size() < minParallelParse || executor.concurrency() < 2 || last - first < 2 ||
+			!(isObject ? last[-1] == '}' : *first == '[' && last[-1] == ']'))
+		{
+			return parse(src);
+		}
+
+		// the elements, cut into chunks
+		const char * body = first + 1;
+		const char * end = last - 1;
+		size_t length = end - body;
+		size_t chunks = std::max<size_t>(1, std::min<size_t>(executor.concurrency() * 4, length / minParseChunk));
+		size_t chunkSize = length / chunks + 1;
+		auto chunkStart = [&](size_t i) { return body + std::min(length, i * chunkSize); };
+
+		std::vector<ChunkScan> scans(chunks);
+		executor.run(chunks, [&](size_t from, size_t to)
+		{
+			for(size_t i = from; i < to; ++i) scanChunk(begin, chunkStart(i), chunkStart(i + 1), scans[i]);
+		});
+		bool inString = false;
+		int depth = 1;
+		for(auto& scan : scans)
+		{
+			scan.inString = inString;
+			scan.depth = depth;
+			depth += inString ? scan.insideDepth : scan.outsideDepth;
+			inString = inString != scan.oddQuotes;
+		}
+		if(inString || depth != 1) return parse(src);	// for the error
+
+		// runs of elements start after the first comma in each chunk
+		std::vector<const char *> splits(chunks, nullptr);
+		executor.run(chunks - 1, [&](size_t from, size_t to)
+		{
+			for(size_t i = from + 1; i <= to; ++i) splits[i] = firstSplit(begin, chunkStart(i), chunkStart(i + 1), scans[i]);
+		});
+		std::vector<const char *> starts(1, body);
+		std::vector<const char *> stops;
+		for(size_t i = 1; i < chunks; ++i)
+		{
+			if(!splits[i]) continue;
+			stops.push_back(splits[i]);
+			starts.push_back(splits[i] + 1);
+		}
+		stops.push_back(end);
+
+		std::vector<Value *> runs(starts.size(), nullptr);
+		std::atomic<bool> failed(false);
+		executor.run(runs.size(), [&](size_t from, size_t to)
+		{
+			for(size_t i = from; i < to && !failed; ++i)
+			{
+				TreeBuilder builder;
+				BasicParser<TreeBuilder> parser(builder);
+				isObject ? builder.startObject() : builder.startArray();
+				if(!parser.parseElements(starts[i], stops[i] - starts[i], isObject)) failed = true;
+				runs[i] = builder.release();
+			}
+		});
+
+		std::vector<UniqueValue> parts(runs.begin(), runs.end());
+		if(failed) return parse(src);	// for the error
+		if(!isObject)
+		{
+			// appending is linear, so one pass on this thread is as good as any
+			for(size_t i = 1; i < parts.size(); ++i) static_cast<ArrayValue&>(*parts[0]).append(static_cast<ArrayValue&>(*parts[i]));
+			return std::move(parts[0]);
+		}
+
+		// merge neighbouring objects pairwise, each round on the executor, keeping the later of any duplicate key
+		for(size_t stride = 1; stride < parts.size(); stride *= 2)
+		{
+			size_t pairs = (parts.size() - stride + 2 * stride - 1) / (2 * stride);
+			executor.run(pairs, [&](size_t from, size_t to)
+			{
+				for(size_t i = from; i < to; ++i)
+				{
+					size_t left = i * 2 * stride;
+					static_cast<ObjectValue&>(*parts[left]).merge(static_cast<ObjectValue&>(*parts[left + stride]));
+					parts[left + stride].reset();
+				}
+			});
+		}
+		return std::move(parts[0]);
+	}
+
+	std::string listTokens(const std::string& src)
+	{
+		std::stringstream ss;
+		TokenStream tokens(src);
+		while(!tokens.isFinished())
+		{
+			tokens.advance();
+			ss << tokens.current().toString() << "\n";
+
+			if(tokens.current().type == Token::eError)
+			{
+				ss << "Error: %s" << tokens.getError().c_str() << "\n";
+			}
+		}
+		return ss.str();
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Aggregates
+	// Packed arrays are reduced over their storage (SSE2 for floats, several independent
+	// accumulators for ints so the compiler can vectorise), anything else falls back to
+	// visiting each element.
+	//////////////////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		const double notANumber = std::numeric_limits<double>::quiet_NaN();
+
+		double sumOf(Span<int> ints)
+		{
+			long long acc[4] = { 0, 0, 0, 0 };
+			unsigned int i = 0;
+			for(; i + 4 <= ints.size; i += 4)
+			{
+				acc[0] += ints[i];
+				acc[1] += ints[i + 1];
+				acc[2] += ints[i + 2];
+				acc[3] += ints[i + 3];
+			}
+			for(; i < ints.size; ++i) acc[0] += ints[i];
+			return (double) (acc[0] + acc[1] + acc[2] + acc[3]);
+		}
+		double sumOf(Span<float> floats)
+		{
+			unsigned int i = 0;
+			double total = 0.0;
+#ifdef JSON_SSE2
+			// widen to doubles so long arrays don't lose precision
+			__m128d lo = _mm_setzero_pd(), hi = _mm_setzero_pd();
+			for(; i + 4 <= floats.size; i += 4)
+			{
+				__m128 v = _mm_loadu_ps(floats.data + i);
+				lo = _mm_add_pd(lo, _mm_cvtps_pd(v));
+				hi = _mm_add_pd(hi, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+			}
+			double lanes[2];
+			_mm_storeu_pd(lanes, _mm_add_pd(lo, hi));
+			total = lanes[0] + lanes[1];
+#endif
+			for(; i < floats.size; ++i) total += floats[i];
+			return total;
+		}
+
+		template<typename T, typename Pick>
+		T extremeOf(Span<T> values, Pick pick)
+		{
+			T acc[4] = { values[0], values[0], values[0], values[0] };
+			unsigned int i = 0;
+			for(; i + 4 <= values.size; i += 4)
+			{
+				acc[0] = pick(acc[0], values[i]);
+				acc[1] = pick(acc[1], values[i + 1]);
+				acc[2] = pick(acc[2], values[i + 2]);
+				acc[3] = pick(acc[3], values[i + 3]);
+			}
+			for(; i < values.size; ++i) acc[0] = pick(acc[0], values[i]);
+			return pick(pick(acc[0], acc[1]), pick(acc[2], acc[3]));
+		}
+		template<typename T> T minOf(T a, T b) { return b < a ? b : a; }
+		template<typename T> T maxOf(T a, T b) { return a < b ? b : a; }
+
+		double minOf(Span<float> floats)
+		{
+#ifdef JSON_SSE2
+			if(floats.size >= 4)
+			{
+				__m128 acc = _mm_loadu_ps(floats.data);
+				unsigned int i = 4;
+				for(; i + 4 <= floats.size; i += 4) acc = _mm_min_ps(acc, _mm_loadu_ps(floats.data + i));
+				float lanes[4];
+				_mm_storeu_ps(lanes, acc);
+				float rtn = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+				for(; i < floats.size; ++i) rtn = std::min(rtn, floats[i]);
+				return rtn;
+			}
+#endif
+			return extremeOf(floats, minOf<float>);
+		}
+		double maxOf(Span<float> floats)
+		{
+#ifdef JSON_SSE2
+			if(floats.size >= 4)
+			{
+				__m128 acc = _mm_loadu_ps(floats.data);
+				unsigned int i = 4;
+				for(; i + 4 <= floats.size; i += 4) acc = _mm_max_ps(acc, _mm_loadu_ps(floats.data + i));
+				float lanes[4];
+				_mm_storeu_ps(lanes, acc);
+				float rtn = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+				for(; i < floats.size; ++i) rtn = std::max(rtn, floats[i]);
+				return rtn;
+			}
+#endif
+			return extremeOf(floats, maxOf<float>);
+		}
+
+		// visit the numbers of an array that isn't packed
+		template<typename F>
+		void eachNumber(const Value& array, F f)
+		{
+			// packed ints and floats were reduced already, so this holds only bools
+			const ArrayValue * arr = dynamic_cast<const ArrayValue *>(&array);
+			if(arr && arr->isPacked()) return;
+
+			forEachElement(array, [&f](const Value& val)
+			{
+				if(val.isInt()) f((double) val.asInt());
+				else if(val.isFloat()) f((double) val.asFloat());
+			});
+		}
+	}
+
+	unsigned int count(const Value& array)
+	{
+		if(!array.asIntSpan().empty()) return array.asIntSpan().size;
+		if(!array.asFloatSpan().empty()) return array.asFloatSpan().size;
+		unsigned int n = 0;
+		eachNumber(array, [&n](double) { ++n; });
+		return n;
+	}
+	double sum(const Value& array)
+	{
+		if(!array.asIntSpan().empty()) return sumOf(array.asIntSpan());
+		if(!array.asFloatSpan().empty()) return sumOf(array.asFloatSpan());
+		double total = 0.0;
+		eachNumber(array, [&total](double val) { total += val; });
+		return total;
+	}
+	double minimum(const Value& array)
+	{
+		if(!array.asIntSpan().empty()) return extremeOf(array.asIntSpan(), minOf<int>);
+		if(!array.asFloatSpan().empty()) return minOf(array.asFloatSpan());
+		double rtn = notANumber;
+		eachNumber(array, [&rtn](double val) { if(!(rtn <= val)) rtn = val; });
+		return rtn;
+	}
+	double maximum(const Value& array)
+	{
+		if(!array.asIntSpan().empty()) return extremeOf(array.asIntSpan(), maxOf<int>);
+		if(!array.asFloatSpan().empty()) return maxOf(array.asFloatSpan());
+		double rtn = notANumber;
+		eachNumber(array, [&rtn](double val) { if(!(rtn >= val)) rtn = val; });
+		return rtn;
+	}
+	double mean(const Value& array)
+	{
+		unsigned int n = count(array);
+		return n == 0 ? notANumber : sum(array) / n;
+	}
+	std::vector<unsigned int> histogram(const Value& array, double lo, double hi, unsigned int buckets)
+	{
+		std::vector<unsigned int> rtn(buckets, 0);
+		if(buckets == 0 || !(lo < hi))
+		{
+			return rtn;
+		}
+		const double scale = buckets / (hi - lo);
+		auto bucket = [&](double val)
+		{
+			if(val < lo || val > hi) return;
+			unsigned int i = (unsigned int) ((val - lo) * scale);
+			++rtn[i < buckets ? i : buckets - 1];
+		};
+		if(!array.asIntSpan().empty())
+		{
+			for(int val : array.asIntSpan()) bucket(val);
+		}
+		else if(!array.asFloatSpan().empty())
+		{
+			for(float val : array.asFloatSpan()) bucket(val);
+		}
+		else
+		{
+			eachNumber(array, bucket);
+		}
+		return rtn;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Literals
+	// Parsed documents are kept by the address of their text.
+	//////////////////////////////////////////////////////////////////////////////////////
+	void Detail::invalidJsonLiteral(const char * text, size_t size)
+	{
+		fprintf(stderr, "Error: invalid JSON literal %.*s\n", (int) size, text);
+		abort();
+	}
+
+	namespace
+	{
+		// literal documents by the address of their text, which has static storage
+		struct LiteralSlot
+		{
+			std::atomic<const char *> text;
+			std::atomic<const Value *> doc;
+		};
+		const size_t literalSlots = 1024;
+		const size_t literalProbes = 16;	// past this a literal goes in the locked map
+		LiteralSlot literals[literalSlots];
+
+		Value * parseLiteral(const char * text, size_t size)
+		{
+			UniqueValue doc = parse(std::string(text, size));
+			return doc ? doc.release() : newNull();
+		}
+	}
+
+	const Value& Literal::value() const
+	{
+		// a literal claims the first empty slot it probes, so a lookup ends there at the latest
+		size_t hash = (size_t) text / 8 * 2654435761u;
+		for(size_t probe = 0; probe < literalProbes; ++probe)
+		{
+			LiteralSlot& slot = literals[(hash + probe) % literalSlots];
+			const char * found = slot.text.load(std::memory_order_acquire);
+			if(!found && slot.text.compare_exchange_strong(found, text, std::memory_order_acq_rel, std::memory_order_acquire)) found = text;
+			if(found != text) continue;
+
+			// two threads may both parse the first time, the one that publishes second lets go
+			const Value * doc = slot.doc.load(std::memory_order_acquire);
+			if(doc) return *doc;
+			UniqueValue parsed(parseLiteral(text, size));
+			if(slot.doc.compare_exchange_strong(doc, parsed.get(), std::memory_order_acq_rel, std::memory_order_acquire)) doc = parsed.release();
+			return *doc;
+		}
+
+		// slots are never freed, so a literal that isn't within its probes is in here
+		static std::mutex lock;
+		static std::map<const char *, UniqueValue> documents;
+		std::lock_guard<std::mutex> guard(lock);
+		UniqueValue& doc = documents[text];
+		if(!doc) doc.reset(parseLiteral(text, size));
+		return *doc;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Static values
+	//////////////////////////////////////////////////////////////////////////////////////
+	StaticValue::~StaticValue()
+	{
+		delete cache.load();
+	}
+	int StaticValue::asInt() const
+	{
+		assert(type == eInt);
+		return integer;
+	}
+	float StaticValue::asFloat() const
+	{
+		assert(type == eFloat);
+		return real;
+	}
+	bool StaticValue::asBool() const
+	{
+		assert(type == eBool);
+		return boolean;
+	}
+	const std::string& StaticValue::asString() const
+	{
+		assert(type == eString);
+		std::string * str = cache.load();
+		if(!str)
+		{
+			// racing readers may both build it, only one gets kept
+			std::string * made = new std::string(text.data, text.size);
+			if(cache.compare_exchange_strong(str, made)) str = made;
+			else delete made;
+		}
+		return *str;
+	}
+	const Value& StaticValue::get(const std::string& name) const
+	{
+		assert(type == eObject);
+		// members are sorted by key
+		const StaticValue * first = children.first;
+		size_t count = children.count;
+		while(count > 0)
+		{
+			size_t half = count / 2;
+			const StaticValue& mid = first[half];
+			int order = memcmp(mid.key.data, name.data(), std::min<size_t>(mid.key.size, name.size()));
+			if(order == 0) order = mid.key.size < name.size() ? -1 : mid.key.size > name.size() ? 1 : 0;
+			if(order == 0) return mid;
+			if(order < 0)
+			{
+				first += half + 1;
+				count -= half + 1;
+			}
+			else
+			{
+				count = half;
+			}
+		}
+		return theNullValue;
+	}
+	unsigned int StaticValue::size() const
+	{
+		assert(type == eObject || type == eArray);
+		return children.count;
+	}
+	void StaticValue::forEachMember(const MemberVisitor& visit) const
+	{
+		assert(type == eObject);
+		for(unsigned int i = 0; i < children.count; ++i)
+		{
+			visit(children.first[i].key.data, children.first[i].key.size, children.first[i]);
+		}
+	}
+	void StaticValue::write(Writer& writer) const
+	{
+		switch(type)
+		{
+		case eNull:		writer.writeNull(); break;
+		case eBool:		writer.writeBool(boolean); break;
+		case eInt:		writer.writeInt(integer); break;
+		case eFloat:	writer.writeFloat(real); break;
+		case eString:	writer.writeString(text.data, text.size); break;
+		case eObject:
+			writer.startObject();
+			for(unsigned int i = 0; i < children.count; ++i)
+			{
+				writer.writeKey(children.first[i].key.data, children.first[i].key.size);
+				children.first[i].write(writer);
+			}
+			writer.endObject();
+			break;
+		case eArray:
+			writer.startArray();
+			for(unsigned int i = 0; i < children.count; ++i)
+			{
+				children.first[i].write(writer);
+			}
+			writer.endArray();
+			break;
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Code generator
+	// Nodes are laid out breadth first so the children of each container are consecutive,
+	// and every string and key goes into one table (repeats are stored once).  The table
+	// is written as a list of bytes because compilers cap the length of string literals.
+	//////////////////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		class SourceGenerator
+		{
+		public:
+			std::string generate(const Value& root, const std::string& name)
+			{
+				std::vector<Node> nodes;
+				nodes.push_back(Node(&root, std::string(), false));
+				for(size_t i = 0; i < nodes.size(); ++i)
+				{
+					// children go on the end of the list, right after any earlier container's
+					if(!nodes[i].val) continue;
+					const Value& val = *nodes[i].val;
+					nodes[i].first = nodes.size();
+					if(val.isObject())
+					{
+						val.forEachMember([&nodes](const char * key, size_t size, const Value& member)
+						{
+							nodes.push_back(Node(&member, std::string(key, size), true));
+						});
+					}
+					else if(val.isArray())
+					{
+						forEachElement(val, [&nodes](const Value& element)
+						{
+							// packed elements only last for the call, so numbers are written out now
+							if(isLeaf(element))	nodes.push_back(Node(nullptr, std::string(), false, leaf(element)));
+							else				nodes.push_back(Node(&element, std::string(), false));
+						});
+					}
+				}
+
+				std::stringstream body;
+				for(auto& node : nodes)
+				{
+					// braces construct each element in place, StaticValue can't be copied
+					body << "\t\t{ " << (node.hasKey ? key(node.key) : std::string("K{ nullptr, 0 }"));
+					const Value& val = node.val ? *node.val : theNullValue;
+					if(!node.val)			body << node.leaf;
+					else if(isLeaf(val))	body << leaf(val);
+					else if(val.isString())	body << ", strings + " << intern(val.asString()) << ", " << val.asString().size() << " }";
+					else if(val.isBytes())	body << ", strings + " << intern(base64url(val.asBytes())) << ", " << base64url(val.asBytes()).size() << " }";	// as its JSON text
+					else					body << ", V::" << (val.isObject() ? "eObject" : "eArray") << ", nodes + " << node.first << ", " << val.size() << " }";
+					body << ",\n";
+				}
+
+				std::stringstream out;
+				out << "// generated by jsonc, do not edit\n"
+					<< "#include \"Json.h\"\n\n"
+					<< "namespace\n{\n"
+					<< "\ttypedef Json::StaticValue V;\n"
+					<< "\ttypedef Json::StaticValue::Key K;\n\n"
+					<< "\tconst char strings[] =\n\t{";
+				for(size_t i = 0; i < table.size(); ++i)
+				{
+					out << (i % 24 == 0 ? "\n\t\t" : " ") << (int) (unsigned char) table[i] << ",";
+				}
+				out << (table.empty() ? "0" : "") << "\n\t};\n\n"
+					<< "\textern const V nodes[];\n"
+					<< "\tconst V nodes[] =\n\t{\n" << body.str() << "\t};\n}\n\n"
+					<< "const Json::Value& " << name << "()\n{\n\treturn nodes[0];\n}\n";
+				return out.str();
+			}
+
+		private:
+			struct Node
+			{
+				Node(const Value * val, const std::string& key, bool hasKey, const std::string& leaf = std::string()) : val(val), key(key), hasKey(hasKey), first(0), leaf(leaf) {}
+				const Value * val;	// null for an element of a packed array
+				std::string key;
+				bool hasKey;
+				size_t first;
+				std::string leaf;	// otherwise what follows the key
+			};
+
+			static bool isLeaf(const Value& val)
+			{
+				return val.isNull() || val.isBool() || val.isInt() || val.isFloat();
+			}
+			static std::string leaf(const Value& val)
+			{
+				if(val.isBool())	return std::string(", ") + (val.asBool() ? "true" : "false") + " }";
+				if(val.isInt())		return ", " + integer(val.asInt()) + " }";
+				if(val.isFloat())	return ", " + real(val.asFloat()) + " }";
+				return " }";
+			}
+
+			size_t intern(const std::string& str)
+			{
+				auto found = offsets.find(str);
+				if(found != offsets.end()) return found->second;
+				size_t offset = table.size();
+				table += str;
+				offsets[str] = offset;
+				return offset;
+			}
+			std::string key(const std::string& str)
+			{
+				std::stringstream ss;
+				ss << "K{ strings + " << intern(str) << ", " << str.size() << " }";
+				return ss.str();
+			}
+			static std::string integer(int val)
+			{
+				// -2147483648 would be a long, which is ambiguous between the constructors
+				return val == INT_MIN ? "(-2147483647 - 1)" : std::to_string(val);
+			}
+			static std::string real(float val)
+			{
+				char text[32];
+				sprintf(text, "%.9g", val);
+				std::string rtn = text;
+				if(rtn.find_first_of(".en") == std::string::npos) rtn += ".0";
+				return rtn + "f";
+			}
+
+			std::string table;
+			std::map<std::string, size_t> offsets;
+		};
+	}
+
+	std::string generateSource(const Value& val, const std::string& name)
+	{
+		return SourceGenerator().generate(val, name);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Snapshots
+	// The file is a header, then one record per node in breadth first order (so the
+	// children of a container are consecutive), then the hash slots of the objects with
+	// more than a few members, then the string table holding every string and key once.
+	//////////////////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		const char snapshotMagic[4] = { 'J', 'S', 'N', 'P' };
+		const unsigned int snapshotOrder = 0x01020304;		// reads differently on a machine of the other byte order
+		const unsigned int snapshotVersion = 1;
+		const unsigned int indexedMembers = 8;				// smaller objects are searched in order
+		const unsigned int noIndex = 0xffffffff;
+
+		struct SnapshotHeader
+		{
+			char magic[4];
+			unsigned int order;
+			unsigned int version;
+			unsigned int nodes;
+			unsigned int indexes;
+			unsigned int strings;
+		};
+
+		// scalars keep their value in a, strings are at offset a for b bytes, containers
+		// have b children from node a and objects with a hash index have its first slot in c
+		struct SnapshotRecord
+		{
+			unsigned int type;			// StaticValue::Type
+			unsigned int a;
+			unsigned int b;
+			unsigned int c;
+			unsigned int keyOffset;
+			unsigned int keySize;
+		};
+
+		unsigned int hashKey(const char * key, size_t size)
+		{
+			// FNV-1a
+			unsigned int hash = 2166136261u;
+			for(size_t i = 0; i < size; ++i)
+			{
+				hash = (hash ^ (unsigned char) key[i]) * 16777619u;
+			}
+			return hash;
+		}
+
+		// slots for an object with count members, a power of two at most half full
+		unsigned int indexSlots(unsigned int count)
+		{
+			unsigned int slots = 16;
+			while(slots < count * 2) slots *= 2;
+			return slots;
+		}
+
+		class SnapshotBuilder
+		{
+		public:
+			explicit SnapshotBuilder(const Value& root)
+			{
+				std::vector<const Value *> values(1, &root);
+				records.resize(1);
+				for(size_t i = 0; i < values.size(); ++i)
+				{
+					// leaves held in packed arrays were recorded with their parent
+					if(!values[i]) continue;
+
+					// adding children moves the records, so this one is filled in by value
+					const Value& val = *values[i];
+					SnapshotRecord rec = records[i];
+					if(val.isObject())
+					{
+						rec.type = StaticValue::eObject;
+						rec.a = (unsigned int) values.size();
+						rec.b = val.size();
+						rec.c = noIndex;
+						val.forEachMember([this, &values](const char * key, size_t size, const Value& member)
+						{
+							SnapshotRecord child = SnapshotRecord();
+							child.keyOffset = intern(key, size);
+							child.keySize = (unsigned int) size;
+							records.push_back(child);
+							values.push_back(&member);
+						});
+					}
+					else if(val.isArray())
+					{
+						rec.type = StaticValue::eArray;
+						rec.a = (unsigned int) values.size();
+						rec.b = val.size();
+						forEachElement(val, [this, &values](const Value& element)
+						{
+							bool container = element.isObject() || element.isArray();
+							records.push_back(SnapshotRecord());
+							if(!container) leaf(element, records.back());
+							values.push_back(container ? &element : nullptr);
+						});
+					}
+					else
+					{
+						leaf(val, rec);
+					}
+					records[i] = rec;
+					if(rec.type == StaticValue::eObject && rec.b > indexedMembers) index(i);
+				}
+
+				memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+				header.order = snapshotOrder;
+				header.version = snapshotVersion;
+				header.nodes = (unsigned int) records.size();
+				header.indexes = (unsigned int) slots.size();
+				header.strings = (unsigned int) table.size();
+			}
+
+			const SnapshotHeader& getHeader() const		{ return header; }
+			size_t size() const
+			{
+				return sizeof(header) + records.size() * sizeof(SnapshotRecord) + slots.size() * sizeof(unsigned int) + table.size();
+			}
+
+			// the same bytes as the file
+			void copyTo(char * out) const
+			{
+				// an empty vector's data() may be null, which memcpy mustn't be given
+				memcpy(out, &header, sizeof(header));
+				out += sizeof(header);
+				if(!records.empty()) memcpy(out, records.data(), records.size() * sizeof(SnapshotRecord));
+				out += records.size() * sizeof(SnapshotRecord);
+				if(!slots.empty()) memcpy(out, slots.data(), slots.size() * sizeof(unsigned int));
+				out += slots.size() * sizeof(unsigned int);
+				if(!table.empty()) memcpy(out, table.data(), table.size());
+			}
+
+			bool save(const std::string& path) const
+			{
+				FILE * file = fopen(path.c_str(), "wb");
+				if(!file) return false;
+				// as in copyTo, empty sections aren't handed over
+				bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+					&& (records.empty() || fwrite(records.data(), sizeof(SnapshotRecord), records.size(), file) == records.size())
+					&& (slots.empty() || fwrite(slots.data(), sizeof(unsigned int), slots.size(), file) == slots.size())
+					&& (table.empty() || fwrite(table.data(), 1, table.size(), file) == table.size());
+				return fclose(file) == 0 && ok;
+			}
+
+		private:
+			void leaf(const Value& val, SnapshotRecord& rec)
+			{
+				if(val.isString())
+				{
+					rec.type = StaticValue::eString;
+					rec.a = intern(val.asString().data(), val.asString().size());
+					rec.b = (unsigned int) val.asString().size();
+				}
+				else if(val.isBytes())
+				{
+					// as its JSON text
+					std::string text = base64url(val.asBytes());
+					rec.type = StaticValue::eString;
+					rec.a = intern(text.data(), text.size());
+					rec.b = (unsigned int) text.size();
+				}
+				else if(val.isInt())
+				{
+					rec.type = StaticValue::eInt;
+					int integer = val.asInt();
+					memcpy(&rec.a, &integer, sizeof(integer));
+				}
+				else if(val.isFloat())
+				{
+					rec.type = StaticValue::eFloat;
+					float real = val.asFloat();
+					memcpy(&rec.a, &real, sizeof(real));
+				}
+				else if(val.isBool())
+				{
+					rec.type = StaticValue::eBool;
+					rec.a = val.asBool() ? 1 : 0;
+				}
+				else
+				{
+					rec.type = StaticValue::eNull;
+				}
+			}
+
+			// the members have been added, so their keys are in the table
+			void index(size_t object)
+			{
+				SnapshotRecord& rec = records[object];
+				unsigned int count = indexSlots(rec.b);
+				rec.c = (unsigned int) slots.size();
+				slots.resize(slots.size() + count, 0);
+				for(unsigned int m = rec.a; m < rec.a + rec.b; ++m)
+				{
+					unsigned int slot = hashKey(&table[records[m].keyOffset], records[m].keySize) & (count - 1);
+					while(slots[rec.c + slot] != 0) slot = (slot + 1) & (count - 1);
+					slots[rec.c + slot] = m + 1;
+				}
+			}
+
+			unsigned int intern(const char * str, size_t size)
+			{
+				std::string key(str, size);
+				auto found = offsets.find(key);
+				if(found != offsets.end()) return found->second;
+				unsigned int offset = (unsigned int) table.size();
+				table += key;
+				offsets[key] = offset;
+				return offset;
+			}
+
+			SnapshotHeader header;
+			std::vector<SnapshotRecord> records;
+			std::vector<unsigned int> slots;
+			std::string table;
+			std::map<std::string, unsigned int> offsets;
+		};
+	}
+
+	bool saveSnapshot(const Value& val, const std::string& path)
+	{
+		return SnapshotBuilder(val).save(path);
+	}
+
+	std::unique_ptr<Snapshot> freeze(const Value& val)
+	{
+		SnapshotBuilder builder(val);
+		std::unique_ptr<Snapshot> snapshot(new Snapshot());
+		snapshot->memory.reset(new char[builder.size()]);
+		builder.copyTo(snapshot->memory.get());
+		snapshot->base = snapshot->memory.get();
+		snapshot->length = builder.size();
+		snapshot->nodes = builder.getHeader().nodes;
+		snapshot->indexes = builder.getHeader().indexes;
+		snapshot->strings = builder.getHeader().strings;
+		return snapshot;
+	}
+
+	std::unique_ptr<Snapshot> openSnapshot(const std::string& path)
+	{
+		std::unique_ptr<Snapshot> snapshot(new Snapshot());
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if(file == INVALID_HANDLE_VALUE)
+		{
+			fprintf(stderr, "Error: can't open snapshot %s\n", path.c_str());
+			return nullptr;
+		}
+		LARGE_INTEGER size;
+		if(GetFileSizeEx(file, &size) && size.QuadPart >= (LONGLONG) sizeof(SnapshotHeader))
+		{
+			snapshot->length = (size_t) size.QuadPart;
+			snapshot->mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if(snapshot->mapping) snapshot->base = (const char *) MapViewOfFile(snapshot->mapping, FILE_MAP_READ, 0, 0, 0);
+		}
+		CloseHandle(file);
+#else
+		int fd = open(path.c_str(), O_RDONLY);
+		if(fd < 0)
+		{
+			fprintf(stderr, "Error: can't open snapshot %s\n", path.c_str());
+			return nullptr;
+		}
+		struct stat info;
+		if(fstat(fd, &info) == 0 && info.st_size >= (off_t) sizeof(SnapshotHeader))
+		{
+			void * base = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(base != MAP_FAILED)
+			{
+				snapshot->base = (const char *) base;
+				snapshot->length = (size_t) info.st_size;
+			}
+		}
+		close(fd);
+#endif
+		if(!snapshot->base)
+		{
+			fprintf(stderr, "Error: can't map snapshot %s\n", path.c_str());
+			return nullptr;
+		}
+
+		const SnapshotHeader& header = *(const SnapshotHeader *) snapshot->base;
+		unsigned long long expected = sizeof(SnapshotHeader) + (unsigned long long) header.nodes * sizeof(SnapshotRecord)
+			+ (unsigned long long) header.indexes * sizeof(unsigned int) + header.strings;
+		if(memcmp(header.magic, snapshotMagic, sizeof(header.magic)) != 0 || header.order != snapshotOrder
+			|| header.version != snapshotVersion || header.nodes == 0 || expected != snapshot->length)
+		{
+			fprintf(stderr, "Error: %s is not a snapshot this build can read\n", path.c_str());
+			return nullptr;
+		}
+		snapshot->nodes = header.nodes;
+		snapshot->indexes = header.indexes;
+		snapshot->strings = header.strings;
+		return snapshot;
+	}
+
+	Snapshot::~Snapshot()
+	{
+		if(!base || memory) return;
+#ifdef _WIN32
+		UnmapViewOfFile(base);
+		CloseHandle(mapping);
+#else
+		munmap(const_cast<char *>(base), length);
+#endif
+	}
+
+	namespace
+	{
+		// the parts of a mapped snapshot, the header has already been checked
+		const SnapshotRecord& recordAt(const char * base, unsigned int index)
+		{
+			return ((const SnapshotRecord *) (base + sizeof(SnapshotHeader)))[index];
+		}
+		const unsigned int * slotsOf(const char * base, unsigned int nodes)
+		{
+			return (const unsigned int *) (base + sizeof(SnapshotHeader) + nodes * sizeof(SnapshotRecord));
+		}
+		Span<char> textAt(const char * table, unsigned int tableSize, unsigned int offset, unsigned int size)
+		{
+			// a damaged file gives empty strings rather than reads outside the mapping
+			if(offset > tableSize || size > tableSize - offset) return Span<char>();
+			return Span<char>(table + offset, size);
+		}
+	}
+
+	// nodes without a snapshot are the null nodes handed out for missing children
+	bool SnapshotNode::isInt() const		{ return snapshot && recordAt(snapshot->base, index).type == StaticValue::eInt; }
+	bool SnapshotNode::isFloat() const		{ return snapshot && recordAt(snapshot->base, index).type == StaticValue::eFloat; }
+	bool SnapshotNode::isString() const		{ return snapshot && recordAt(snapshot->base, index).type == StaticValue::eString; }
+	bool SnapshotNode::isBool() const		{ return snapshot && recordAt(snapshot->base, index).type == StaticValue::eBool; }
+	bool SnapshotNode::isNull() const		{ return !snapshot || recordAt(snapshot->base, index).type == StaticValue::eNull; }
+	bool SnapshotNode::isObject() const		{ return snapshot && recordAt(snapshot->base, index).type == StaticValue::eObject; }
+	bool SnapshotNode::isArray() const		{ return snapshot && recordAt(snapshot->base, index).type == StaticValue::eArray; }
+
+	int SnapshotNode::asInt() const
+	{
+		assert(isInt());
+		int integer;
+		memcpy(&integer, &recordAt(snapshot->base, index).a, sizeof(integer));
+		return integer;
+	}
+	float SnapshotNode::asFloat() const
+	{
+		assert(isFloat());
+		float real;
+		memcpy(&real, &recordAt(snapshot->base, index).a, sizeof(real));
+		return real;
+	}
+	bool SnapshotNode::asBool() const
+	{
+		assert(isBool());
+		return recordAt(snapshot->base, index).a != 0;
+	}
+	Span<char> SnapshotNode::asText() const
+	{
+		assert(isString());
+		const SnapshotRecord& rec = recordAt(snapshot->base, index);
+		return textAt(snapshot->base + snapshot->length - snapshot->strings, snapshot->strings, rec.a, rec.b);
+	}
+	std::string SnapshotNode::asString() const
+	{
+		Span<char> text = asText();
+		return std::string(text.data, text.size);
+	}
+	Span<char> SnapshotNode::key() const
+	{
+		if(!snapshot) return Span<char>();
+		const SnapshotRecord& rec = recordAt(snapshot->base, index);
+		return textAt(snapshot->base + snapshot->length - snapshot->strings, snapshot->strings, rec.keyOffset, rec.keySize);
+	}
+
+	unsigned int SnapshotNode::size() const
+	{
+		assert(isObject() || isArray());
+		return recordAt(snapshot->base, index).b;
+	}
+
+	SnapshotNode SnapshotNode::operator[](unsigned int i) const
+	{
+		if(!isArray() && !isObject()) return SnapshotNode();
+		// children are laid out after their parent, so in a damaged file that points back
+		// at an ancestor they are missing rather than a cycle
+		const SnapshotRecord& rec = recordAt(snapshot->base, index);
+		if(i >= rec.b || rec.a <= index || rec.a >= snapshot->nodes || i >= snapshot->nodes - rec.a) return SnapshotNode();
+		return SnapshotNode(snapshot, rec.a + i);
+	}
+
+	SnapshotNode SnapshotNode::get(const std::string& name) const
+	{
+		if(!isObject()) return SnapshotNode();
+		const SnapshotRecord& rec = recordAt(snapshot->base, index);
+		if(rec.a <= index || rec.a >= snapshot->nodes || rec.b > snapshot->nodes - rec.a) return SnapshotNode();
+
+		auto matches = [this, &name](unsigned int member)
+		{
+			Span<char> key = SnapshotNode(snapshot, member).key();
+			return key.size == name.size() && memcmp(key.data, name.data(), key.size) == 0;
+		};
+
+		unsigned int count = indexSlots(rec.b);
+		if(rec.c == noIndex || rec.c > snapshot->indexes || count > snapshot->indexes - rec.c)
+		{
+			for(unsigned int m = rec.a; m < rec.a + rec.b; ++m)
+			{
+				if(matches(m)) return SnapshotNode(snapshot, m);
+			}
+			return SnapshotNode();
+		}
+
+		const unsigned int * slots = slotsOf(snapshot->base, snapshot->nodes) + rec.c;
+		unsigned int slot = hashKey(name.data(), name.size()) & (count - 1);
+		for(unsigned int probes = 0; probes < count && slots[slot] != 0; ++probes)
+		{
+			unsigned int member = slots[slot] - 1;
+			if(member >= rec.a && member < rec.a + rec.b && matches(member)) return SnapshotNode(snapshot, member);
+			slot = (slot + 1) & (count - 1);
+		}
+		return SnapshotNode();
+	}
+
+	void SnapshotNode::write(Writer& writer) const
+	{
+		if(isObject())
+		{
+			writer.startObject();
+			for(unsigned int i = 0; i < size(); ++i)
+			{
+				SnapshotNode member = (*this)[i];
+				Span<char> name = member.key();
+				writer.writeKey(name.data, name.size);
+				member.write(writer);
+			}
+			writer.endObject();
+		}
+		else if(isArray())
+		{
+			writer.startArray();
+			for(unsigned int i = 0; i < size(); ++i)
+			{
+				(*this)[i].write(writer);
+			}
+			writer.endArray();
+		}
+		else if(isString())
+		{
+			Span<char> text = asText();
+			writer.writeString(text.data, text.size);
+		}
+		else if(isInt())	writer.writeInt(asInt());
+		else if(isFloat())	writer.writeFloat(asFloat());
+		else if(isBool())	writer.writeBool(asBool());
+		else				writer.writeNull();
+	}
+
+	std::string SnapshotNode::toString() const
+	{
+		std::string rtn;
+		{
+			Writer writer([&rtn](const char * data, size_t size) { rtn.append(data, size); return true; }, 256);
+			write(writer);
+		}
+		return rtn;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Shared snapshots
+	// Epoch based reclamation.  Readers are counted in one of three buckets by the epoch
+	// they entered in, and a snapshot replaced during epoch e is freed once the epoch has
+	// reached e + 2.  The epoch only moves on from e when the bucket for e - 1 is empty,
+	// so by then every reader that entered while the old snapshot was current has left.
+	//////////////////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		const unsigned int readerStripes = 32;
+
+		struct ReaderCount
+		{
+			std::atomic<unsigned int> count;
+			char padding[64 - sizeof(std::atomic<unsigned int>)];	// a cache line each
+		};
+
+		// spreads threads over the stripes
+		unsigned int readerStripe()
+		{
+			static std::atomic<unsigned int> next(0);
+			static thread_local unsigned int stripe = next++ % readerStripes;
+			return stripe;
+		}
+
+		// the readers and the replaced objects of one shared pointer
+		class Epochs
+		{
+		public:
+			Epochs() : epoch(0)
+			{
+				for(auto& bucket : readers)
+				{
+					for(auto& stripe : bucket) stripe.count = 0;
+				}
+			}
+			~Epochs()	// no readers are left
+			{
+				for(auto& old : retired) old.destroy();
+			}
+
+			// counts the reader in, returns the count to decrement when it leaves
+			std::atomic<unsigned int> * enter()
+			{
+				unsigned int stripe = readerStripe();
+				for(;;)
+				{
+					// the epoch is checked again so a reader is only counted in its current bucket
+					unsigned long long now = epoch;
+					std::atomic<unsigned int> * counter = &readers[now % 3][stripe].count;
+					++*counter;
+					if(epoch == now) return counter;
+					--*counter;
+				}
+			}
+
+			// destroy is called once no reader can still see what was replaced
+			void retire(const std::function<void()>& destroy)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				Retired old = { destroy, epoch };
+				retired.push_back(old);
+			}
+
+			// frees what it can, returns how many are left
+			size_t collect()
+			{
+				std::lock_guard<std::mutex> guard(lock);
+
+				// two steps are all the oldest can need
+				for(int step = 0; step < 2; ++step)
+				{
+					unsigned long long now = epoch;
+					if(!empty((now + 2) % 3)) break;	// readers from the epoch before
+					epoch = now + 1;
+				}
+				unsigned long long now = epoch;
+				auto kept = std::remove_if(retired.begin(), retired.end(), [now](const Retired& old)
+				{
+					if(old.epoch + 2 > now) return false;
+					old.destroy();
+					return true;
+				});
+				retired.erase(kept, retired.end());
+				return retired.size();
+			}
+
+		private:
+			struct Retired
+			{
+				std::function<void()> destroy;
+				unsigned long long epoch;
+			};
+
+			bool empty(unsigned int bucket) const
+			{
+				for(auto& stripe : readers[bucket])
+				{
+					if(stripe.count) return false;
+				}
+				return true;
+			}
+
+			std::atomic<unsigned long long> epoch;
+			ReaderCount readers[3][readerStripes];
+			std::mutex lock;
+			std::vector<Retired> retired;
+		};
+	}
+
+	struct SharedSnapshot::State
+	{
+		std::atomic<const Snapshot *> current;
+		Epochs epochs;
+	};
+
+	SharedSnapshot::ReadGuard::ReadGuard(State * state) : state(state), counter(state->epochs.enter()), snapshot(state->current)
+	{
+	}
+
+	SharedSnapshot::ReadGuard::ReadGuard(ReadGuard&& other) : state(other.state), counter(other.counter), snapshot(other.snapshot)
+	{
+		other.counter = nullptr;
+	}
+
+	SharedSnapshot::ReadGuard::~ReadGuard()
+	{
+		if(counter) --*counter;
+	}
+
+	SharedSnapshot::SharedSnapshot(std::unique_ptr<Snapshot> snapshot) : state(new State)
+	{
+		state->current = snapshot.release();
+	}
+
+	SharedSnapshot::~SharedSnapshot()
+	{
+		delete state->current.load();
+	}
+
+	SharedSnapshot::ReadGuard SharedSnapshot::read() const
+	{
+		return ReadGuard(state.get());
+	}
+
+	void SharedSnapshot::publish(std::unique_ptr<Snapshot> snapshot)
+	{
+		const Snapshot * old = state->current.exchange(snapshot.release());
+		if(old) state->epochs.retire([old]() { delete old; });
+		state->epochs.collect();
+	}
+
+	size_t SharedSnapshot::reclaim()
+	{
+		return state->epochs.collect();
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// MessagePack
+	//////////////////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		// appends MessagePack, multi-byte numbers are big endian
+		class MsgPackOut
+		{
+		public:
+			explicit MsgPackOut(std::string& out) : out(out) {}
+
+			void null()									{ out += (char) 0xc0; }
+			void boolean(bool value)					{ out += (char) (value ? 0xc3 : 0xc2); }
+			void integer(int value)
+			{
+				if(value >= -32 && value <= 127)	out += (char) value;	// fixints
+				else if(value > 0)
+				{
+					if(value <= 0xff)				{ out += (char) 0xcc; put(value, 1); }
+					else if(value <= 0xffff)		{ out += (char) 0xcd; put(value, 2); }
+					else							{ out += (char) 0xce; put(value, 4); }
+				}
+				else
+				{
+					if(value >= -128)				{ out += (char) 0xd0; put(value, 1); }
+					else if(value >= -32768)		{ out += (char) 0xd1; put(value, 2); }
+					else							{ out += (char) 0xd2; put(value, 4); }
+				}
+			}
+			void real(float value)
+			{
+				unsigned int bits;
+				memcpy(&bits, &value, sizeof(bits));
+				out += (char) 0xca;
+				put(bits, 4);
+			}
+			void real(double value)
+			{
+				unsigned long long bits;
+				memcpy(&bits, &value, sizeof(bits));
+				out += (char) 0xcb;
+				put(bits, 8);
+			}
+			void string(const char * data, size_t size)
+			{
+				if(size < 32)				out += (char) (0xa0 | size);
+				else if(size <= 0xff)		{ out += (char) 0xd9; put(size, 1); }
+				else if(size <= 0xffff)		{ out += (char) 0xda; put(size, 2); }
+				else						{ out += (char) 0xdb; put(size, 4); }
+				out.append(data, size);
+			}
+			void bytes(const char * data, size_t size)
+			{
+				if(size <= 0xff)			{ out += (char) 0xc4; put(size, 1); }
+				else if(size <= 0xffff)		{ out += (char) 0xc5; put(size, 2); }
+				else						{ out += (char) 0xc6; put(size, 4); }
+				out.append(data, size);
+			}
+			void array(size_t size)			{ header(size, 0x90, 0xdc, 0xdd); }
+			void map(size_t size)			{ header(size, 0x80, 0xde, 0xdf); }
+
+			// a 32 bit header to be filled in by patch() once the size is known
+			size_t reserve(bool map)
+			{
+				out += (char) (map ? 0xdf : 0xdd);
+				out.append(4, '\0');
+				return out.size() - 4;
+			}
+			void patch(size_t at, unsigned int size)
+			{
+				for(int i = 3; i >= 0; --i, size >>= 8) out[at + i] = (char) (size & 0xff);
+			}
+
+		private:
+			void header(size_t size, int fix, int wide, int wider)
+			{
+				if(size < 16)				out += (char) (fix | size);
+				else if(size <= 0xffff)		{ out += (char) wide; put(size, 2); }
+				else						{ out += (char) wider; put(size, 4); }
+			}
+			template<typename T>
+			void put(T value, int bytes)
+			{
+				for(int i = bytes - 1; i >= 0; --i) out += (char) (((unsigned long long) value >> (i * 8)) & 0xff);
+			}
+
+			std::string& out;
+		};
+
+		void encode(MsgPackOut& out, const Value& val)
+		{
+			if(val.isObject())
+			{
+				out.map(val.size());
+				val.forEachMember([&out](const char * key, size_t size, const Value& member)
+				{
+					out.string(key, size);
+					encode(out, member);
+				});
+			}
+			else if(val.isArray())
+			{
+				out.array(val.size());
+				Span<int> ints = val.asIntSpan();
+				Span<float> floats = val.asFloatSpan();
+				if(!ints.empty())			for(int i : ints) out.integer(i);
+				else if(!floats.empty())	for(float f : floats) out.real(f);
+				else						forEachElement(val, [&out](const Value& element) { encode(out, element); });
+			}
+			else if(val.isString())		out.string(val.asString().data(), val.asString().size());
+			else if(val.isBytes())		out.bytes(val.asBytes().data(), val.asBytes().size());
+			else if(val.isInt())		out.integer(val.asInt());
+			else if(val.isFloat())		out.real(val.asFloat());
+			else if(val.isBool())		out.boolean(val.asBool());
+			else						out.null();
+		}
+
+		// reads MessagePack as the same events BasicParser sends its handler.  Nesting is
+		// kept on a stack rather than by recursion, like the parser.
+		template<typename Handler>
+		class MsgPackReader
+		{
+		public:
+			MsgPackReader(Handler& handler, const std::string& bytes) : handler(handler), itr((const unsigned char *) bytes.data()), begin(itr), end(itr + bytes.size()) {}
+
+			bool read()
+			{
+				do
+				{
+					if(!stack.empty() && stack.back().wantKey)
+					{
+						if(!item(true)) return false;
+						stack.back().wantKey = false;
+					}
+					else if(!item(false))
+					{
+						return false;
+					}
+				} while(!stack.empty());
+				return itr == end || error("Unexpected bytes after the value.");
+			}
+
+			const std::string& getError() const		{ return errorMsg; }
+			size_t getOffset() const				{ return itr - begin; }
+
+		private:
+			struct Frame
+			{
+				bool object;
+				bool wantKey;
+				unsigned int remaining;
+			};
+
+			bool error(const char * msg)			{ errorMsg = msg; return false; }
+
+			bool take(size_t bytes, unsigned long long& value)
+			{
+				if((size_t) (end - itr) < bytes) return error("Unexpected end of data.");
+				value = 0;
+				for(size_t i = 0; i < bytes; ++i) value = (value << 8) | *itr++;
+				return true;
+			}
+
+			bool item(bool isKey)
+			{
+				if(itr == end) return error("Unexpected end of data.");
+				unsigned char type = *itr++;
+				unsigned long long value = 0;
+
+				size_t size;
+				if((type & 0xe0) == 0xa0)	{ size = type & 0x1f; return text(size, isKey); }
+				if(type >= 0xd9 && type <= 0xdb)
+				{
+					if(!take(1 << (type - 0xd9), value)) return false;
+					return text((size_t) value, isKey);
+				}
+				if(type >= 0xc4 && type <= 0xc6)	// bin
+				{
+					if(isKey) return error("Map keys must be strings.");
+					if(!take(1 << (type - 0xc4), value)) return false;
+					if((size_t) (end - itr) < value) return error("Unexpected end of data.");
+					const char * data = (const char *) itr;
+					itr += value;
+					return (handler.bytes(data, (size_t) value) || error("Stopped by the handler.")) && finished();
+				}
+				if(isKey) return error("Map keys must be strings.");
+
+				bool ok;
+				if(type <= 0x7f)						ok = handler.integer(type);
+				else if(type >= 0xe0)					ok = handler.integer((signed char) type);
+				else if((type & 0xf0) == 0x80)			return open(true, type & 0x0f);
+				else if((type & 0xf0) == 0x90)			return open(false, type & 0x0f);
+				else if(type == 0xde || type == 0xdf)	return take(type == 0xde ? 2 : 4, value) && open(true, (unsigned int) value);
+				else if(type == 0xdc || type == 0xdd)	return take(type == 0xdc ? 2 : 4, value) && open(false, (unsigned int) value);
+				else if(type == 0xc0)					ok = handler.null();
+				else if(type == 0xc2 || type == 0xc3)	ok = handler.boolean(type == 0xc3);
+				else if(type >= 0xcc && type <= 0xcf)	// uint 8 - 64
+				{
+					if(!take(1 << (type - 0xcc), value)) return false;
+					ok = value <= (unsigned long long) INT_MAX ? handler.integer((int) value) : handler.number((double) value);
+				}
+				else if(type >= 0xd0 && type <= 0xd3)	// int 8 - 64
+				{
+					int bytes = 1 << (type - 0xd0);
+					if(!take(bytes, value)) return false;
+					// sign extend
+					long long signedValue = bytes == 8 ? (long long) value : (long long) (value ^ (1ull << (bytes * 8 - 1))) - (1ll << (bytes * 8 - 1));
+					ok = signedValue >= INT_MIN && signedValue <= INT_MAX ? handler.integer((int) signedValue) : handler.number((double) signedValue);
+				}
+				else if(type == 0xca)
+				{
+					if(!take(4, value)) return false;
+					unsigned int bits = (unsigned int) value;
+					float real;
+					memcpy(&real, &bits, sizeof(real));
+					ok = handler.number(real);
+				}
+				else if(type == 0xcb)
+				{
+					if(!take(8, value)) return false;
+					double real;
+					memcpy(&real, &value, sizeof(real));
+					ok = handler.number(real);
+				}
+				else
+				{
+					return error("Unsupported type (extensions are not read).");
+				}
+				return ok ? finished() : error("Stopped by the handler.");
+			}
+
+			bool text(size_t size, bool isKey)
+			{
+				if((size_t) (end - itr) < size) return error("Unexpected end of data.");
+				const char * data = (const char *) itr;
+				itr += size;
+				if(isKey) return handler.key(data, size) || error("Stopped by the handler.");
+				return (handler.string(data, size) || error("Stopped by the handler.")) && finished();
+			}
+
+			bool open(bool object, unsigned int count)
+			{
+				if(!(object ? handler.startObject() : handler.startArray())) return error("Stopped by the handler.");
+				Frame frame = { object, object, count };
+				stack.push_back(frame);
+				return count > 0 || (close() && finished());
+			}
+
+			// a value is complete, so close every container it completes
+			bool finished()
+			{
+				while(!stack.empty())
+				{
+					Frame& frame = stack.back();
+					if(--frame.remaining > 0)
+					{
+						frame.wantKey = frame.object;
+						return true;
+					}
+					if(!close()) return false;
+				}
+				return true;
+			}
+			bool close()
+			{
+				bool object = stack.back().object;
+				stack.pop_back();
+				return (object ? handler.endObject() : handler.endArray()) || error("Stopped by the handler.");
+			}
+
+			Handler& handler;
+			const unsigned char * itr;
+			const unsigned char * begin;
+			const unsigned char * end;
+			std::vector<Frame> stack;
+			std::string errorMsg;
+		};
+
+		// BasicParser handler writing MessagePack as the events arrive
+		class MsgPackTranscoder : public BaseHandler
+		{
+		public:
+			explicit MsgPackTranscoder(std::string& out) : out(out) {}
+
+			bool null()									{ counted(); out.null(); return true; }
+			bool boolean(bool value)					{ counted(); out.boolean(value); return true; }
+			bool integer(int value)						{ counted(); out.integer(value); return true; }
+			bool number(double value)					{ counted(); out.real(value); return true; }
+			bool string(const char * data, size_t size)	{ counted(); out.string(data, size); return true; }
+			bool key(const char * data, size_t size)	{ out.string(data, size); return true; }
+			bool startObject()							{ counted(); open(true); return true; }
+			bool endObject()							{ close(); return true; }
+			bool startArray()							{ counted(); open(false); return true; }
+			bool endArray()								{ close(); return true; }
+
+		private:
+			struct Open
+			{
+				size_t header;
+				unsigned int count;
+			};
+
+			void counted()								{ if(!stack.empty()) ++stack.back().count; }
+			void open(bool map)							{ Open frame = { out.reserve(map), 0 }; stack.push_back(frame); }
+			void close()								{ out.patch(stack.back().header, stack.back().count); stack.pop_back(); }
+
+			MsgPackOut out;
+			std::vector<Open> stack;
+		};
+	}
+
+	std::string toMsgPack(const Value& val)
+	{
+		std::string rtn;
+		MsgPackOut out(rtn);
+		encode(out, val);
+		return rtn;
+	}
+
+	UniqueValue fromMsgPack(const std::string& bytes)
+	{
+		TreeBuilder builder;
+		MsgPackReader<TreeBuilder> reader(builder, bytes);
+		if(!reader.read())
+		{
+			fprintf(stderr, "Error: %s (at offset %u)\n", reader.getError().c_str(), (unsigned int) reader.getOffset());
+			return UniqueValue(newNull());
+		}
+		return UniqueValue(builder.release());
+	}
+
+	bool jsonToMsgPack(const std::string& src, std::string& out, std::string& error)
+	{
+		out.clear();
+		MsgPackTranscoder transcoder(out);
+		BasicParser<MsgPackTranscoder> parser(transcoder);
+		if(!parser.parse(src))
+		{
+			error = parser.getError();
+			return false;
+		}
+		return true;
+	}
+
+	bool jsonToMsgPack(const std::string& src, std::string& out)
+	{
+		std::string error;
+		return jsonToMsgPack(src, out, error);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// CBOR
+	// Every item starts with a head: the major type in the top three bits, then either the
+	// argument itself (under 24) or the number of argument bytes that follow.
+	//////////////////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		enum CborMajor
+		{
+			eCborUnsigned = 0,
+			eCborNegative,
+			eCborBytes,
+			eCborText,
+			eCborArray,
+			eCborMap,
+			eCborTag,
+			eCborSimple
+		};
+
+		const unsigned char cborBreak = 0xff;
+
+		struct CborHead
+		{
+			unsigned int major;
+			unsigned int info;				// the low five bits, 31 for indefinite length
+			unsigned long long arg;
+		};
+
+		// false if the head is truncated or malformed
+		bool readHead(const unsigned char *& itr, const unsigned char * end, CborHead& head)
+		{
+			if(itr == end) return false;
+			head.major = *itr >> 5;
+			head.info = *itr & 0x1f;
+			++itr;
+			head.arg = head.info;
+			if(head.info >= 24 && head.info <= 27)
+			{
+				size_t bytes = (size_t) 1 << (head.info - 24);
+				if((size_t) (end - itr) < bytes) return false;
+				head.arg = 0;
+				for(size_t i = 0; i < bytes; ++i) head.arg = (head.arg << 8) | *itr++;
+			}
+			else if(head.info >= 28 && head.info <= 30)
+			{
+				return false;
+			}
+			else if(head.info == 31 && (head.major < eCborBytes || head.major == eCborTag))
+			{
+				return false;
+			}
+			return true;
+		}
+
+		double halfToDouble(unsigned int half)
+		{
+			int exponent = (half >> 10) & 0x1f;
+			int mantissa = half & 0x3ff;
+			double value;
+			if(exponent == 0)		value = ldexp(mantissa, -24);
+			else if(exponent != 31)	value = ldexp(mantissa + 1024, exponent - 25);
+			else					value = mantissa == 0 ? std::numeric_limits<double>::infinity() : std::numeric_limits<double>::quiet_NaN();
+			return half & 0x8000 ? -value : value;
+		}
+
+		// the half precision float equal to value, if there is one
+		bool toHalf(float value, unsigned int& half)
+		{
+			unsigned int bits;
+			memcpy(&bits, &value, sizeof(bits));
+			unsigned int sign = (bits >> 16) & 0x8000;
+			int exponent = (bits >> 23) & 0xff;
+			unsigned int mantissa = bits & 0x7fffff;
+			if(exponent == 0xff)
+			{
+				half = sign | 0x7c00 | (mantissa ? 0x200 : 0);	// NaN payloads aren't kept
+				return true;
+			}
+			if(exponent == 0 && mantissa == 0)
+			{
+				half = sign;
+				return true;
+			}
+			int rebased = exponent - 127 + 15;
+			if(rebased >= 1 && rebased <= 30)
+			{
+				if(mantissa & 0x1fff) return false;
+				half = sign | (rebased << 10) | (mantissa >> 13);
+				return true;
+			}
+			if(exponent != 0 && rebased < 1 && rebased >= -10)
+			{
+				// subnormal in half precision
+				unsigned int full = mantissa | 0x800000;
+				int shift = 14 - rebased;
+				if(full & ((1u << shift) - 1)) return false;
+				half = sign | (full >> shift);
+				return true;
+			}
+			return false;
+		}
+
+		class CborOut
+		{
+		public:
+			explicit CborOut(std::string& out) : out(out) {}
+
+			void null()									{ out += (char) 0xf6; }
+			void boolean(bool value)					{ out += (char) (value ? 0xf5 : 0xf4); }
+			void integer(int value)
+			{
+				if(value >= 0)	head(eCborUnsigned, (unsigned long long) value);
+				else			head(eCborNegative, (unsigned long long) (-1 - (long long) value));
+			}
+			void real(float value)
+			{
+				unsigned int half;
+				if(toHalf(value, half))
+				{
+					out += (char) 0xf9;
+					put(half, 2);
+				}
+				else
+				{
+					unsigned int bits;
+					memcpy(&bits, &value, sizeof(bits));
+					out += (char) 0xfa;
+					put(bits, 4);
+				}
+			}
+			void string(const char * data, size_t size)	{ head(eCborText, size); out.append(data, size); }
+			void bytes(const char * data, size_t size)	{ head(eCborBytes, size); out.append(data, size); }
+			void array(size_t size)						{ head(eCborArray, size); }
+			void map(size_t size)						{ head(eCborMap, size); }
+
+		private:
+			void head(CborMajor major, unsigned long long arg)
+			{
+				int type = major << 5;
+				if(arg < 24)					out += (char) (type | arg);
+				else if(arg <= 0xff)			{ out += (char) (type | 24); put(arg, 1); }
+				else if(arg <= 0xffff)			{ out += (char) (type | 25); put(arg, 2); }
+				else if(arg <= 0xffffffffull)	{ out += (char) (type | 26); put(arg, 4); }
+				else							{ out += (char) (type | 27); put(arg, 8); }
+			}
+			void put(unsigned long long value, int bytes)
+			{
+				for(int i = bytes - 1; i >= 0; --i) out += (char) ((value >> (i * 8)) & 0xff);
+			}
+
+			std::string& out;
+		};
+
+		void encode(CborOut& out, const Value& val)
+		{
+			if(val.isObject())
+			{
+				out.map(val.size());
+				val.forEachMember([&out](const char * key, size_t size, const Value& member)
+				{
+					out.string(key, size);
+					encode(out, member);
+				});
+			}
+			else if(val.isArray())
+			{
+				out.array(val.size());
+				Span<int> ints = val.asIntSpan();
+				Span<float> floats = val.asFloatSpan();
+				if(!ints.empty())			for(int i : ints) out.integer(i);
+				else if(!floats.empty())	for(float f : floats) out.real(f);
+				else						forEachElement(val, [&out](const Value& element) { encode(out, element); });
+			}
+			else if(val.isString())		out.string(val.asString().data(), val.asString().size());
+			else if(val.isBytes())		out.bytes(val.asBytes().data(), val.asBytes().size());
+			else if(val.isInt())		out.integer(val.asInt());
+			else if(val.isFloat())		out.real(val.asFloat());
+			else if(val.isBool())		out.boolean(val.asBool());
+			else						out.null();
+		}
+
+		// reads CBOR as the events BasicParser sends its handler (plus bytes() for byte
+		// strings), keeping nesting on a stack like MsgPackReader
+		template<typename Handler>
+		class CborReader
+		{
+		public:
+			CborReader(Handler& handler, const char * data, size_t size, bool allowChunks)
+				: handler(handler), itr((const unsigned char *) data), begin(itr), end(itr + size), allowChunks(allowChunks) {}
+
+			bool read()
+			{
+				do
+				{
+					if(!stack.empty() && stack.back().indefinite && itr != end && *itr == cborBreak)
+					{
+						if(stack.back().object && !stack.back().wantKey) return error("Missing value before the break.");
+						++itr;
+						if(!close() || !finished()) return false;
+					}
+					else if(!stack.empty() && stack.back().wantKey)
+					{
+						if(!item(true)) return false;
+						stack.back().wantKey = false;
+					}
+					else if(!item(false))
+					{
+						return false;
+					}
+				} while(!stack.empty());
+				return itr == end || error("Unexpected bytes after the item.");
+			}
+
+			const std::string& getError() const		{ return errorMsg; }
+			size_t getOffset() const				{ return itr - begin; }
+
+		private:
+			struct Frame
+			{
+				bool object;
+				bool wantKey;
+				bool indefinite;
+				unsigned long long remaining;
+			};
+
+			bool error(const char * msg)			{ errorMsg = msg; return false; }
+			bool stopped()							{ return error("Stopped by the handler."); }
+
+			bool item(bool isKey)
+			{
+				CborHead head;
+				do
+				{
+					const unsigned char * start = itr;
+					if(!readHead(itr, end, head)) return error(start != end && (*start & 0x1f) >= 28 ? "Malformed head." : "Unexpected end of data.");
+				} while(head.major == eCborTag);	// tags are skipped, the tagged item follows
+
+				if(isKey && head.major != eCborText) return error("Map keys must be text.");
+
+				bool ok;
+				switch(head.major)
+				{
+				case eCborUnsigned:
+					ok = head.arg <= (unsigned long long) INT_MAX ? handler.integer((int) head.arg) : handler.number((double) head.arg);
+					break;
+				case eCborNegative:
+					ok = head.arg <= (unsigned long long) INT_MAX ? handler.integer(-1 - (int) head.arg) : handler.number(-1.0 - (double) head.arg);
+					break;
+				case eCborBytes:
+				case eCborText:
+					return text(head, isKey);
+				case eCborArray:
+				case eCborMap:
+					return open(head.major == eCborMap, head.info == 31, head.arg);
+				default:
+					switch(head.info)
+					{
+					case 20:
+					case 21:	ok = handler.boolean(head.info == 21); break;
+					case 22:
+					case 23:	ok = handler.null(); break;		// undefined has no JSON equivalent
+					case 25:	ok = handler.number(halfToDouble((unsigned int) head.arg)); break;
+					case 26:
+						{
+							unsigned int bits = (unsigned int) head.arg;
+							float real;
+							memcpy(&real, &bits, sizeof(real));
+							ok = handler.number(real);
+						}
+						break;
+					case 27:
+						{
+							double real;
+							memcpy(&real, &head.arg, sizeof(real));
+							ok = handler.number(real);
+						}
+						break;
+					case 31:	return error("Unexpected break.");
+					default:	return error("Unsupported simple value.");
+					}
+				}
+				return (ok || stopped()) && finished();
+			}
+
+			bool text(const CborHead& head, bool isKey)
+			{
+				const char * data;
+				size_t size;
+				if(head.info != 31)
+				{
+					if((unsigned long long) (end - itr) < head.arg) return error("Unexpected end of data.");
+					data = (const char *) itr;
+					size = (size_t) head.arg;
+					itr += size;
+				}
+				else
+				{
+					// chunks of the same type, each of definite length, joined
+					if(!allowChunks) return error("Strings split into chunks can't be viewed in place.");
+					scratch.clear();
+					while(itr == end || *itr != cborBreak)
+					{
+						CborHead chunk;
+						if(!readHead(itr, end, chunk)) return error("Unexpected end of data.");
+						if(chunk.major != head.major || chunk.info == 31) return error("Malformed string chunk.");
+						if((unsigned long long) (end - itr) < chunk.arg) return error("Unexpected end of data.");
+						scratch.append((const char *) itr, (size_t) chunk.arg);
+						itr += chunk.arg;
+					}
+					++itr;
+					data = scratch.data();
+					size = scratch.size();
+				}
+				if(isKey) return handler.key(data, size) || stopped();
+				bool ok = head.major == eCborText ? handler.string(data, size) : handler.bytes(data, size);
+				return (ok || stopped()) && finished();
+			}
+
+			bool open(bool object, bool indefinite, unsigned long long count)
+			{
+				if(!(object ? handler.startObject() : handler.startArray())) return stopped();
+				Frame frame = { object, object, indefinite, count };
+				stack.push_back(frame);
+				return indefinite || count > 0 || (close() && finished());
+			}
+
+			// a value is complete, so close every definite container it completes
+			bool finished()
+			{
+				while(!stack.empty())
+				{
+					Frame& frame = stack.back();
+					if(frame.indefinite || --frame.remaining > 0)
+					{
+						frame.wantKey = frame.object;
+						return true;
+					}
+					if(!close()) return false;
+				}
+				return true;
+			}
+			bool close()
+			{
+				bool object = stack.back().object;
+				stack.pop_back();
+				return (object ? handler.endObject() : handler.endArray()) || stopped();
+			}
+
+			Handler& handler;
+			const unsigned char * itr;
+			const unsigned char * begin;
+			const unsigned char * end;
+			bool allowChunks;
+			std::vector<Frame> stack;
+			std::string scratch;
+			std::string errorMsg;
+		};
+
+		// checks well formedness for viewCbor
+		struct CborChecker : public BaseHandler
+		{
+			bool bytes(const char *, size_t)			{ return true; }
+		};
+
+		// the start of the item after any tags
+		const unsigned char * untag(const unsigned char * itr)
+		{
+			while((*itr >> 5) == eCborTag)
+			{
+				CborHead head;
+				readHead(itr, itr + 9, head);
+			}
+			return itr;
+		}
+
+		// the end of a well formed item, without chunked strings
+		const unsigned char * skipItem(const unsigned char * itr)
+		{
+			unsigned long long pending = 1;			// items left in the current run of definite containers
+			std::vector<unsigned long long> saved;	// pending outside each open indefinite container
+			for(;;)
+			{
+				if(pending == 0)
+				{
+					if(saved.empty()) return itr;
+					if(*itr == cborBreak)
+					{
+						++itr;
+						pending = saved.back();
+						saved.pop_back();
+						continue;
+					}
+				}
+				else
+				{
+					--pending;
+				}
+
+				CborHead head;
+				readHead(itr, itr + 9, head);
+				switch(head.major)
+				{
+				case eCborTag:		++pending; break;
+				case eCborBytes:
+				case eCborText:		itr += head.arg; break;
+				case eCborArray:
+				case eCborMap:
+					if(head.info == 31)
+					{
+						saved.push_back(pending);
+						pending = 0;
+					}
+					else
+					{
+						pending += head.major == eCborMap ? head.arg * 2 : head.arg;
+					}
+					break;
+				}
+			}
+		}
+	}
+
+	std::string toCbor(const Value& val)
+	{
+		std::string rtn;
+		CborOut out(rtn);
+		encode(out, val);
+		return rtn;
+	}
+
+	UniqueValue fromCbor(const std::string& bytes)
+	{
+		TreeBuilder builder;
+		CborReader<TreeBuilder> reader(builder, bytes.data(), bytes.size(), true);
+		if(!reader.read())
+		{
+			fprintf(stderr, "Error: %s (at offset %u)\n", reader.getError().c_str(), (unsigned int) reader.getOffset());
+			return UniqueValue(newNull());
+		}
+		return UniqueValue(builder.release());
+	}
+
+	CborView viewCbor(const char * data, size_t size)
+	{
+		CborChecker checker;
+		CborReader<CborChecker> reader(checker, data, size, false);
+		if(!reader.read())
+		{
+			fprintf(stderr, "Error: %s (at offset %u)\n", reader.getError().c_str(), (unsigned int) reader.getOffset());
+			return CborView();
+		}
+		return CborView((const unsigned char *) data, nullptr, 0);
+	}
+
+	// the buffer has been checked, so heads and lengths can be trusted from here on
+	CborView::CborView(const unsigned char * item, const char * keyData, unsigned int keySize) : item(untag(item)), keyData(keyData), keySize(keySize) {}
+
+	namespace
+	{
+		CborHead headOf(const unsigned char * item)
+		{
+			CborHead head = { eCborSimple, 22, 22 };	// null
+			if(item) readHead(item, item + 9, head);
+			return head;
+		}
+		const unsigned char * payloadOf(const unsigned char * item)
+		{
+			CborHead head;
+			readHead(item, item + 9, head);
+			return item;
+		}
+	}
+
+	bool CborView::isInt() const
+	{
+		CborHead head = headOf(item);
+		return (head.major == eCborUnsigned || head.major == eCborNegative) && head.arg <= (unsigned long long) INT_MAX;
+	}
+	bool CborView::isFloat() const
+	{
+		CborHead head = headOf(item);
+		if(head.major == eCborUnsigned || head.major == eCborNegative) return head.arg > (unsigned long long) INT_MAX;
+		return head.major == eCborSimple && head.info >= 25 && head.info <= 27;
+	}
+	bool CborView::isString() const		{ return headOf(item).major == eCborText; }
+	bool CborView::isBytes() const		{ return headOf(item).major == eCborBytes; }
+	bool CborView::isBool() const		{ CborHead head = headOf(item); return head.major == eCborSimple && (head.info == 20 || head.info == 21); }
+	bool CborView::isNull() const		{ CborHead head = headOf(item); return head.major == eCborSimple && (head.info == 22 || head.info == 23); }
+	bool CborView::isObject() const		{ return headOf(item).major == eCborMap; }
+	bool CborView::isArray() const		{ return headOf(item).major == eCborArray; }
+
+	int CborView::asInt() const
+	{
+		assert(isInt());
+		CborHead head = headOf(item);
+		return head.major == eCborUnsigned ? (int) head.arg : -1 - (int) head.arg;
+	}
+	double CborView::asDouble() const
+	{
+		assert(isInt() || isFloat());
+		CborHead head = headOf(item);
+		if(head.major == eCborUnsigned) return (double) head.arg;
+		if(head.major == eCborNegative) return -1.0 - (double) head.arg;
+		if(head.info == 25) return halfToDouble((unsigned int) head.arg);
+		if(head.info == 26)
+		{
+			unsigned int bits = (unsigned int) head.arg;
+			float real;
+			memcpy(&real, &bits, sizeof(real));
+			return real;
+		}
+		double real;
+		memcpy(&real, &head.arg, sizeof(real));
+		return real;
+	}
+	float CborView::asFloat() const
+	{
+		return (float) asDouble();
+	}
+	bool CborView::asBool() const
+	{
+		assert(isBool());
+		return headOf(item).info == 21;
+	}
+	Span<char> CborView::asText() const
+	{
+		assert(isString());
+		return Span<char>((const char *) payloadOf(item), (unsigned int) headOf(item).arg);
+	}
+	std::string CborView::asString() const
+	{
+		Span<char> text = asText();
+		return std::string(text.data, text.size);
+	}
+	Span<char> CborView::asBytes() const
+	{
+		assert(isBytes());
+		return Span<char>((const char *) payloadOf(item), (unsigned int) headOf(item).arg);
+	}
+	Span<char> CborView::key() const
+	{
+		return Span<char>(keyData, keySize);
+	}
+
+	unsigned int CborView::size() const
+	{
+		assert(isObject() || isArray());
+		CborHead head = headOf(item);
+		if(head.info != 31) return (unsigned int) head.arg;
+		unsigned int count = 0;
+		for(const unsigned char * child = payloadOf(item); *child != cborBreak; child = skipItem(child))
+		{
+			if(head.major == eCborMap) child = skipItem(child);
+			++count;
+		}
+		return count;
+	}
+
+	CborView CborView::operator[](unsigned int i) const
+	{
+		if(!isObject() && !isArray()) return CborView();
+		CborHead head = headOf(item);
+		bool object = head.major == eCborMap;
+		const unsigned char * child = payloadOf(item);
+		for(unsigned int n = 0; head.info == 31 ? *child != cborBreak : n < head.arg; ++n)
+		{
+			const unsigned char * key = nullptr;
+			if(object)
+			{
+				key = untag(child);
+				child = skipItem(child);
+			}
+			if(n == i)
+			{
+				if(!object) return CborView(child, nullptr, 0);
+				return CborView(child, (const char *) payloadOf(key), (unsigned int) headOf(key).arg);
+			}
+			child = skipItem(child);
+		}
+		return CborView();
+	}
+
+	CborView CborView::get(const std::string& name) const
+	{
+		if(!isObject()) return CborView();
+		CborHead head = headOf(item);
+		const unsigned char * child = payloadOf(item);
+		for(unsigned long long n = 0; head.info == 31 ? *child != cborBreak : n < head.arg; ++n)
+		{
+			const unsigned char * key = untag(child);
+			const char * keyText = (const char *) payloadOf(key);
+			unsigned int keyLength = (unsigned int) headOf(key).arg;
+			child = skipItem(child);
+			if(keyLength == name.size() && memcmp(keyText, name.data(), keyLength) == 0) return CborView(child, keyText, keyLength);
+			child = skipItem(child);
+		}
+		return CborView();
+	}
+
+	void CborView::write(Writer& writer) const
+	{
+		if(isObject() || isArray())
+		{
+			CborHead head = headOf(item);
+			bool object = head.major == eCborMap;
+			object ? writer.startObject() : writer.startArray();
+			const unsigned char * child = payloadOf(item);
+			for(unsigned long long n = 0; head.info == 31 ? *child != cborBreak : n < head.arg; ++n)
+			{
+				if(object)
+				{
+					const unsigned char * key = untag(child);
+					writer.writeKey((const char *) payloadOf(key), (size_t) headOf(key).arg);
+					child = skipItem(child);
+				}
+				CborView(child, nullptr, 0).write(writer);
+				child = skipItem(child);
+			}
+			object ? writer.endObject() : writer.endArray();
+		}
+		else if(isString())
+		{
+			Span<char> text = asText();
+			writer.writeString(text.data, text.size);
+		}
+		else if(isBytes())
+		{
+			Span<char> bytes = asBytes();
+			std::string text = base64url(std::string(bytes.data, bytes.size));
+			writer.writeStringCopy(text.data(), text.size());
+		}
+		else if(isInt())
+		{
+			writer.writeInt(asInt());
+		}
+		else if(isFloat())
+		{
+			// half and single precision print as the tree's floats do
+			CborHead head = headOf(item);
+			if(head.major == eCborSimple && head.info != 27)	writer.writeFloat(asFloat());
+			else												writer.writeDouble(asDouble());
+		}
+		else if(isBool())
+		{
+			writer.writeBool(asBool());
+		}
+		else
+		{
+			writer.writeNull();
+		}
+	}
+
+	std::string CborView::toString() const
+	{
+		std::string rtn;
+		{
+			Writer writer([&rtn](const char * data, size_t size) { rtn.append(data, size); return true; }, 256);
+			write(writer);
+		}
+		return rtn;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// JSON Pointer
+	//////////////////////////////////////////////////////////////////////////////////////
+	Pointer::Pointer(const std::string& path) : ok(true)
+	{
+		if(path.empty()) return;	// the whole document
+		if(path[0] != '/')
+		{
+			ok = false;
+			return;
+		}
+		for(size_t start = 1; start <= path.size(); )
+		{
+			size_t stop = std::min(path.find('/', start), path.size());
+			Step step;
+			for(size_t i = start; i < stop; ++i)
+			{
+				if(path[i] != '~')
+				{
+					step.key += path[i];
+				}
+				else if(i + 1 < stop && (path[i + 1] == '0' || path[i + 1] == '1'))
+				{
+					step.key += path[++i] == '0' ? '~' : '/';
+				}
+				else
+				{
+					ok = false;
+					return;
+				}
+			}
+
+			step.index = 0;
+			step.isIndex = !step.key.empty() && (step.key == "0" || step.key[0] != '0');
+			for(char c : step.key)
+			{
+				if(!Detail::isDigit(c) || step.index > (UINT_MAX - 9) / 10)
+				{
+					step.isIndex = false;
+					break;
+				}
+				step.index = step.index * 10 + (c - '0');
+			}
+
+			steps.push_back(step);
+			start = stop + 1;
+		}
+	}
+
+	const Value * Pointer::resolve(const Value& root) const
+	{
+		if(!ok) return nullptr;
+		const Value * val = &root;
+		for(auto& step : steps)
+		{
+			if(val->isObject())
+			{
+				val = &val->get(step.key);
+				if(val == &theNullValue) return nullptr;
+			}
+			else if(val->isArray() && step.isIndex && step.index < val->size())
+			{
+				val = &(*val)[step.index];
+			}
+			else
+			{
+				return nullptr;
+			}
+		}
+		return val;
+	}
+
+	bool Pointer::resolve(const char * src, size_t size, Span<char>& text) const
+	{
+		if(!ok) return false;
+		Reader reader(src, size);
+		for(auto& step : steps)
+		{
+			bool found = false;
+			if(reader.isObject())
+			{
+				const char * key;
+				size_t length;
+				reader.startObject();
+				while(!found && reader.nextKey(key, length))
+				{
+					found = length == step.key.size() && memcmp(key, step.key.data(), length) == 0;
+					if(!found) reader.skipValue();
+				}
+			}
+			else if(reader.isArray() && step.isIndex)
+			{
+				reader.startArray();
+				for(unsigned int i = 0; !found && reader.nextElement(); ++i)
+				{
+					found = i == step.index;
+					if(!found) reader.skipValue();
+				}
+			}
+			if(!found) return false;
+		}
+		const char * data;
+		size_t length;
+		if(!reader.skipValue(data, length)) return false;
+		text = Span<char>(data, (unsigned int) length);
+		return true;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// JSONPath
+	// A plan is a list of segments, each a list of selectors.  Running it keeps, for each
+	// node, a bit set of how many segments the node has matched so far: a child gets bit
+	// k + 1 when one of segment k's selectors picks it, and keeps bit k when segment k is
+	// recursive.  A node with the last bit set is a match.  The same step serves value
+	// trees and raw text, which differ only in how children and filter operands are read.
+	//////////////////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		typedef unsigned long long PathStates;
+		const size_t maxPathSegments = 63;
+
+		// a typed operand of a filter comparison
+		struct PathScalar
+		{
+			enum Kind
+			{
+				eMissing,
+				eNull,
+				eBool,
+				eNumber,
+				eString,
+				eOther		// containers and bytes
+			};
+
+			PathScalar() : kind(eMissing), boolean(false), number(0), text(nullptr), size(0) {}
+
+			Kind kind;
+			bool boolean;
+			double number;
+			const char * text;
+			size_t size;
+			std::string storage;	// raw strings whose escapes had to be decoded
+		};
+
+		void scalarOf(const Value * val, PathScalar& scalar)
+		{
+			if(!val)					scalar.kind = PathScalar::eMissing;
+			else if(val->isInt())		{ scalar.kind = PathScalar::eNumber; scalar.number = val->asInt(); }
+			else if(val->isFloat())		{ scalar.kind = PathScalar::eNumber; scalar.number = val->asFloat(); }
+			else if(val->isString())	{ scalar.kind = PathScalar::eString; scalar.text = val->asString().data(); scalar.size = val->asString().size(); }
+			else if(val->isBool())		{ scalar.kind = PathScalar::eBool; scalar.boolean = val->asBool(); }
+			else if(val->isNull())		scalar.kind = PathScalar::eNull;
+			else						scalar.kind = PathScalar::eOther;
+		}
+
+		void scalarOf(const char * data, size_t size, PathScalar& scalar)
+		{
+			Reader reader(data, size);
+			char first = size ? *data : 0;
+			if(first == '"')
+			{
+				const char * text;
+				if(!reader.readString(text, scalar.size)) return;
+				scalar.kind = PathScalar::eString;
+				if(text >= data && text < data + size)
+				{
+					scalar.text = text;
+				}
+				else
+				{
+					scalar.storage.assign(text, scalar.size);
+					scalar.text = scalar.storage.data();
+				}
+			}
+			else if(first == 't' || first == 'f')
+			{
+				if(reader.readBool(scalar.boolean)) scalar.kind = PathScalar::eBool;
+			}
+			else if(first == 'n')			scalar.kind = PathScalar::eNull;
+			else if(first == '{' || first == '[')	scalar.kind = PathScalar::eOther;
+			else if(reader.readDouble(scalar.number))	scalar.kind = PathScalar::eNumber;
+		}
+
+		bool equal(const PathScalar& a, const PathScalar& b)
+		{
+			if(a.kind != b.kind) return false;
+			switch(a.kind)
+			{
+			case PathScalar::eMissing:
+			case PathScalar::eNull:		return true;
+			case PathScalar::eBool:		return a.boolean == b.boolean;
+			case PathScalar::eNumber:	return a.number == b.number;
+			case PathScalar::eString:	return a.size == b.size && memcmp(a.text, b.text, a.size) == 0;
+			default:					return false;
+			}
+		}
+
+		// strings order by their bytes
+		int order(const PathScalar& a, const PathScalar& b)
+		{
+			if(a.kind == PathScalar::eNumber) return a.number < b.number ? -1 : a.number > b.number ? 1 : 0;
+			int rtn = memcmp(a.text, b.text, std::min(a.size, b.size));
+			return rtn ? rtn : a.size < b.size ? -1 : a.size > b.size ? 1 : 0;
+		}
+	}
+
+	struct Path::Plan
+	{
+		struct Selector
+		{
+			enum Kind
+			{
+				eName,
+				eIndex,
+				eWildcard,
+				eSlice,
+				eFilter
+			};
+
+			Kind kind;
+			std::string name;
+			int index;
+			int start;
+			int end;
+			int step;
+			bool hasStart;
+			bool hasEnd;
+			unsigned int filter;	// root of its expression
+		};
+
+		struct Segment
+		{
+			bool recursive;
+			bool needsCount;		// the array's size is needed to pick elements
+			bool singleName;		// a plain .name, so a tree can look it up
+			std::vector<Selector> selectors;
+		};
+
+		struct Operand
+		{
+			enum Kind
+			{
+				eCurrent,
+				eRoot,
+				eLiteral
+			};
+
+			Kind kind;
+			std::unique_ptr<Pointer> path;
+			PathScalar literal;
+		};
+
+		struct Expr
+		{
+			enum Op
+			{
+				eOr,
+				eAnd,
+				eNot,
+				eExists,
+				eEqual,
+				eNotEqual,
+				eLess,
+				eLessEqual,
+				eGreater,
+				eGreaterEqual
+			};
+
+			Op op;
+			unsigned int left;		// expressions for the logical ops, operands for the rest
+			unsigned int right;
+		};
+
+		std::vector<Segment> segments;
+		std::vector<Expr> exprs;
+		std::vector<Operand> operands;
+
+		PathStates matched() const				{ return 1ull << segments.size(); }
+		PathStates live() const					{ return matched() - 1; }
+
+		bool picks(const Selector& selector, const char * key, size_t size, bool isIndex, unsigned int index, unsigned int count) const;
+
+		// the states of a child, filter(expr) evaluates a filter on the child
+		template<typename Filter>
+		PathStates step(PathStates states, const char * key, size_t size, bool isIndex, unsigned int index, unsigned int count, const Filter& filter) const
+		{
+			PathStates next = 0;
+			for(size_t k = 0; k < segments.size(); ++k)
+			{
+				if(!(states & (1ull << k))) continue;
+				const Segment& segment = segments[k];
+				if(segment.recursive) next |= 1ull << k;
+				for(auto& selector : segment.selectors)
+				{
+					if(selector.kind == Selector::eFilter ? filter(selector.filter) : picks(selector, key, size, isIndex, index, count))
+					{
+						next |= 1ull << (k + 1);
+						break;
+					}
+				}
+			}
+			return next;
+		}
+
+		// Resolve turns a path operand into a scalar against the current node or the root
+		template<typename Resolve>
+		bool evaluate(unsigned int e, const Resolve& resolve) const
+		{
+			const Expr& expr = exprs[e];
+			switch(expr.op)
+			{
+			case Expr::eOr:		return evaluate(expr.left, resolve) || evaluate(expr.right, resolve);
+			case Expr::eAnd:	return evaluate(expr.left, resolve) && evaluate(expr.right, resolve);
+			case Expr::eNot:	return !evaluate(expr.left, resolve);
+			default:			break;
+			}
+
+			PathScalar leftPath;
+			const PathScalar& left = scalar(operands[expr.left], leftPath, resolve);
+			if(expr.op == Expr::eExists) return left.kind != PathScalar::eMissing;
+			PathScalar rightPath;
+			const PathScalar& right = scalar(operands[expr.right], rightPath, resolve);
+			switch(expr.op)
+			{
+			case Expr::eEqual:		return equal(left, right);
+			case Expr::eNotEqual:	return !equal(left, right);
+			default:				break;
+			}
+			bool comparable = left.kind == right.kind && (left.kind == PathScalar::eNumber || left.kind == PathScalar::eString);
+			if(!comparable) return false;
+			int rtn = order(left, right);
+			switch(expr.op)
+			{
+			case Expr::eLess:		return rtn < 0;
+			case Expr::eLessEqual:	return rtn <= 0;
+			case Expr::eGreater:	return rtn > 0;
+			default:				return rtn >= 0;
+			}
+		}
+
+		class Compiler;
+
+		template<typename Resolve>
+		const PathScalar& scalar(const Operand& operand, PathScalar& path, const Resolve& resolve) const
+		{
+			if(operand.kind == Operand::eLiteral) return operand.literal;
+			resolve(operand, path);
+			return path;
+		}
+
+		void walk(const Value& val, PathStates states, const Value& root, std::vector<const Value *>& matches) const;
+		bool walk(const char * data, size_t size, PathStates states, Span<char> root, std::vector<Span<char>>& matches) const;
+	};
+
+	bool Path::Plan::picks(const Selector& selector, const char * key, size_t size, bool isIndex, unsigned int index, unsigned int count) const
+	{
+		switch(selector.kind)
+		{
+		case Selector::eName:
+			return !isIndex && size == selector.name.size() && memcmp(key, selector.name.data(), size) == 0;
+		case Selector::eWildcard:
+			return true;
+		case Selector::eIndex:
+			return isIndex && (selector.index >= 0 ? index == (unsigned int) selector.index : (long long) index == (long long) count + selector.index);
+		case Selector::eSlice:
+			{
+				if(!isIndex || selector.step == 0) return false;
+				// bounds as RFC 9535 normalises them, elements are still visited in document order
+				long long len = count;
+				auto normal = [len](long long i) { return i >= 0 ? i : len + i; };
+				long long i = index;
+				if(selector.step > 0)
+				{
+					long long lower = selector.hasStart ? std::min(std::max(normal(selector.start), 0ll), len) : 0;
+					long long upper = selector.hasEnd ? std::min(std::max(normal(selector.end), 0ll), len) : len;
+					return i >= lower && i < upper && (i - lower) % selector.step == 0;
+				}
+				long long upper = selector.hasStart ? std::min(std::max(normal(selector.start), -1ll), len - 1) : len - 1;
+				long long lower = selector.hasEnd ? std::min(std::max(normal(selector.end), -1ll), len - 1) : -1;
+				return i > lower && i <= upper && (upper - i) % -selector.step == 0;
+			}
+		default:
+			return false;
+		}
+	}
+
+	void Path::Plan::walk(const Value& val, PathStates states, const Value& root, std::vector<const Value *>& matches) const
+	{
+		if(states & matched()) matches.push_back(&val);
+		states &= live();
+		if(!states) return;
+
+		auto filterOn = [this, &root](const Value& child)
+		{
+			return [this, &root, &child](unsigned int filter)
+			{
+				return evaluate(filter, [&root, &child](const Operand& operand, PathScalar& scalar)
+				{
+					scalarOf(operand.path->resolve(operand.kind == Operand::eRoot ? root : child), scalar);
+				});
+			};
+		};
+
+		if(val.isObject() && (states & (states - 1)) == 0)
+		{
+			// one name to follow, so look it up rather than visiting every member
+			size_t k = 0;
+			while(!(states & (1ull << k))) ++k;
+			const Segment& segment = segments[k];
+			if(segment.singleName)
+			{
+				const std::string& name = segment.selectors[0].name;
+				const Value& child = val.get(name);
+				if(&child != &theNullValue) walk(child, states << 1, root, matches);
+				return;
+			}
+		}
+
+		if(val.isObject())
+		{
+			val.forEachMember([&](const char * key, size_t size, const Value& child)
+			{
+				PathStates next = step(states, key, size, false, 0, 0, filterOn(child));
+				if(next) walk(child, next, root, matches);
+			});
+		}
+		else if(val.isArray())
+		{
+			// a packed element is only boxed for good if it is matched
+			unsigned int count = val.size();
+			unsigned int i = 0;
+			forEachElement(val, [&](const Value& child)
+			{
+				PathStates next = step(states, nullptr, 0, true, i, count, filterOn(child));
+				if(child.isObject() || child.isArray())	{ if(next) walk(child, next, root, matches); }
+				else if(next & matched())				matches.push_back(&val[i]);
+				++i;
+			});
+		}
+	}
+
+	bool Path::Plan::walk(const char * data, size_t size, PathStates states, Span<char> root, std::vector<Span<char>>& matches) const
+	{
+		if(states & matched()) matches.push_back(Span<char>(data, (unsigned int) size));
+		states &= live();
+		if(!states) return true;
+
+		auto filterOn = [this, root](const char * childData, size_t childSize)
+		{
+			return [this, root, childData, childSize](unsigned int filter)
+			{
+				return evaluate(filter, [root, childData, childSize](const Operand& operand, PathScalar& scalar)
+				{
+					Span<char> text;
+					bool found = operand.kind == Operand::eRoot ? operand.path->resolve(root.data, root.size, text) : operand.path->resolve(childData, childSize, text);
+					if(found) scalarOf(text.data, text.size, scalar);
+				});
+			};
+		};
+
+		Reader reader(data, size);
+		const char * childData;
+		size_t childSize;
+		if(reader.isObject())
+		{
+			std::string key;	// the reader's copy goes when the value is skipped
+			const char * keyData;
+			size_t keySize;
+			reader.startObject();
+			while(reader.nextKey(keyData, keySize))
+			{
+				key.assign(keyData, keySize);
+				if(!reader.skipValue(childData, childSize)) return false;
+				PathStates next = step(states, key.data(), key.size(), false, 0, 0, filterOn(childData, childSize));
+				if(next && !walk(childData, childSize, next, root, matches)) return false;
+			}
+		}
+		else if(reader.isArray())
+		{
+			unsigned int count = 0;
+			for(size_t k = 0; k < segments.size(); ++k)
+			{
+				if(!(states & (1ull << k)) || !segments[k].needsCount) continue;
+				Reader counter(data, size);
+				counter.startArray();
+				while(counter.nextElement() && counter.skipValue()) ++count;
+				if(counter.failed()) return false;
+				break;
+			}
+			reader.startArray();
+			for(unsigned int i = 0; reader.nextElement(); ++i)
+			{
+				if(!reader.skipValue(childData, childSize)) return false;
+				PathStates next = step(states, nullptr, 0, true, i, count, filterOn(childData, childSize));
+				if(next && !walk(childData, childSize, next, root, matches)) return false;
+			}
+		}
+		return !reader.failed();
+	}
+
+	// expression text to a plan
+	class Path::Plan::Compiler
+	{
+	public:
+		Compiler(const std::string& text, Plan& plan) : begin(text.data()), itr(begin), end(begin + text.size()), plan(plan) {}
+
+		bool compile()
+		{
+			if(!accept('$')) return fail("Expected '$' at the start.");
+			while(itr != end)
+			{
+				Plan::Segment segment;
+				segment.recursive = false;
+				if(accept('.'))
+				{
+					segment.recursive = accept('.');
+					if(segment.recursive && peek() == '[')
+					{
+						if(!bracket(segment)) return false;
+					}
+					else if(!shorthand(segment))
+					{
+						return false;
+					}
+				}
+				else if(peek() == '[')
+				{
+					if(!bracket(segment)) return false;
+				}
+				else
+				{
+					return fail("Expected '.' or '['.");
+				}
+
+				segment.singleName = !segment.recursive && segment.selectors.size() == 1 && segment.selectors[0].kind == Plan::Selector::eName;
+				segment.needsCount = false;
+				for(auto& selector : segment.selectors)
+				{
+					segment.needsCount |= (selector.kind == Plan::Selector::eIndex && selector.index < 0) || selector.kind == Plan::Selector::eSlice;
+				}
+				plan.segments.push_back(std::move(segment));
+				if(plan.segments.size() > maxPathSegments) return fail("Too many segments.");
+			}
+			return true;
+		}
+
+		const std::string& getError() const	{ return error; }
+
+	private:
+		char peek() const						{ return itr != end ? *itr : 0; }
+		bool accept(char c)						{ if(peek() != c) return false; ++itr; return true; }
+		bool accept(const char * text)
+		{
+			size_t size = strlen(text);
+			if((size_t) (end - itr) < size || memcmp(itr, text, size) != 0) return false;
+			itr += size;
+			return true;
+		}
+		void skipSpace()						{ while(itr != end && Detail::isSpace(*itr)) ++itr; }
+		bool fail(const char * message)
+		{
+			if(error.empty()) error = std::string(message) + " (at offset " + std::to_string(itr - begin) + ")";
+			return false;
+		}
+
+		static bool isNameChar(char c)
+		{
+			return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || Detail::isDigit(c) || c == '_' || (unsigned char) c >= 0x80;
+		}
+		bool name(std::string& value)
+		{
+			const char * start = itr;
+			while(itr != end && isNameChar(*itr)) ++itr;
+			if(itr == start) return fail("Expected a name.");
+			value.assign(start, itr);
+			return true;
+		}
+
+		// .name or .*
+		bool shorthand(Plan::Segment& segment)
+		{
+			Plan::Selector selector = Plan::Selector();
+			if(accept('*'))
+			{
+				selector.kind = Plan::Selector::eWildcard;
+			}
+			else
+			{
+				selector.kind = Plan::Selector::eName;
+				if(!name(selector.name)) return false;
+			}
+			segment.selectors.push_back(selector);
+			return true;
+		}
+
+		// [selector, ...]
+		bool bracket(Plan::Segment& segment)
+		{
+			accept('[');
+			do
+			{
+				skipSpace();
+				Plan::Selector selector = Plan::Selector();
+				if(peek() == '\'' || peek() == '"')
+				{
+					selector.kind = Plan::Selector::eName;
+					if(!quoted(selector.name)) return false;
+				}
+				else if(accept('*'))
+				{
+					selector.kind = Plan::Selector::eWildcard;
+				}
+				else if(accept('?'))
+				{
+					selector.kind = Plan::Selector::eFilter;
+					skipSpace();
+					if(!logical(selector.filter)) return false;
+				}
+				else if(!indexOrSlice(selector))
+				{
+					return false;
+				}
+				segment.selectors.push_back(selector);
+				skipSpace();
+			} while(accept(','));
+			return accept(']') || fail("Expected ']'.");
+		}
+
+		bool integer(int& value)
+		{
+			const char * start = itr;
+			accept('-');
+			if(!Detail::isDigit(peek())) return fail("Expected an integer.");
+			long long rtn = 0;
+			while(Detail::isDigit(peek()))
+			{
+				rtn = rtn * 10 + (*itr++ - '0');
+				if(rtn > INT_MAX) return fail("Integer out of range.");
+			}
+			value = (int) (*start == '-' ? -rtn : rtn);
+			return true;
+		}
+
+		bool indexOrSlice(Plan::Selector& selector)
+		{
+			selector.kind = Plan::Selector::eIndex;
+			selector.step = 1;
+			if(peek() != ':')
+			{
+				if(!integer(selector.index)) return false;
+				skipSpace();
+				if(peek() != ':') return true;
+				selector.start = selector.index;
+				selector.hasStart = true;
+			}
+			selector.kind = Plan::Selector::eSlice;
+			accept(':');
+			skipSpace();
+			if(peek() == '-' || Detail::isDigit(peek()))
+			{
+				if(!integer(selector.end)) return false;
+				selector.hasEnd = true;
+				skipSpace();
+			}
+			if(accept(':'))
+			{
+				skipSpace();
+				if((peek() == '-' || Detail::isDigit(peek())) && !integer(selector.step)) return false;
+			}
+			return true;
+		}
+
+		// 'text' or "text" with JSON's escapes (and \\' in single quotes)
+		bool quoted(std::string& value)
+		{
+			char quote = *itr++;
+			value.clear();
+			while(itr != end && *itr != quote)
+			{
+				if(*itr != '\\')
+				{
+					value += *itr++;
+					continue;
+				}
+				if(++itr == end) break;
+				char c = *itr++;
+				switch(c)
+				{
+				case 'b':	value += '\b'; break;
+				case 'f':	value += '\f'; break;
+				case 'n':	value += '\n'; break;
+				case 'r':	value += '\r'; break;
+				case 't':	value += '\t'; break;
+				case 'u':
+					{
+						unsigned int code;
+						if(!hex(code)) return false;
+						if(code >= 0xd800 && code < 0xdc00 && accept("\\u"))
+						{
+							unsigned int low;
+							if(!hex(low)) return false;
+							code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+						}
+						Detail::appendUtf8(value, code);
+					}
+					break;
+				default:	value += c; break;	// quotes, \\ and /
+				}
+			}
+			return accept(quote) || fail("Unterminated string.");
+		}
+		bool hex(unsigned int& code)
+		{
+			code = 0;
+			for(int i = 0; i < 4; ++i, ++itr)
+			{
+				char c = peek();
+				int digit = Detail::isDigit(c) ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+				if(digit < 0) return fail("Invalid \\u escape.");
+				code = code * 16 + digit;
+			}
+			return true;
+		}
+
+		unsigned int add(Plan::Expr::Op op, unsigned int left, unsigned int right)
+		{
+			Plan::Expr expr = { op, left, right };
+			plan.exprs.push_back(expr);
+			return (unsigned int) plan.exprs.size() - 1;
+		}
+
+		// a || b, a && b, !a, (a), and comparisons
+		bool logical(unsigned int& expr)
+		{
+			if(!conjunction(expr)) return false;
+			for(skipSpace(); accept("||"); skipSpace())
+			{
+				unsigned int right;
+				skipSpace();
+				if(!conjunction(right)) return false;
+				expr = add(Plan::Expr::eOr, expr, right);
+			}
+			return true;
+		}
+		bool conjunction(unsigned int& expr)
+		{
+			if(!unary(expr)) return false;
+			for(skipSpace(); accept("&&"); skipSpace())
+			{
+				unsigned int right;
+				skipSpace();
+				if(!unary(right)) return false;
+				expr = add(Plan::Expr::eAnd, expr, right);
+			}
+			return true;
+		}
+		bool unary(unsigned int& expr)
+		{
+			skipSpace();
+			if(accept('!'))
+			{
+				unsigned int inner;
+				if(!unary(inner)) return false;
+				expr = add(Plan::Expr::eNot, inner, 0);
+				return true;
+			}
+			if(accept('('))
+			{
+				if(!logical(expr)) return false;
+				skipSpace();
+				return accept(')') || fail("Expected ')'.");
+			}
+			return comparison(expr);
+		}
+		bool comparison(unsigned int& expr)
+		{
+			unsigned int left;
+			if(!operand(left)) return false;
+			skipSpace();
+			static const struct { const char * text; Plan::Expr::Op op; } ops[] =
+			{
+				{ "==", Plan::Expr::eEqual }, { "!=", Plan::Expr::eNotEqual },
+				{ "<=", Plan::Expr::eLessEqual }, { ">=", Plan::Expr::eGreaterEqual },
+				{ "<", Plan::Expr::eLess }, { ">", Plan::Expr::eGreater }
 			};
+			for(auto& op : ops)
+			{
+				if(accept(op.text))
+				{
+					unsigned int right;
+					skipSpace();
+					if(!operand(right)) return false;
+					expr = add(op.op, left, right);
+					return true;
+				}
+			}
+			if(plan.operands[left].kind == Plan::Operand::eLiteral) return fail("Expected a comparison.");
+			expr = add(Plan::Expr::eExists, left, 0);
+			return true;
+		}
 
-			Token() : type(eError) {}
-			Token(Type type) : type(type) {}
-			Token(Type type, const std::string& value) 
-				: type(type), value(value) {}
+		// @.path, $.path or a literal
+		bool operand(unsigned int& index)
+		{
+			Plan::Operand operand;
+			operand.kind = Plan::Operand::eLiteral;
+			PathScalar& literal = operand.literal;
+			if(peek() == '@' || peek() == '$')
+			{
+				operand.kind = *itr++ == '@' ? Plan::Operand::eCurrent : Plan::Operand::eRoot;
+				std::string pointer;
+				if(!relative(pointer)) return false;
+				operand.path.reset(new Pointer(pointer));
+			}
+			else if(peek() == '\'' || peek() == '"')
+			{
+				literal.kind = PathScalar::eString;
+				if(!quoted(literal.storage)) return false;
+			}
+			else if(accept("true"))
+			{
+				literal.kind = PathScalar::eBool;
+				literal.boolean = true;
+			}
+			else if(accept("false"))
+			{
+				literal.kind = PathScalar::eBool;
+			}
+			else if(accept("null"))
+			{
+				literal.kind = PathScalar::eNull;
+			}
+			else if(peek() == '-' || Detail::isDigit(peek()))
+			{
+				// the longest number strtod takes, copied so it can't run past the expression
+				const char * start = itr;
+				while(itr != end && (Detail::isDigit(*itr) || strchr("+-.eE", *itr))) ++itr;
+				std::string text(start, itr);
+				char * stop;
+				literal.kind = PathScalar::eNumber;
+				literal.number = strtod(text.c_str(), &stop);
+				if(*stop) return fail("Invalid number.");
+			}
+			else
+			{
+				return fail("Expected a value or a path.");
+			}
+			plan.operands.push_back(std::move(operand));
+			index = (unsigned int) plan.operands.size() - 1;
+			return true;
+		}
 
-			Type type;
-			std::string value;
+		// the steps after @ or $ as a JSON Pointer
+		bool relative(std::string& pointer)
+		{
+			for(;;)
+			{
+				std::string key;
+				if(accept('.'))
+				{
+					if(!name(key)) return false;
+				}
+				else if(accept('['))
+				{
+					skipSpace();
+					if(peek() == '\'' || peek() == '"')
+					{
+						if(!quoted(key)) return false;
+					}
+					else
+					{
+						int index = 0;
+						if(!integer(index)) return false;
+						if(index < 0) return fail("Filter paths can't use negative indexes.");
+						key = std::to_string(index);
+					}
+					skipSpace();
+					if(!accept(']')) return fail("Expected ']'.");
+				}
+				else
+				{
+					return true;
+				}
+				pointer += '/';
+				for(char c : key)
+				{
+					if(c == '~')		pointer += "~0";
+					else if(c == '/')	pointer += "~1";
+					else				pointer += c;
+				}
+			}
+		}
 
-			std::string toString();
-		};
+		const char * begin;
+		const char * itr;
+		const char * end;
+		Plan& plan;
+		std::string error;
+	};
 
-		std::string Token::toString()
+	Path::Path(const std::string& expression) : plan(new Plan())
+	{
+		Plan::Compiler compiler(expression, *plan);
+		if(!compiler.compile()) error = compiler.getError();
+		// string literals keep their text in storage, which may have moved with the operands
+		for(auto& operand : plan->operands)
 		{
-			switch(type)
+			if(operand.literal.kind == PathScalar::eString)
 			{
-			case	eOpenObject:	return "eOpenObject"; break;
-			case	eCloseObject:	return "eCloseObject"; break;
-			case	eOpenArray:		return "eOpenArray"; break;
-			case	eCloseArray:	return "eCloseArray"; break;
-			case	eColon:			return "eColon"; break;
-			case	eComma:			return "eComma"; break;
-			case	eTrue:			return "eTrue"; break;
-			case	eFalse:			return "eFalse"; break;
-			case	eNull:			return "eNull"; break;
-			case	eString:		return "eString"; break;
-			case	eInt:			return "eInt"; break;
-			case	eFloat:			return "eFloat"; break;
-			case	eError:			return "eError"; break;
-			case	eEnd:			return "eEnd"; break;
-			default: return "unknown"; break;
+				operand.literal.text = operand.literal.storage.data();
+				operand.literal.size = operand.literal.storage.size();
 			}
 		}
+	}
 
-		// acts like a generator for the tokens
-		class TokenStream
+	Path::~Path()
+	{
+	}
+
+	void Path::select(const Value& root, std::vector<const Value *>& matches) const
+	{
+		matches.clear();
+		if(valid()) plan->walk(root, 1, root, matches);
+	}
+
+	std::vector<const Value *> Path::select(const Value& root) const
+	{
+		std::vector<const Value *> matches;
+		select(root, matches);
+		return matches;
+	}
+
+	bool Path::select(const char * src, size_t size, std::vector<Span<char>>& matches) const
+	{
+		matches.clear();
+		if(!valid()) return false;
+		// the walk is given each value's own text, so trim the space around the document
+		while(size && Detail::isSpace(*src)) { ++src; --size; }
+		while(size && Detail::isSpace(src[size - 1])) --size;
+		return plan->walk(src, size, 1, Span<char>(src, (unsigned int) size), matches);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Projection
+	//////////////////////////////////////////////////////////////////////////////////////
+	Projection::Projection(std::initializer_list<const char *> paths) : nodes(1), ok(true)
+	{
+		nodes[0].whole = false;
+		for(const char * path : paths) add(path);
+	}
+
+	Projection::Projection(const std::vector<std::string>& paths) : nodes(1), ok(true)
+	{
+		nodes[0].whole = false;
+		for(auto& path : paths) add(path);
+	}
+
+	void Projection::add(const std::string& path)
+	{
+		Pointer pointer(path);
+		if(!pointer.valid())
 		{
-		public:
-			TokenStream(const std::string& str)
-				: src(str)
-				, itr(src.begin())
-				, hasErrorMsg(false)
-			{}
-			bool isFinished() const;
-			void advance();
-			Token current();
-			bool hasError() const;
-			const std::string& getError() const;
+			ok = false;
+			return;
+		}
+		unsigned int node = 0;
+		for(auto& step : pointer.steps)
+		{
+			unsigned int next = 0;
+			for(auto& child : nodes[node].children)
+			{
+				if(child.first.key == step.key) next = child.second;
+			}
+			if(!next)
+			{
+				next = (unsigned int) nodes.size();
+				nodes[node].children.push_back(std::make_pair(step, next));
+				nodes.push_back(Node());
+				nodes.back().whole = false;
+			}
+			node = next;
+		}
+		nodes[node].whole = true;
+	}
 
-		private:
-			Token scanTrue();
-			Token scanFalse();
-			Token scanNull();
-			Token scanString();
-			Token scanNumber();
-			bool isNumber();
+	UniqueValue parse(const std::string& src, const Projection& projection)
+	{
+		if(!projection.valid())
+		{
+			fprintf(stderr, "Error: Invalid projection path.\n");
+			return UniqueValue(newNull());
+		}
 
-			Token next();
-			void error(const std::string& message);
+		// each value is matched against the trie node for its path
+		struct Walk
+		{
+			const Projection& projection;
+			const char * src;
+			Reader reader;
+			std::string error;
+			size_t offset;
 
-			Token currentToken;
-			std::string src;
-			std::string::iterator itr; // current position
-			bool hasErrorMsg;
-			std::string errorMsg;
+			bool fail(const std::string& message, size_t at)	{ error = message; offset = at; return false; }
+
+			bool project(unsigned int node, Value *& val)
+			{
+				const Projection::Node& here = projection.nodes[node];
+				val = nullptr;
+				if(here.whole)
+				{
+					const char * data;
+					size_t size;
+					if(!reader.skipValue(data, size)) return fail(reader.getError(), reader.getOffset());
+					TreeBuilder builder;
+					BasicParser<TreeBuilder> parser(builder);
+					if(!parser.parse(data, size)) return fail(parser.getError(), data - src + parser.getOffset());
+					val = builder.release();
+					return true;
+				}
+
+				if(reader.isObject())
+				{
+					UniqueValue object(newObject());
+					const char * keyData;
+					size_t keySize;
+					reader.startObject();
+					while(reader.nextKey(keyData, keySize))
+					{
+						unsigned int child = 0;
+						for(auto& step : here.children)
+						{
+							if(step.first.key.size() == keySize && memcmp(step.first.key.data(), keyData, keySize) == 0) child = step.second;
+						}
+						if(!child)
+						{
+							reader.skipValue();
+							continue;
+						}
+						std::string key(keyData, keySize);	// parsing the value can reuse the reader's copy
+						Value * member;
+						if(!project(child, member)) return false;
+						if(member) object->add(key, member);
+					}
+					if(reader.failed()) return fail(reader.getError(), reader.getOffset());
+					val = object.release();
+				}
+				else if(reader.isArray())
+				{
+					unsigned int last = 0;
+					bool any = false;
+					for(auto& step : here.children)
+					{
+						if(step.first.isIndex)
+						{
+							last = std::max(last, step.first.index);
+							any = true;
+						}
+					}
+					UniqueValue array(newArray());
+					reader.startArray();
+					for(unsigned int i = 0; reader.nextElement(); ++i)
+					{
+						unsigned int child = 0;
+						for(auto& step : here.children)
+						{
+							if(step.first.isIndex && step.first.index == i) child = step.second;
+						}
+						Value * element = nullptr;
+						if(child && !project(child, element)) return false;
+						if(!child) reader.skipValue();
+						if(any && i <= last) array->add(element ? element : newNull());
+					}
+					if(reader.failed()) return fail(reader.getError(), reader.getOffset());
+					val = array.release();
+				}
+				else if(!reader.skipValue())
+				{
+					return fail(reader.getError(), reader.getOffset());
+				}
+				return true;
+			}
 		};
-		// public
-		bool TokenStream::isFinished() const
+
+		Walk walk = { projection, src.data(), Reader(src), std::string(), 0 };
+		Value * root;
+		bool ok = walk.project(0, root);
+		UniqueValue rtn(root ? root : newNull());
+		if(!ok || (!walk.reader.finish() && !walk.fail(walk.reader.getError(), walk.reader.getOffset())))
 		{
-			return itr == src.end();
+			fprintf(stderr, "Error: %s (at offset %u)\n", walk.error.c_str(), (unsigned int) walk.offset);
+			return UniqueValue(newNull());
 		}
-		void TokenStream::advance()
+		return rtn;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// NDJSON line filter
+	//////////////////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		// whether the needle is in the text: compares the needle's first and last bytes
+		// at 16 positions at a time and checks the rest only where both match
+		bool contains(const char * text, size_t size, const std::string& needle)
 		{
-			if(!isFinished()) currentToken = next();
+			size_t length = needle.size();
+			if(!length) return true;
+			if(length > size) return false;
+			size_t i = 0;
+#ifdef JSON_SSE2
+			__m128i first = _mm_set1_epi8(needle[0]);
+			__m128i last = _mm_set1_epi8(needle[length - 1]);
+			for(; i + length - 1 + 16 <= size; i += 16)
+			{
+				__m128i heads = _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *) (text + i)));
+				__m128i tails = _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i *) (text + i + length - 1)));
+				unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_and_si128(heads, tails));
+				for(unsigned int bit = 0; mask; ++bit, mask >>= 1)
+				{
+					if((mask & 1) && memcmp(text + i + bit, needle.data(), length) == 0) return true;
+				}
+			}
+#endif
+			while(i + length <= size)
+			{
+				const char * hit = (const char *) memchr(text + i, needle[0], size - length + 1 - i);
+				if(!hit) return false;
+				if(memcmp(hit, needle.data(), length) == 0) return true;
+				i = hit - text + 1;
+			}
+			return false;
 		}
-		Token TokenStream::current()
+
+		// the text a string is usually written as, or empty if it has characters that
+		// need escaping (and so could be escaped in more than one way)
+		std::string quoted(const char * str, size_t size)
 		{
-			return currentToken;
+			if(needsEscape(str, size)) return std::string();
+			std::string rtn(1, '"');
+			rtn.append(str, size);
+			rtn += '"';
+			return rtn;
 		}
-		bool TokenStream::hasError() const
+	}
+
+	LineFilter::LineFilter(const std::string& path, const std::string& value) : pointer(path), ok(pointer.valid())
+	{
+		Reader reader(value);
+		const char * data;
+		size_t size;
+		if(!reader.skipValue(data, size) || !reader.finish() || *data == '{' || *data == '[')
 		{
-			return hasErrorMsg;
+			ok = false;
+			return;
 		}
-		const std::string& TokenStream::getError() const
+		this->value.assign(data, size);
+
+		if(pointer.depth()) keyNeedle = quoted(pointer.steps.back().key.data(), pointer.steps.back().key.size());
+		PathScalar scalar;
+		scalarOf(data, size, scalar);
+		if(scalar.kind == PathScalar::eString)	valueNeedle = quoted(scalar.text, scalar.size);
+		else if(scalar.kind != PathScalar::eNumber)	valueNeedle = this->value;
+	}
+
+	bool LineFilter::matches(const char * line, size_t size) const
+	{
+		if(!ok) return false;
+
+		// a missing needle rules the line out unless an escape could have spelled it differently
+		if((!contains(line, size, keyNeedle) || !contains(line, size, valueNeedle)) && !memchr(line, '\\', size)) return false;
+
+		Span<char> text;
+		if(!pointer.resolve(line, size, text)) return false;
+		if(text.size == value.size() && memcmp(text.data, value.data(), value.size()) == 0) return true;
+		PathScalar found, wanted;
+		scalarOf(text.data, text.size, found);
+		scalarOf(value.data(), value.size(), wanted);
+		return equal(found, wanted);
+	}
+
+	size_t LineFilter::select(const char * data, size_t size, std::vector<Span<char>>& lines, bool last) const
+	{
+		size_t start = 0;
+		while(start < size)
 		{
-			return errorMsg;
+			const char * newline = (const char *) memchr(data + start, '\n', size - start);
+			if(!newline && !last) break;
+			size_t stop = newline ? newline - data : size;
+			size_t length = stop - start;
+			if(length && data[stop - 1] == '\r') --length;
+			if(length && matches(data + start, length)) lines.push_back(Span<char>(data + start, (unsigned int) length));
+			start = newline ? stop + 1 : size;
 		}
-		// private
-		Token TokenStream::next()
+		return start;
+	}
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Persistent values
+	// Nothing is changed once built: an edit copies the nodes on the way down to the
+	// change and points the copies at the untouched nodes beside them.  An object trie
+	// uses five bits of the key's hash per level; a slot is either a member or a deeper
+	// node, and keys whose hashes match in every bit share a list at the bottom.  An
+	// array trie has 32 elements in each leaf and 32 children in each node above, with
+	// index bits picking the child at each level.
+	//////////////////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		struct HamtNode;
+		struct ChunkNode;
+
+		struct HamtEntry
 		{
-			assert(!isFinished());
+			unsigned int hash;
+			std::string key;
+			PersistentValue value;
+			std::shared_ptr<const HamtNode> child;	// a deeper node rather than a member
+		};
 
-			Token rtn;
-			while(isspace(*itr)) ++itr;
-			switch(*itr)
+		struct HamtNode
+		{
+			unsigned int bitmap;	// the slots in use, each with an entry in slot order
+			std::vector<HamtEntry> entries;
+		};
+
+		struct ChunkNode
+		{
+			std::vector<std::shared_ptr<const ChunkNode>> children;
+			std::vector<PersistentValue> values;	// in leaves
+		};
+
+		const unsigned int hashBits = 32;
+
+		unsigned int bitCount(unsigned int bits)
+		{
+			bits = bits - ((bits >> 1) & 0x55555555);
+			bits = (bits & 0x33333333) + ((bits >> 2) & 0x33333333);
+			return (((bits + (bits >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+		}
+	}
+
+	struct PersistentValue::Node
+	{
+		Node(StaticValue::Type type) : type(type), integer(0), count(0), shift(0) {}
+
+		StaticValue::Type type;
+		union
+		{
+			int integer;
+			float real;
+			bool boolean;
+		};
+		std::string text;
+		unsigned int count;			// members or elements
+		unsigned int shift;			// of the array trie's root
+		std::shared_ptr<const HamtNode> members;
+		std::shared_ptr<const ChunkNode> elements;
+	};
+
+	namespace
+	{
+		typedef PersistentValue::Node PersistentNode;
+
+		const PersistentValue * findMember(const HamtNode * node, unsigned int hash, const std::string& key, unsigned int shift)
+		{
+			while(node)
 			{
-			case '{': rtn = Token(Token::eOpenObject); break;
-			case '}': rtn = Token(Token::eCloseObject); break;
-			case '[': rtn = Token(Token::eOpenArray); break;
-			case ']': rtn = Token(Token::eCloseArray); break;
-			case ':': rtn = Token(Token::eColon); break;
-			case ',': rtn = Token(Token::eComma); break;
-			case 't': rtn = scanTrue(); break;
-			case 'f': rtn = scanFalse(); break;
-			case 'n': rtn = scanNull(); break;
-			case '"': rtn = scanString(); break;
-			default:
-				if(isNumber())
-				{
-					rtn = scanNumber();
-				}
-				else
+				if(shift >= hashBits)
 				{
-					// TODO: log some error information here
-					rtn = Token(Token::eError);
+					for(auto& entry : node->entries)
+					{
+						if(entry.key == key) return &entry.value;
+					}
+					return nullptr;
 				}
-				break;
+				unsigned int bit = 1u << ((hash >> shift) & 31);
+				if(!(node->bitmap & bit)) return nullptr;
+				const HamtEntry& entry = node->entries[bitCount(node->bitmap & (bit - 1))];
+				if(!entry.child) return entry.key == key ? &entry.value : nullptr;
+				node = entry.child.get();
+				shift += 5;
 			}
-			++ itr;
-			return rtn;
+			return nullptr;
 		}
-		Token TokenStream::scanTrue()
+
+		std::shared_ptr<const HamtNode> addMember(const HamtNode * node, const HamtEntry& member, unsigned int shift, bool& added)
 		{
-			if(*++itr == 'r' && *++itr == 'u' && *++itr == 'e')
+			std::shared_ptr<HamtNode> rtn = node ? std::make_shared<HamtNode>(*node) : std::make_shared<HamtNode>();
+			if(!node) rtn->bitmap = 0;
+			if(shift >= hashBits)
 			{
-				return Token(Token::eTrue);
+				for(auto& entry : rtn->entries)
+				{
+					if(entry.key == member.key)
+					{
+						entry.value = member.value;
+						return rtn;
+					}
+				}
+				rtn->entries.push_back(member);
+				added = true;
+				return rtn;
+			}
+
+			unsigned int bit = 1u << ((member.hash >> shift) & 31);
+			unsigned int slot = bitCount(rtn->bitmap & (bit - 1));
+			if(!(rtn->bitmap & bit))
+			{
+				rtn->bitmap |= bit;
+				rtn->entries.insert(rtn->entries.begin() + slot, member);
+				added = true;
+				return rtn;
+			}
+			HamtEntry& entry = rtn->entries[slot];
+			if(entry.child)
+			{
+				entry.child = addMember(entry.child.get(), member, shift + 5, added);
+			}
+			else if(entry.key == member.key)
+			{
+				entry.value = member.value;
 			}
 			else
 			{
-				error("Failed to parse token: 'true'");
-				return Token(Token::eError);
+				// two members in one slot move down a level
+				bool ignored = false;
+				HamtEntry pushed = entry;
+				entry.child = addMember(addMember(nullptr, pushed, shift + 5, ignored).get(), member, shift + 5, added);
+				entry.key.clear();
+				entry.value = PersistentValue();
 			}
+			return rtn;
 		}
-		Token TokenStream::scanFalse()
+
+		// null when the last member goes
+		std::shared_ptr<const HamtNode> removeMember(const std::shared_ptr<const HamtNode>& node, unsigned int hash, const std::string& key, unsigned int shift, bool& removed)
 		{
-			if(*++itr == 'a' && *++itr == 'l' && *++itr == 's' && *++itr == 'e')
+			if(shift >= hashBits)
 			{
-				return Token(Token::eFalse);
+				for(size_t i = 0; i < node->entries.size(); ++i)
+				{
+					if(node->entries[i].key != key) continue;
+					removed = true;
+					if(node->entries.size() == 1) return nullptr;
+					std::shared_ptr<HamtNode> rtn = std::make_shared<HamtNode>(*node);
+					rtn->entries.erase(rtn->entries.begin() + i);
+					return rtn;
+				}
+				return node;
+			}
+
+			unsigned int bit = 1u << ((hash >> shift) & 31);
+			if(!(node->bitmap & bit)) return node;
+			unsigned int slot = bitCount(node->bitmap & (bit - 1));
+			const HamtEntry& entry = node->entries[slot];
+			std::shared_ptr<const HamtNode> child;
+			if(entry.child)
+			{
+				child = removeMember(entry.child, hash, key, shift + 5, removed);
+				if(!removed) return node;
+			}
+			else if(entry.key == key)
+			{
+				removed = true;
 			}
 			else
 			{
-				error("Failed to parse token: 'false'");
-				return Token(Token::eError);
+				return node;
 			}
-		}
-		Token TokenStream::scanNull()
-		{
-			if(*++itr == 'u' && *++itr == 'l' && *++itr == 'l')
+
+			std::shared_ptr<HamtNode> rtn = std::make_shared<HamtNode>(*node);
+			if(!child)
 			{
-				return Token(Token::eNull);
+				rtn->bitmap &= ~bit;
+				rtn->entries.erase(rtn->entries.begin() + slot);
+				if(rtn->entries.empty()) return nullptr;
+			}
+			else if(child->entries.size() == 1 && !child->entries[0].child)
+			{
+				rtn->entries[slot] = child->entries[0];	// a lone member moves back up
 			}
 			else
 			{
-				error("Failed to parse token: 'null'");
-				return Token(Token::eError);
+				rtn->entries[slot].child = child;
 			}
+			return rtn;
 		}
-		Token TokenStream::scanString()
+
+		void eachMember(const HamtNode * node, const std::function<void(const HamtEntry&)>& visit)
 		{
-			std::stringstream s;
-			++itr;
-			while(*itr != '"')
+			if(!node) return;
+			for(auto& entry : node->entries)
 			{
-				if(itr == src.end())
-				{
-					error("Reached end of characters while parsing string.");
-					return Token(Token::eError);
-				}
-				else
-				{
-					s << *itr;
-				}
-				++itr;
+				if(entry.child) eachMember(entry.child.get(), visit);
+				else visit(entry);
 			}
-			return Token(Token::eString, s.str());
 		}
-		Token TokenStream::scanNumber()
+
+		const PersistentValue * elementAt(const PersistentNode& array, unsigned int index)
 		{
-			// TODO: This methood does not handle the exponential part of a number
-			bool hasDot = false;
-			std::stringstream s;
-			if(*itr == '-') 
-			{ 
-				s << '-';
-				++itr;
+			if(index >= array.count) return nullptr;
+			const ChunkNode * node = array.elements.get();
+			for(unsigned int shift = array.shift; shift > 0; shift -= 5)
+			{
+				node = node->children[(index >> shift) & 31].get();
 			}
-			while(isdigit(*itr) || (!hasDot && *itr == '.'))
+			return &node->values[index & 31];
+		}
+
+		std::shared_ptr<const ChunkNode> setElement(const ChunkNode& node, unsigned int shift, unsigned int index, const PersistentValue& value)
+		{
+			std::shared_ptr<ChunkNode> rtn = std::make_shared<ChunkNode>(node);
+			if(shift == 0) rtn->values[index & 31] = value;
+			else rtn->children[(index >> shift) & 31] = setElement(*node.children[(index >> shift) & 31], shift - 5, index, value);
+			return rtn;
+		}
+
+		// adds element index, making the nodes on its path that don't exist yet
+		std::shared_ptr<const ChunkNode> pushElement(const ChunkNode * node, unsigned int shift, unsigned int index, const PersistentValue& value)
+		{
+			std::shared_ptr<ChunkNode> rtn = node ? std::make_shared<ChunkNode>(*node) : std::make_shared<ChunkNode>();
+			if(shift == 0)
 			{
-				if(!hasDot && *itr == '.')
-				{
-					hasDot = true;
-					s << *itr;
-				}
-				else if(isdigit(*itr))
-				{
-					s << *itr;
-				}
-				else
-				{
-					error("Encountered illegal character while parsing number");
-				}
-				++itr;
+				rtn->values.push_back(value);
+				return rtn;
 			}
-			--itr; // YUCK! try and get rid of this.
-			if(hasError())
+			unsigned int child = (index >> shift) & 31;
+			if(child < rtn->children.size()) rtn->children[child] = pushElement(rtn->children[child].get(), shift - 5, index, value);
+			else rtn->children.push_back(pushElement(nullptr, shift - 5, index, value));
+			return rtn;
+		}
+
+		void eachElement(const ChunkNode * node, unsigned int shift, const std::function<void(const PersistentValue&)>& visit)
+		{
+			if(!node) return;
+			if(shift == 0)
 			{
-				return Token(Token::eError);
+				for(auto& value : node->values) visit(value);
+				return;
 			}
-			if(hasDot)
+			for(auto& child : node->children) eachElement(child.get(), shift - 5, visit);
+		}
+
+		// an array of the values built from the leaves up
+		std::shared_ptr<PersistentNode> arrayOf(const std::vector<PersistentValue>& values)
+		{
+			std::shared_ptr<PersistentNode> rtn = std::make_shared<PersistentNode>(StaticValue::eArray);
+			rtn->count = (unsigned int) values.size();
+			if(values.empty()) return rtn;
+
+			std::vector<std::shared_ptr<const ChunkNode>> level;
+			for(size_t i = 0; i < values.size(); i += 32)
 			{
-				return Token(Token::eFloat, s.str());
+				std::shared_ptr<ChunkNode> leaf = std::make_shared<ChunkNode>();
+				leaf->values.assign(values.begin() + i, values.begin() + std::min(values.size(), i + 32));
+				level.push_back(leaf);
 			}
-			else
+			while(level.size() > 1)
 			{
-				return Token(Token::eInt, s.str());
+				std::vector<std::shared_ptr<const ChunkNode>> parents;
+				for(size_t i = 0; i < level.size(); i += 32)
+				{
+					std::shared_ptr<ChunkNode> parent = std::make_shared<ChunkNode>();
+					parent->children.assign(level.begin() + i, level.begin() + std::min(level.size(), i + 32));
+					parents.push_back(parent);
+				}
+				level.swap(parents);
+				rtn->shift += 5;
 			}
+			rtn->elements = level[0];
+			return rtn;
 		}
-		bool TokenStream::isNumber()
+
+		PersistentValue nullPersistent;
+		const std::string emptyText;
+	}
+
+	PersistentValue::PersistentValue() {}
+
+	PersistentValue::PersistentValue(int value)
+	{
+		std::shared_ptr<Node> rtn = std::make_shared<Node>(StaticValue::eInt);
+		rtn->integer = value;
+		node = rtn;
+	}
+
+	PersistentValue::PersistentValue(float value)
+	{
+		std::shared_ptr<Node> rtn = std::make_shared<Node>(StaticValue::eFloat);
+		rtn->real = value;
+		node = rtn;
+	}
+
+	PersistentValue::PersistentValue(bool value)
+	{
+		std::shared_ptr<Node> rtn = std::make_shared<Node>(StaticValue::eBool);
+		rtn->boolean = value;
+		node = rtn;
+	}
+
+	PersistentValue::PersistentValue(const std::string& value)
+	{
+		std::shared_ptr<Node> rtn = std::make_shared<Node>(StaticValue::eString);
+		rtn->text = value;
+		node = rtn;
+	}
+
+	PersistentValue::PersistentValue(const char * value) : PersistentValue(std::string(value)) {}
+
+	PersistentValue::PersistentValue(const Value& val)
+	{
+		if(val.isObject())
 		{
-			return isdigit(*itr) != 0 || *itr == '-';
+			std::shared_ptr<Node> rtn = std::make_shared<Node>(StaticValue::eObject);
+			val.forEachMember([&rtn](const char * key, size_t size, const Value& member)
+			{
+				HamtEntry entry;
+				entry.key.assign(key, size);
+				entry.hash = hashKey(key, size);
+				entry.value = PersistentValue(member);
+				bool added = false;
+				rtn->members = addMember(rtn->members.get(), entry, 0, added);
+				if(added) ++rtn->count;
+			});
+			node = rtn;
 		}
-		void TokenStream::error(const std::string& message)
+		else if(val.isArray())
 		{
-			errorMsg = message;
-			hasErrorMsg = true;
+			std::vector<PersistentValue> values;
+			values.reserve(val.size());
+			forEachElement(val, [&values](const Value& element) { values.push_back(PersistentValue(element)); });
+			node = arrayOf(values);
 		}
+		else if(val.isInt())	*this = PersistentValue(val.asInt());
+		else if(val.isFloat())	*this = PersistentValue(val.asFloat());
+		else if(val.isBool())	*this = PersistentValue(val.asBool());
+		else if(val.isString())	*this = PersistentValue(val.asString());
+		else if(val.isBytes())	*this = PersistentValue(base64url(val.asBytes()));
+	}
 
-		// recursive parser
-		class Parser
-		{
-		public:
-			Parser(const std::string& str)
-				: tokens(str) 
-				, hasError(false) {}
+	PersistentValue PersistentValue::emptyObject()	{ return PersistentValue(std::make_shared<Node>(StaticValue::eObject)); }
+	PersistentValue PersistentValue::emptyArray()	{ return PersistentValue(std::make_shared<Node>(StaticValue::eArray)); }
 
-			UniqueValue getValue();
+	bool PersistentValue::isNull() const	{ return !node; }
+	bool PersistentValue::isInt() const		{ return node && node->type == StaticValue::eInt; }
+	bool PersistentValue::isFloat() const	{ return node && node->type == StaticValue::eFloat; }
+	bool PersistentValue::isString() const	{ return node && node->type == StaticValue::eString; }
+	bool PersistentValue::isBool() const	{ return node && node->type == StaticValue::eBool; }
+	bool PersistentValue::isObject() const	{ return node && node->type == StaticValue::eObject; }
+	bool PersistentValue::isArray() const	{ return node && node->type == StaticValue::eArray; }
 
-		private:
-			// helpers
-			bool accept(Token::Type type);
-			bool expect(Token::Type type);
-			bool peek(Token::Type type);
-			void next();
-			void error(const std::string& message);
+	int PersistentValue::asInt() const						{ assert(isInt()); return node->integer; }
+	float PersistentValue::asFloat() const					{ assert(isFloat()); return node->real; }
+	bool PersistentValue::asBool() const					{ assert(isBool()); return node->boolean; }
+	const std::string& PersistentValue::asString() const	{ return isString() ? node->text : emptyText; }
 
-			// recursive decent functions
-			void object();
-			void members();
-			void pair();
-			void array();
-			void elements();
-			void value();
+	unsigned int PersistentValue::size() const
+	{
+		return isObject() || isArray() ? node->count : 0;
+	}
 
-			// build helpers
-			void push(Json::Value * val)	{ stack.push_back(val); }
-			template<typename T> T* pop()	{ Json::Value * rtn = stack.back(); stack.pop_back(); return (T*) rtn; }
-			template<typename T> T* top()	{ return (T*) stack.back(); }
+	PersistentValue PersistentValue::get(const std::string& key) const
+	{
+		if(!isObject()) return nullPersistent;
+		const PersistentValue * found = findMember(node->members.get(), hashKey(key.data(), key.size()), key, 0);
+		return found ? *found : nullPersistent;
+	}
 
-			TokenStream tokens;			
-			std::vector<Json::Value*> stack; // pointers to the current object that we are adding to
+	PersistentValue PersistentValue::operator[](unsigned int index) const
+	{
+		const PersistentValue * found = isArray() ? elementAt(*node, index) : nullptr;
+		return found ? *found : nullPersistent;
+	}
 
-			bool hasError;
-			std::string errorMsg;
-		};
-		UniqueValue Parser::getValue()
+	PersistentValue PersistentValue::at(const Pointer& path) const
+	{
+		if(!path.valid()) return nullPersistent;
+		PersistentValue val = *this;
+		for(auto& step : path.steps)
 		{
-			next();
-			object();
-			if(hasError)
-			{
-				// TODO: have error reporting as a switch or return somekind of error value or message on the null value
-				fprintf(stderr, "Error: %s", errorMsg.c_str());
-				return UniqueValue(newNull());
-			}
-			else
-			{
-				return UniqueValue(pop<ObjectValue>()); // the client code now owns the value
-			}
+			if(val.isObject())		val = val.get(step.key);
+			else if(val.isArray() && step.isIndex)	val = val[step.index];
+			else					return nullPersistent;
 		}
-		bool Parser::accept(Token::Type type)
+		return val;
+	}
+
+	void PersistentValue::forEachMember(const std::function<void(const std::string& key, const PersistentValue& value)>& visit) const
+	{
+		if(isObject()) eachMember(node->members.get(), [&visit](const HamtEntry& entry) { visit(entry.key, entry.value); });
+	}
+
+	// rtn is the new value of val with the path from step on changed
+	bool PersistentValue::assign(const PersistentValue& val, const Pointer& path, size_t step, const PersistentValue& value, bool remove, PersistentValue& rtn)
+	{
+		if(step == path.steps.size())
 		{
-			if(tokens.current().type == type)
-			{
-				next();
-				return true;
-			}
-			return false;
+			rtn = value;
+			return !remove;		// the root itself can't be removed
 		}
-		bool Parser::expect(Token::Type type)
+		const Pointer::Step& at = path.steps[step];
+		bool last = step + 1 == path.steps.size();
+		if(val.isObject())
 		{
-			if(accept(type))
+			unsigned int hash = hashKey(at.key.data(), at.key.size());
+			const PersistentValue * found = findMember(val.node->members.get(), hash, at.key, 0);
+			if(!found && !(last && !remove)) return false;
+			std::shared_ptr<Node> object = std::make_shared<Node>(*val.node);
+			if(last && remove)
 			{
-				return true;
+				bool removed = false;
+				object->members = removeMember(object->members, hash, at.key, 0, removed);
+				--object->count;
 			}
 			else
 			{
-				error("expect: unexpected symbol");
-				return false;
+				HamtEntry entry;
+				entry.hash = hash;
+				entry.key = at.key;
+				if(!assign(found ? *found : nullPersistent, path, step + 1, value, remove, entry.value)) return false;
+				bool added = false;
+				object->members = addMember(object->members.get(), entry, 0, added);
+				if(added) ++object->count;
 			}
+			rtn = PersistentValue(object);
+			return true;
 		}
-		void Parser::next()
+		if(val.isArray())
 		{
-			if(tokens.isFinished())
+			unsigned int index = at.key == "-" ? val.node->count : at.index;
+			if(!(at.isIndex || at.key == "-") || index > val.node->count || (index == val.node->count && !(last && !remove))) return false;
+			if(last && remove)
 			{
-				// TODO: Should there be an error if we call next and it's finished?
-				//error("Reached end of token stream.  Document not valid.");
+				// later elements move down, so the trie is rebuilt
+				std::vector<PersistentValue> values;
+				values.reserve(val.node->count);
+				eachElement(val.node->elements.get(), val.node->shift, [&values](const PersistentValue& element) { values.push_back(element); });
+				values.erase(values.begin() + index);
+				rtn = PersistentValue(arrayOf(values));
+				return true;
 			}
-			else
+			std::shared_ptr<Node> array = std::make_shared<Node>(*val.node);
+			if(index == array->count)
 			{
-				tokens.advance();
-				if(tokens.hasError())
+				if(array->count && (unsigned long long) array->count == 1ull << (array->shift + 5))
 				{
-					error("Lexical Error: " + tokens.getError());
+					// full, so the trie grows a level
+					std::shared_ptr<ChunkNode> root = std::make_shared<ChunkNode>();
+					root->children.push_back(array->elements);
+					array->elements = root;
+					array->shift += 5;
 				}
+				array->elements = pushElement(array->elements.get(), array->shift, index, value);
+				++array->count;
 			}
+			else
+			{
+				PersistentValue element;
+				if(!assign(*elementAt(*val.node, index), path, step + 1, value, remove, element)) return false;
+				array->elements = setElement(*array->elements, array->shift, index, element);
+			}
+			rtn = PersistentValue(array);
+			return true;
 		}
-		bool Parser::peek(Token::Type type)
-		{
-			return tokens.current().type == type;
-		}
-		void Parser::error(const std::string& message)
-		{
-			hasError = true;
-			errorMsg = message;
-		}
-		void Parser::object()
+		return false;
+	}
+
+	PersistentValue PersistentValue::set(const Pointer& path, const PersistentValue& value) const
+	{
+		PersistentValue rtn;
+		return path.valid() && assign(*this, path, 0, value, false, rtn) ? rtn : *this;
+	}
+
+	PersistentValue PersistentValue::remove(const Pointer& path) const
+	{
+		PersistentValue rtn;
+		return path.valid() && assign(*this, path, 0, PersistentValue(), true, rtn) ? rtn : *this;
+	}
+
+	UniqueValue PersistentValue::toValue() const
+	{
+		if(isObject())
 		{
-			expect(Token::eOpenObject);
-			push( newObject() );
-			members();
-			expect(Token::eCloseObject);
+			UniqueValue rtn(newObject());
+			eachMember(node->members.get(), [&rtn](const HamtEntry& entry) { rtn->add(entry.key, entry.value.toValue().release()); });
+			return rtn;
 		}
-		void Parser::members()
+		if(isArray())
 		{
-			do {
-				pair();
-			} while(accept(Token::eComma));
+			// numbers and bools are packed as the parser would
+			ArrayValue * array = new ArrayValue();
+			UniqueValue rtn(array);
+			eachElement(node->elements.get(), node->shift, [array](const PersistentValue& element)
+			{
+				if(element.isInt())			array->addInt(element.asInt());
+				else if(element.isFloat())	array->addFloat(element.asFloat());
+				else if(element.isBool())	array->addBool(element.asBool());
+				else						array->add(element.toValue().release());
+			});
+			return rtn;
 		}
-		void Parser::pair()
+		if(isInt())		return UniqueValue(newInt(node->integer));
+		if(isFloat())	return UniqueValue(newFloat(node->real));
+		if(isBool())	return UniqueValue(newBool(node->boolean));
+		if(isString())	return UniqueValue(newString(node->text));
+		return UniqueValue(newNull());
+	}
+
+	void PersistentValue::write(Writer& writer) const
+	{
+		if(isObject())
 		{
-			std::string key = tokens.current().value;
-			if(accept(Token::eString))
+			std::vector<const HamtEntry *> members;
+			members.reserve(node->count);
+			eachMember(node->members.get(), [&members](const HamtEntry& entry) { members.push_back(&entry); });
+			std::sort(members.begin(), members.end(), [](const HamtEntry * a, const HamtEntry * b) { return a->key < b->key; });
+			writer.startObject();
+			for(auto member : members)
 			{
-				expect(Token::eColon);
-				value();
-				Json::Value * newVal = pop<Value>();
-				top<ObjectValue>()->add(key, newVal);
+				writer.writeKey(member->key);
+				member->value.write(writer);
 			}
+			writer.endObject();
 		}
-		void Parser::array()
+		else if(isArray())
 		{
-			expect(Token::eOpenArray);
-			push(newArray());
-			elements();
-			expect(Token::eCloseArray);
+			writer.startArray();
+			eachElement(node->elements.get(), node->shift, [&writer](const PersistentValue& element) { element.write(writer); });
+			writer.endArray();
 		}
-		void Parser::elements()
+		else if(isInt())	writer.writeInt(node->integer);
+		else if(isFloat())	writer.writeFloat(node->real);
+		else if(isBool())	writer.writeBool(node->boolean);
+		else if(isString())	writer.writeString(node->text);
+		else				writer.writeNull();
+	}
+
+	std::string PersistentValue::toString() const
+	{
+		std::string rtn;
 		{
-			if(!peek(Token::eCloseArray))
-			{
-				do {
-					value();
-					Json::Value * newVal = pop<Value>();
-					top<ArrayValue>()->add(newVal);
-				} while(accept(Token::eComma));
-			}
+			Writer writer([&rtn](const char * data, size_t size) { rtn.append(data, size); return true; }, 4096);
+			write(writer);
 		}
-		void Parser::value()
+		return rtn;
+	}
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Versioned documents
+	//////////////////////////////////////////////////////////////////////////////////////
+	struct VersionedDocument::State
+	{
+		std::atomic<const Record *> current;
+		Epochs epochs;
+		std::mutex writer;
+
+		// the background collector, woken after each edit
+		std::thread collector;
+		std::mutex lock;
+		std::condition_variable wake;
+		bool pending;
+		bool stop;
+
+		void collect()
 		{
-			std::string val = tokens.current().value;
-			if(accept(Token::eTrue))
-			{
-				push(newBool(true));
-			}
-			else if(accept(Token::eFalse))
-			{
-				push(newBool(false));
-			}
-			else if(accept(Token::eNull))
-			{
-				push(newNull());
-			}
-			else if(accept(Token::eString))
-			{
-				push(newString(val));
-			}
-			else if(accept(Token::eInt))
-			{
-				// TODO: what if this fails?
-				int intVal = strtol (val.c_str(), NULL, 10);
-				push(newInt(intVal));
-			}
-			else if(accept(Token::eFloat))
+			std::unique_lock<std::mutex> guard(lock);
+			while(!stop)
 			{
-				// TODO: what if this fails etc, also there is warning here?
-				float floatVal = (float) atof(val.c_str());
-				push(newFloat(floatVal));
-			}
-			else if(peek(Token::eOpenArray))
-			{
-				array();
-			}
-			else if(peek(Token::eOpenObject))
-			{
-				object();
-			}
-			else
-			{
-				error("Unexpected Token in stream.");
+				wake.wait(guard, [this]() { return pending || stop; });
+				pending = false;
+				guard.unlock();
+				size_t left = epochs.collect();
+				guard.lock();
+
+				// versions still pinned are tried again a little later
+				if(left && !stop) wake.wait_for(guard, std::chrono::milliseconds(5), [this]() { return stop; });
+				if(left) pending = true;
 			}
 		}
+	};
+
+	VersionedDocument::Version::Version(State * state) : counter(state->epochs.enter()), record(state->current)
+	{
 	}
 
-	UniqueValue parse(const std::string& src)
+	VersionedDocument::Version::Version(Version&& other) : counter(other.counter), record(other.record)
 	{
-		return Parser(src).getValue();
+		other.counter = nullptr;
 	}
 
-	std::string listTokens(const std::string& src)
+	VersionedDocument::Version::~Version()
 	{
-		std::stringstream ss;
-		TokenStream tokens(src);
-		while(!tokens.isFinished())
-		{
-			tokens.advance();
-			ss << tokens.current().toString() << "\n";
+		if(counter) --*counter;
+	}
 
-			if(tokens.current().type == Token::eError)
+	VersionedDocument::VersionedDocument(const PersistentValue& root, bool collectInBackground) : state(new State)
+	{
+		Record * first = new Record;
+		first->root = root;
+		first->number = 0;
+		state->current = first;
+		state->pending = false;
+		state->stop = false;
+		if(collectInBackground) state->collector = std::thread([this]() { state->collect(); });
+	}
+
+	VersionedDocument::~VersionedDocument()
+	{
+		if(state->collector.joinable())
+		{
 			{
-				ss << "Error: %s" << tokens.getError().c_str() << "\n";
+				std::lock_guard<std::mutex> guard(state->lock);
+				state->stop = true;
+				state->wake.notify_all();
 			}
+			state->collector.join();
 		}
-		return ss.str();
+		delete state->current.load();
+	}
+
+	VersionedDocument::Version VersionedDocument::read() const
+	{
+		return Version(state.get());
+	}
+
+	bool VersionedDocument::add(const std::string& path, const PersistentValue& value)
+	{
+		Pointer pointer(path);
+		return pointer.valid() && update([&](const PersistentValue& root) { return root.set(pointer, value); });
+	}
+
+	bool VersionedDocument::remove(const std::string& path)
+	{
+		Pointer pointer(path);
+		return pointer.valid() && update([&](const PersistentValue& root) { return root.remove(pointer); });
+	}
+
+	bool VersionedDocument::update(const std::function<PersistentValue(const PersistentValue& root)>& edit)
+	{
+		std::lock_guard<std::mutex> guard(state->writer);
+		const Record * old = state->current;
+		PersistentValue root = edit(old->root);
+		if(root.sameAs(old->root)) return false;
+
+		Record * next = new Record;
+		next->root = root;
+		next->number = old->number + 1;
+		state->current = next;
+		state->epochs.retire([old]() { delete old; });
+		if(state->collector.joinable())
+		{
+			std::lock_guard<std::mutex> wake(state->lock);
+			state->pending = true;
+			state->wake.notify_one();
+		}
+		else
+		{
+			state->epochs.collect();
+		}
+		return true;
+	}
+
+	size_t VersionedDocument::collect()
+	{
+		return state->epochs.collect();
 	}
 }
\ No newline at end of file
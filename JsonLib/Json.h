@@ -1,15 +1,45 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <functional>
+#include <initializer_list>
+#include <iosfwd>
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 namespace Json
 {
+	// read-only view of contiguous elements (e.g. the packed storage of a numeric array)
+	template<typename T>
+	struct Span
+	{
+		Span() : data(nullptr), size(0) {}
+		Span(const T * data, unsigned int size) : data(data), size(size) {}
+
+		const T * begin() const					{ return data; }
+		const T * end() const					{ return data + size; }
+		const T& operator[](unsigned int i) const	{ return data[i]; }
+		bool empty() const						{ return size == 0; }
+
+		const T * data;
+		unsigned int size;
+	};
+
+	class Writer;
+
 	// abstract base class of all value classes
 	// the only part of the hierarchy that is visible to the client code
 	class Value
 	{
 	public:
+		virtual ~Value() {}
+
 		// query the type
 		virtual bool isInt() const;
 		virtual bool isFloat() const;
@@ -18,12 +48,14 @@ namespace Json
 		virtual bool isNull() const;
 		virtual bool isObject() const;
 		virtual bool isArray() const;
+		virtual bool isBytes() const;
 
 		// access the value
 		virtual int asInt() const;
 		virtual float asFloat() const;
 		virtual const std::string& asString() const;
 		virtual bool asBool() const;
+		virtual const std::string& asBytes() const;
 
 		// access and append to object
 		virtual void add(const std::string& key, Value * val);
@@ -39,8 +71,22 @@ namespace Json
 		virtual const Value& operator[](unsigned int key) const;
 		virtual unsigned int size() const;
 
+		// visit each member of an object in key order
+		typedef std::function<void(const char * key, size_t size, const Value& val)> MemberVisitor;
+		virtual void forEachMember(const MemberVisitor& visit) const;
+
+		// zero-copy access to arrays the parser packed as plain ints / floats
+		// (an empty span with null data if the array is not packed as that type)
+		virtual Span<int> asIntSpan() const;
+		virtual Span<float> asFloatSpan() const;
+
 		// stringify the value
-		virtual std::string toString() const = 0;
+		virtual std::string toString() const;
+		virtual void write(Writer& writer) const = 0;
+
+		// values come from per-thread pools of a few block sizes (see poolStats)
+		static void * operator new(size_t size);
+		static void operator delete(void * ptr, size_t size);
 	};
 
 	// named construtors (e.g. Json::Value *obj = Json::newObject(); )
@@ -50,13 +96,1973 @@ namespace Json
 	Value * newFloat(float value);
 	Value * newString(const std::string& value);
 	Value * newBool(bool value);
+	Value * newBytes(const std::string& value);		// binary data, written to JSON as base64url text
 
 	// helpful typedef
 	typedef std::unique_ptr<Value> UniqueValue;
 
-	// parser
+	// Occupancy of the pools that values, object members and their reference counts are
+	// allocated from, one entry per block size summed over every thread.  A thread takes
+	// blocks from its own free lists; blocks freed on another thread go back to the owner
+	// in batches, sent when full or when that thread finishes, and count as in use until
+	// then.  Build Json.cpp with JSON_NO_POOL defined to use plain new and delete instead.
+	struct PoolStats
+	{
+		size_t blockSize;	// bytes a block holds
+		size_t blocks;		// carved from slabs so far
+		size_t inUse;
+	};
+	std::vector<PoolStats> poolStats();
+
+	// read-only value laid out as constant data, as written by the code generator (see
+	// generateSource and jsonc).  The children of a container are consecutive nodes and
+	// object members are sorted by key.  Nodes are constant initialised, so a static
+	// document costs nothing at startup; asString() makes its std::string on first use.
+	class StaticValue : public Value
+	{
+	public:
+		enum Type
+		{
+			eNull = 0,
+			eBool,
+			eInt,
+			eFloat,
+			eString,
+			eObject,
+			eArray
+		};
+
+		// the node's key within its parent object (null outside objects)
+		struct Key
+		{
+			const char * data;
+			unsigned int size;
+		};
+
+		constexpr StaticValue(Key key)												: key(key), type(eNull), cache(nullptr), boolean(false) {}
+		constexpr StaticValue(Key key, bool value)										: key(key), type(eBool), cache(nullptr), boolean(value) {}
+		constexpr StaticValue(Key key, int value)										: key(key), type(eInt), cache(nullptr), integer(value) {}
+		constexpr StaticValue(Key key, float value)										: key(key), type(eFloat), cache(nullptr), real(value) {}
+		constexpr StaticValue(Key key, const char * data, unsigned int size)			: key(key), type(eString), cache(nullptr), text(Text{ data, size }) {}
+		constexpr StaticValue(Key key, Type type, const StaticValue * first, unsigned int count)	: key(key), type(type), cache(nullptr), children(Children{ first, count }) {}
+		virtual ~StaticValue();
+
+		virtual bool isInt() const override										{ return type == eInt; }
+		virtual bool isFloat() const override									{ return type == eFloat; }
+		virtual bool isString() const override									{ return type == eString; }
+		virtual bool isBool() const override									{ return type == eBool; }
+		virtual bool isNull() const override									{ return type == eNull; }
+		virtual bool isObject() const override									{ return type == eObject; }
+		virtual bool isArray() const override									{ return type == eArray; }
+
+		virtual int asInt() const override;
+		virtual float asFloat() const override;
+		virtual const std::string& asString() const override;
+		virtual bool asBool() const override;
+
+		virtual Value& get(const std::string& key) override						{ return const_cast<Value &>(static_cast<const StaticValue &>(*this).get(key)); }
+		virtual const Value& get(const std::string& key) const override;
+		virtual Value& operator[](const std::string& key) override				{ return get(key); }
+		virtual const Value& operator[](const std::string& key) const override	{ return get(key); }
+		virtual Value& operator[](unsigned int key) override					{ return const_cast<StaticValue &>(children.first[key]); }
+		virtual const Value& operator[](unsigned int key) const override		{ return children.first[key]; }
+		virtual unsigned int size() const override;
+		virtual void forEachMember(const MemberVisitor& visit) const override;
+
+		virtual void write(Writer& writer) const override;
+
+	private:
+		StaticValue(const StaticValue&);
+		StaticValue& operator=(const StaticValue&);
+
+		struct Text
+		{
+			const char * data;
+			unsigned int size;
+		};
+		struct Children
+		{
+			const StaticValue * first;
+			unsigned int count;
+		};
+
+		Key key;
+		Type type;
+		mutable std::atomic<std::string *> cache;	// asString()
+		union
+		{
+			bool boolean;
+			int integer;
+			float real;
+			Text text;
+			Children children;
+		};
+	};
+
+	// C++ source defining the value as static data, reachable through
+	// const Json::Value& name();
+	std::string generateSource(const Value& val, const std::string& name);
+
+	// parser (prints any error to stderr and returns null)
 	UniqueValue parse(const std::string& src);
+	UniqueValue parse(const std::string& src, std::string& error);	// no printing, an empty pointer on error
 
 	// tokeniser
 	std::string listTokens(const std::string& src);
+
+	// streams values, or a sequence of events, through a fixed size buffer into a sink
+	// so memory use doesn't depend on the size of the document
+	class Writer
+	{
+	public:
+		// receives each block of output, returns false to abandon the rest of the output
+		typedef std::function<bool(const char * data, size_t size)> Sink;
+
+		explicit Writer(const Sink& sink, size_t capacity = 64 * 1024);
+		Writer(const Sink& sink, char * buffer, size_t capacity);	// uses the caller's buffer, no allocation
+		~Writer();	// flushes anything still buffered
+
+		// write a whole value
+		void write(const Value& val);
+
+		// events (commas and colons are added as needed)
+		void startObject();
+		void endObject();
+		void startArray();
+		void endArray();
+		void writeKey(const std::string& key);
+		void writeKey(const char * key, size_t size);
+		void writeRawKey(const char * text, size_t size);	// already quoted and escaped, with its colon
+		void writeInt(int value);
+		void writeFloat(float value);
+		void writeDouble(double value);						// enough digits to read back exactly
+		void writeString(const std::string& value);
+		void writeString(const char * value, size_t size);
+		void writeStringCopy(const char * value, size_t size);	// never passed through, for text that won't outlive the call
+		void writeBool(bool value);
+		void writeNull();
+
+		// strings of at least threshold bytes that need no escaping are handed to reference
+		// where they are rather than being copied through the buffer
+		void passThrough(const Sink& reference, size_t threshold);
+
+		// pass everything buffered on to the sink
+		void flush();
+
+		// false once the sink has refused some output
+		bool good() const { return !failed; }
+
+	private:
+		Writer(const Writer&);
+		Writer& operator=(const Writer&);
+
+		void separate();
+		void put(char c)							{ if(used == capacity) flush(); buffer[used++] = c; }
+		void put(const char * data, size_t size);
+		void putEscaped(const char * str, size_t size, bool lasting = true);
+		void refused();
+
+		Sink sink;
+		Sink reference;
+		size_t threshold;
+		std::vector<char> storage;
+		char * buffer;
+		size_t capacity;
+		size_t used;
+		bool needComma;
+		bool failed;
+		char discard[16];	// takes the output once the sink has refused some
+	};
+
+	// sinks for the writer
+	Writer::Sink fileSink(int fd);
+	Writer::Sink streamSink(std::ostream& out);
+
+	// Runs the library's parallel work.  A batch is a range of indexes (records, array
+	// chunks) that the executor may cut into pieces of at least grain indexes and run in
+	// any order; run() returns once all of it is done.  Tasks mustn't throw.  Derive from
+	// this to run the library on your own threads.
+	class Executor
+	{
+	public:
+		typedef std::function<void(size_t begin, size_t end)> Task;
+
+		virtual ~Executor() {}
+
+		virtual unsigned int concurrency() const = 0;	// how many pieces can run at once
+		virtual void run(size_t count, const Task& task, size_t grain = 1) = 0;
+	};
+
+	// Each worker keeps a deque of ranges: it splits the bottom one in half until it is no
+	// bigger than grain, pushing the other halves back, and idle workers steal from the
+	// top, where the biggest ranges are.  The calling thread helps with its own batch, and
+	// batches started from inside a task are fine.
+	class ThreadPool : public Executor
+	{
+	public:
+		explicit ThreadPool(unsigned int threads = 0);	// 0 for one per core, counting the caller
+		~ThreadPool();
+
+		unsigned int concurrency() const override;
+		void run(size_t count, const Task& task, size_t grain = 1) override;
+
+	private:
+		ThreadPool(const ThreadPool&);
+		ThreadPool& operator=(const ThreadPool&);
+
+		struct State;
+		std::unique_ptr<State> state;
+	};
+
+	// what the library's parallel operations use unless they're given an executor, a pool
+	// with a thread per core until it is replaced (null puts that back)
+	Executor& defaultExecutor();
+	void setDefaultExecutor(Executor * executor);
+
+	// Frees values on a low priority background thread, so dropping a big document costs
+	// the caller a queue push instead of millions of frees.  Opt in per value with
+	// dispose(), or hold documents as DeferredValue so that going out of scope does it.
+	class Reclaimer
+	{
+	public:
+		Reclaimer();
+		~Reclaimer();	// frees whatever is still queued
+
+		void dispose(UniqueValue val);
+		void dispose(Value * val);
+
+		// wait until everything handed over so far is freed
+		void drain();
+
+	private:
+		Reclaimer(const Reclaimer&);
+		Reclaimer& operator=(const Reclaimer&);
+
+		struct State;
+		std::unique_ptr<State> state;
+	};
+
+	// the shared reclaimer used by DeferredValue, its thread starts on first use
+	Reclaimer& backgroundReclaimer();
+
+	struct DeferredDelete
+	{
+		void operator()(Value * val) const		{ backgroundReclaimer().dispose(val); }
+	};
+	typedef std::unique_ptr<Value, DeferredDelete> DeferredValue;
+
+	// serialise large arrays and objects in chunks across threads (0 for the default
+	// executor, otherwise a pool of that many that is kept for later calls).  The output
+	// is identical to toString()
+	std::string toStringParallel(const Value& val, unsigned int threads = 0);
+	bool writeParallel(const Value& val, const Writer::Sink& sink, unsigned int threads = 0);
+	std::string toStringParallel(const Value& val, Executor& executor);
+	bool writeParallel(const Value& val, const Writer::Sink& sink, Executor& executor);
+
+	// parse a big document on several threads (0 for the default executor, otherwise a
+	// kept pool of that many, as for toStringParallel).  The bytes are
+	// cut into chunks that are scanned at once for their quotes and brackets, each
+	// assuming it starts outside a string and in one; a prefix pass over the chunks then
+	// picks the right answer for each, which gives every chunk its string state and
+	// depth.  The top level array or object is split at its commas nearest the chunk
+	// starts and the runs of elements are parsed on separate threads and joined: arrays
+	// in one pass, objects by merging neighbouring runs pairwise on the executor.  The
+	// result, and any error, is the same as parse(); small documents just use that.
+	UniqueValue parseParallel(const std::string& src, unsigned int threads = 0);
+	UniqueValue parseParallel(const std::string& src, Executor& executor);
+
+	// exact length of the serialised value
+	size_t measure(const Value& val);
+
+	// serialise into the caller's memory without allocating, returns the length of the
+	// output and writes all of it (unterminated) when that is no more than len; if not,
+	// buf holds just the first len bytes and the value is walked again to measure it
+	size_t serializeInto(const Value& val, char * buf, size_t len);
+
+	// scatter-gather output for writev: syntax and small values are copied into scratch
+	// space while large strings that need no escaping are referenced in place, so the
+	// value must outlive the list
+	class GatherList
+	{
+	public:
+		struct Chunk
+		{
+			const char * data;
+			size_t size;
+		};
+
+		explicit GatherList(const Value& val, size_t threshold = 1024);
+
+		const std::vector<Chunk>& chunks() const	{ return pieces; }
+		size_t size() const							{ return total; }
+
+		// write every chunk to the file descriptor, returns false on error
+		bool writeTo(int fd) const;
+
+	private:
+		// chunks point into scratch, so the list stays where it was built
+		GatherList(const GatherList&);
+		GatherList& operator=(const GatherList&);
+
+		std::string scratch;
+		std::vector<Chunk> pieces;
+		size_t total;
+	};
+
+	class Snapshot;
+
+	// a node of an open snapshot, a small handle that's cheap to copy
+	// missing keys and out of range indexes give null nodes
+	class SnapshotNode
+	{
+	public:
+		SnapshotNode() : snapshot(nullptr), index(0) {}
+
+		bool isInt() const;
+		bool isFloat() const;
+		bool isString() const;
+		bool isBool() const;
+		bool isNull() const;
+		bool isObject() const;
+		bool isArray() const;
+
+		int asInt() const;
+		float asFloat() const;
+		bool asBool() const;
+		Span<char> asText() const;			// the string's bytes inside the mapping
+		std::string asString() const;
+
+		SnapshotNode get(const std::string& key) const;
+		SnapshotNode operator[](const std::string& key) const		{ return get(key); }
+		SnapshotNode operator[](unsigned int i) const;
+		unsigned int size() const;
+		Span<char> key() const;				// this node's key within its parent object
+
+		void write(Writer& writer) const;
+		std::string toString() const;
+
+	private:
+		friend class Snapshot;
+		SnapshotNode(const Snapshot * snapshot, unsigned int index) : snapshot(snapshot), index(index) {}
+
+		const Snapshot * snapshot;
+		unsigned int index;
+	};
+
+	// a saved value mapped read-only into memory.  The file holds the nodes as fixed size
+	// records that refer to each other by index, a string table, and hash indexes for
+	// the larger objects, so opening it needs no parsing and no allocation per node.
+	// Snapshots are written in the byte order of the machine that saves them.
+	class Snapshot
+	{
+	public:
+		~Snapshot();
+
+		SnapshotNode root() const								{ return SnapshotNode(this, 0); }
+
+	private:
+		friend class SnapshotNode;
+		friend std::unique_ptr<Snapshot> openSnapshot(const std::string& path);
+		friend std::unique_ptr<Snapshot> freeze(const Value& val);
+		Snapshot() : base(nullptr), length(0), mapping(nullptr), nodes(0), strings(0), indexes(0) {}
+		Snapshot(const Snapshot&);
+		Snapshot& operator=(const Snapshot&);
+
+		const char * base;
+		size_t length;
+		void * mapping;						// file mapping handle on Windows
+		std::unique_ptr<char[]> memory;		// the bytes of a frozen value, which has no file
+		unsigned int nodes;
+		unsigned int strings;				// size of the string table
+		unsigned int indexes;				// number of hash slots
+	};
+
+	// writes the value as a snapshot file, returns false on error
+	bool saveSnapshot(const Value& val, const std::string& path);
+
+	// maps a snapshot file (prints any error to stderr and returns null)
+	std::unique_ptr<Snapshot> openSnapshot(const std::string& path);
+
+	// an immutable copy of the value laid out as a snapshot in one block of memory.  Nothing
+	// in it changes and nothing is reference counted, so any number of threads can read
+	// it at once without locks.
+	std::unique_ptr<Snapshot> freeze(const Value& val);
+
+	// Holds the current snapshot for many reader threads while a writer swaps in new ones,
+	// read-copy-update style.  A reader pins the snapshot it gets for as long as it keeps
+	// the ReadGuard, which costs one atomic increment on a counter striped across cache
+	// lines; readers never wait.  A replaced snapshot is freed once every reader that could
+	// have seen it has let go, checked on each publish() and reclaim() rather than waited
+	// for.
+	class SharedSnapshot
+	{
+		struct State;
+
+	public:
+		class ReadGuard
+		{
+		public:
+			ReadGuard(ReadGuard&& other);
+			~ReadGuard();
+
+			const Snapshot * get() const						{ return snapshot; }
+			SnapshotNode root() const							{ return snapshot ? snapshot->root() : SnapshotNode(); }
+
+		private:
+			friend class SharedSnapshot;
+			ReadGuard(State * state);
+			ReadGuard(const ReadGuard&);
+			ReadGuard& operator=(const ReadGuard&);
+
+			State * state;
+			std::atomic<unsigned int> * counter;	// where this reader is counted
+			const Snapshot * snapshot;
+		};
+
+		explicit SharedSnapshot(std::unique_ptr<Snapshot> snapshot = nullptr);
+		~SharedSnapshot();	// no reader may still hold a guard
+
+		ReadGuard read() const;
+
+		// swap in the next snapshot, from any thread
+		void publish(std::unique_ptr<Snapshot> snapshot);
+
+		// free the replaced snapshots no reader can still see, returns how many are left
+		size_t reclaim();
+
+	private:
+		SharedSnapshot(const SharedSnapshot&);
+		SharedSnapshot& operator=(const SharedSnapshot&);
+
+		std::unique_ptr<State> state;
+	};
+
+	// MessagePack, straight to and from the value tree.  Ints take the smallest encoding
+	// that holds them and floats are written as float 32.  Reading accepts every format
+	// except extensions; map keys must be strings, bin is read as bytes and ints that
+	// don't fit an int become floats (fromMsgPack prints any error to stderr and returns null)
+	std::string toMsgPack(const Value& val);
+	UniqueValue fromMsgPack(const std::string& bytes);
+
+	// JSON text to MessagePack without building a value tree.  Containers are written
+	// with 32 bit headers, as their size isn't known until they end, and numbers that
+	// aren't integers are kept as float 64
+	bool jsonToMsgPack(const std::string& src, std::string& out, std::string& error);
+	bool jsonToMsgPack(const std::string& src, std::string& out);
+
+	// CBOR (RFC 8949), straight to and from the value tree.  Byte strings are bytes values,
+	// ints take the shortest head and floats are written as half precision when that
+	// holds them exactly.  Reading accepts indefinite lengths and skips tags; map keys must
+	// be text, undefined reads as null and ints that don't fit an int become floats
+	// (fromCbor prints any error to stderr and returns null)
+	std::string toCbor(const Value& val);
+	UniqueValue fromCbor(const std::string& bytes);
+
+	// read-only view of CBOR in the caller's buffer, which must outlive it.  Nothing is
+	// copied: text and byte strings are spans of the buffer, so strings split into chunks
+	// (indefinite length) aren't accepted.  Children are found by skipping the ones before
+	// them, so indexing costs time in proportion to the position.
+	class CborView
+	{
+	public:
+		CborView() : item(nullptr), keyData(nullptr), keySize(0) {}	// null
+
+		bool isInt() const;
+		bool isFloat() const;
+		bool isString() const;
+		bool isBytes() const;
+		bool isBool() const;
+		bool isNull() const;
+		bool isObject() const;
+		bool isArray() const;
+
+		int asInt() const;
+		float asFloat() const;
+		double asDouble() const;		// any number
+		bool asBool() const;
+		Span<char> asText() const;
+		std::string asString() const;
+		Span<char> asBytes() const;
+
+		CborView get(const std::string& key) const;
+		CborView operator[](const std::string& key) const		{ return get(key); }
+		CborView operator[](unsigned int i) const;				// array elements or object members in order
+		unsigned int size() const;
+		Span<char> key() const;			// this node's key within its parent object
+
+		void write(Writer& writer) const;
+		std::string toString() const;
+
+	private:
+		friend CborView viewCbor(const char * data, size_t size);
+		CborView(const unsigned char * item, const char * keyData, unsigned int keySize);
+
+		const unsigned char * item;		// past any tags
+		const char * keyData;
+		unsigned int keySize;
+	};
+
+	// checks the buffer holds exactly one well formed item
+	// (prints any error to stderr and returns a null view)
+	CborView viewCbor(const char * data, size_t size);
+	inline CborView viewCbor(const std::string& bytes)			{ return viewCbor(bytes.data(), bytes.size()); }
+	CborView viewCbor(std::string&& bytes) = delete;			// the view would outlive the buffer
+
+	// aggregates over the numbers in an array (other elements are skipped)
+	// packed arrays are reduced directly over their storage
+	unsigned int count(const Value& array);
+	double sum(const Value& array);
+	double minimum(const Value& array);	// NaN if there are no numbers
+	double maximum(const Value& array);	// NaN if there are no numbers
+	double mean(const Value& array);	// NaN if there are no numbers
+
+	// counts per equal width bucket over [lo, hi], numbers outside the range are dropped
+	std::vector<unsigned int> histogram(const Value& array, double lo, double hi, unsigned int buckets);
+
+	// parser features, chosen at compile time so the ones left out cost nothing
+	enum ParseFlags
+	{
+		eValidateUtf8 = 1 << 0,			// reject strings that aren't valid UTF-8
+		eDecodeEscapes = 1 << 1,		// decode escape sequences, otherwise strings are passed on raw
+		eRejectDuplicateKeys = 1 << 2,	// fail on a repeated key, otherwise the handler decides
+		eFastNumbers = 1 << 3,			// convert numbers without strtod, the last digit may be off
+		eDefaultParseFlags = eDecodeEscapes
+	};
+
+	// handler for BasicParser with every event accepted, derive and override what you need
+	// (returning false from an event stops the parse)
+	struct BaseHandler
+	{
+		bool null()										{ return true; }
+		bool boolean(bool)								{ return true; }
+		bool integer(int)								{ return true; }
+		bool number(double)								{ return true; }
+		bool string(const char *, size_t)				{ return true; }
+		bool key(const char *, size_t)					{ return true; }
+		bool startObject()								{ return true; }
+		bool endObject()								{ return true; }
+		bool startArray()								{ return true; }
+		bool endArray()									{ return true; }
+	};
+
+	namespace Detail
+	{
+		constexpr bool isSpace(char c)	{ return c == ' ' || c == '\n' || c == '\r' || c == '\t'; }
+		constexpr bool isDigit(char c)	{ return c >= '0' && c <= '9'; }
+
+		inline void appendUtf8(std::string& str, unsigned int code)
+		{
+			if(code < 0x80)
+			{
+				str += (char) code;
+			}
+			else if(code < 0x800)
+			{
+				str += (char) (0xc0 | (code >> 6));
+				str += (char) (0x80 | (code & 0x3f));
+			}
+			else if(code < 0x10000)
+			{
+				str += (char) (0xe0 | (code >> 12));
+				str += (char) (0x80 | ((code >> 6) & 0x3f));
+				str += (char) (0x80 | (code & 0x3f));
+			}
+			else
+			{
+				str += (char) (0xf0 | (code >> 18));
+				str += (char) (0x80 | ((code >> 12) & 0x3f));
+				str += (char) (0x80 | ((code >> 6) & 0x3f));
+				str += (char) (0x80 | (code & 0x3f));
+			}
+		}
+
+		// length of the UTF-8 sequence at itr, or 0 if it isn't well formed
+		inline size_t utf8Length(const unsigned char * itr, const unsigned char * end)
+		{
+			unsigned char c = itr[0];
+			if(c < 0x80) return 1;
+			size_t len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc2 ? 2 : 0;
+			if(len == 0 || c > 0xf4 || (size_t) (end - itr) < len) return 0;
+			for(size_t i = 1; i < len; ++i)
+			{
+				if((itr[i] & 0xc0) != 0x80) return 0;
+			}
+			// overlong encodings, surrogates and code points past U+10FFFF
+			if(c == 0xe0 && itr[1] < 0xa0) return 0;
+			if(c == 0xed && itr[1] >= 0xa0) return 0;
+			if(c == 0xf0 && itr[1] < 0x90) return 0;
+			if(c == 0xf4 && itr[1] >= 0x90) return 0;
+			return len;
+		}
+	}
+
+	namespace Detail
+	{
+		// position in a buffer plus the scanning shared by the parser and the reader
+		// (each method starts at its token and leaves itr just after it)
+		template<unsigned int Flags>
+		class Cursor
+		{
+		public:
+			void reset(const char * src, size_t size)	{ begin = itr = src; end = src + size; errorMsg.clear(); offset = 0; }
+			bool atEnd() const							{ return itr == end; }
+			char peek() const							{ return itr != end ? *itr : 0; }
+			void skipSpace()							{ while(itr != end && isSpace(*itr)) ++itr; }
+			bool error(const char * message)			{ errorMsg = message; offset = itr - begin; return false; }
+
+			bool string(const char *& data, size_t& size);
+			bool number(bool& isInteger, int& integer, double& real);
+			bool literal(const char * text, size_t size);
+			bool skipValue();
+
+			const char * begin;
+			const char * itr;
+			const char * end;
+			std::string errorMsg;
+			size_t offset;
+
+		private:
+			bool hex(unsigned int& code);
+
+			std::string scratch;	// decoded strings (eDecodeEscapes)
+		};
+
+		template<unsigned int Flags>
+		bool Cursor<Flags>::literal(const char * text, size_t size)
+		{
+			if((size_t) (end - itr) < size || memcmp(itr, text, size) != 0) return error("Invalid literal.");
+			itr += size;
+			return true;
+		}
+
+		// data points into the buffer unless escapes had to be decoded
+		template<unsigned int Flags>
+		bool Cursor<Flags>::string(const char *& data, size_t& size)
+		{
+			if(peek() != '"') return error("Expected a string.");
+			const char * start = ++itr;
+			bool escaped = false;
+			while(itr != end && *itr != '"')
+			{
+				unsigned char c = *itr;
+				if(c == '\\')
+				{
+					escaped = true;
+					if(++itr == end) break;
+					++itr;
+				}
+				else if(c < 0x20)
+				{
+					return error("Control character in string.");
+				}
+				else if((Flags & eValidateUtf8) && c >= 0x80)
+				{
+					size_t len = utf8Length((const unsigned char *) itr, (const unsigned char *) end);
+					if(len == 0) return error("Invalid UTF-8 in string.");
+					itr += len;
+				}
+				else
+				{
+					++itr;
+				}
+			}
+			if(itr == end) return error("Reached end of characters while parsing string.");
+
+			const char * close = itr++;
+			data = start;
+			size = close - start;
+			if(!(Flags & eDecodeEscapes) || !escaped)
+			{
+				return true;
+			}
+
+			scratch.clear();
+			for(const char * pos = start; pos != close; )
+			{
+				if(*pos != '\\')
+				{
+					const char * run = pos;
+					while(pos != close && *pos != '\\') ++pos;
+					scratch.append(run, pos);
+					continue;
+				}
+				++pos;
+				switch(*pos++)
+				{
+				case '"':	scratch += '"'; break;
+				case '\\':	scratch += '\\'; break;
+				case '/':	scratch += '/'; break;
+				case 'b':	scratch += '\b'; break;
+				case 'f':	scratch += '\f'; break;
+				case 'n':	scratch += '\n'; break;
+				case 'r':	scratch += '\r'; break;
+				case 't':	scratch += '\t'; break;
+				case 'u':
+					{
+						unsigned int code;
+						itr = pos;
+						if(!hex(code)) return false;
+						if(code >= 0xd800 && code < 0xdc00)
+						{
+							unsigned int low;
+							if(close - itr < 6 || itr[0] != '\\' || itr[1] != 'u') return error("Unpaired surrogate in string.");
+							itr += 2;
+							if(!hex(low)) return false;
+							if(low < 0xdc00 || low >= 0xe000) return error("Unpaired surrogate in string.");
+							code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+						}
+						else if((Flags & eValidateUtf8) && code >= 0xdc00 && code < 0xe000)
+						{
+							return error("Unpaired surrogate in string.");
+						}
+						appendUtf8(scratch, code);
+						pos = itr;
+					}
+					break;
+				default:
+					itr = pos - 1;
+					return error("Invalid escape sequence in string.");
+				}
+			}
+			itr = close + 1;
+			data = scratch.data();
+			size = scratch.size();
+			return true;
+		}
+
+		template<unsigned int Flags>
+		bool Cursor<Flags>::hex(unsigned int& code)
+		{
+			code = 0;
+			for(int i = 0; i < 4; ++i, ++itr)
+			{
+				char c = peek();
+				code <<= 4;
+				if(c >= '0' && c <= '9') code |= c - '0';
+				else if(c >= 'a' && c <= 'f') code |= c - 'a' + 10;
+				else if(c >= 'A' && c <= 'F') code |= c - 'A' + 10;
+				else return error("Invalid \\u escape in string.");
+			}
+			return true;
+		}
+
+		// integers that fit an int are returned as one, everything else as a double
+		template<unsigned int Flags>
+		bool Cursor<Flags>::number(bool& isInteger, int& integer, double& real)
+		{
+			const char * start = itr;
+			bool negative = peek() == '-';
+			if(negative) ++itr;
+			if(!isDigit(peek())) return error("Unexpected character.");
+
+			// integer part, no leading zeros
+			unsigned long long mantissa = 0;
+			int digits = 0;
+			int exponent = 0;
+			if(*itr == '0')
+			{
+				++itr;
+			}
+			else
+			{
+				for(; itr != end && isDigit(*itr); ++itr)
+				{
+					if(digits < 19) mantissa = mantissa * 10 + (*itr - '0'), ++digits;
+					else ++exponent;
+				}
+			}
+			isInteger = true;
+			if(peek() == '.')
+			{
+				isInteger = false;
+				++itr;
+				if(!isDigit(peek())) return error("Expected a digit after the decimal point.");
+				for(; itr != end && isDigit(*itr); ++itr)
+				{
+					if(digits < 19) mantissa = mantissa * 10 + (*itr - '0'), ++digits, --exponent;
+				}
+			}
+			if(peek() == 'e' || peek() == 'E')
+			{
+				isInteger = false;
+				++itr;
+				bool negativeExp = peek() == '-';
+				if(peek() == '-' || peek() == '+') ++itr;
+				if(!isDigit(peek())) return error("Expected a digit in the exponent.");
+				int exp = 0;
+				for(; itr != end && isDigit(*itr); ++itr)
+				{
+					if(exp < 100000) exp = exp * 10 + (*itr - '0');
+				}
+				exponent += negativeExp ? -exp : exp;
+			}
+
+			if(isInteger && exponent == 0 && mantissa <= (unsigned long long) INT_MAX + (negative ? 1 : 0))
+			{
+				integer = negative ? (int) (0 - mantissa) : (int) mantissa;
+				return true;
+			}
+			isInteger = false;
+			if(Flags & eFastNumbers)
+			{
+				double scale = 1.0;
+				for(int i = exponent < 0 ? -exponent : exponent; i > 0 && scale < 1e308; --i) scale *= 10.0;
+				real = exponent < 0 ? mantissa / scale : mantissa * scale;
+				if(negative) real = -real;
+				return true;
+			}
+
+			// strtod needs a terminated copy
+			char text[64];
+			size_t len = itr - start;
+			std::string longText;
+			const char * terminated = text;
+			if(len < sizeof(text))
+			{
+				memcpy(text, start, len);
+				text[len] = 0;
+			}
+			else
+			{
+				longText.assign(start, len);
+				terminated = longText.c_str();
+			}
+			real = strtod(terminated, NULL);
+			return true;
+		}
+
+		// step over a value by tracking brackets and quotes, nothing is decoded or checked
+		template<unsigned int Flags>
+		bool Cursor<Flags>::skipValue()
+		{
+			int depth = 0;
+			skipSpace();
+			do
+			{
+				if(itr == end) return error("Unexpected end of document.");
+				switch(*itr)
+				{
+				case '"':
+					for(++itr;;)
+					{
+						// jump to each quote, it's escaped if an odd run of backslashes precedes it
+						const char * quote = (const char *) memchr(itr, '"', end - itr);
+						if(!quote)
+						{
+							itr = end;
+							return error("Reached end of characters while parsing string.");
+						}
+						const char * run = quote;
+						while(run != itr && run[-1] == '\\') --run;
+						itr = quote + 1;
+						if((quote - run) % 2 == 0) break;
+					}
+					break;
+				case '{':
+				case '[':
+					++depth;
+					++itr;
+					break;
+				case '}':
+				case ']':
+					if(--depth < 0) return error("Unexpected end of container.");
+					++itr;
+					break;
+				case ',':
+				case ':':
+					if(depth == 0) return error("Expected a value.");
+					++itr;
+					break;
+				default:
+					if(isSpace(*itr))
+					{
+						++itr;
+					}
+					else
+					{
+						// number or literal
+						const char * start = itr;
+						while(itr != end && !isSpace(*itr) && *itr != ',' && *itr != ':' && *itr != '}' && *itr != ']' && *itr != '[' && *itr != '{' && *itr != '"') ++itr;
+						if(itr == start) return error("Unexpected character.");
+					}
+					break;
+				}
+			} while(depth > 0);
+			return true;
+		}
+	}
+
+	// SAX parser over a buffer: events go to the handler as they are read and no tree is
+	// built.  Only the features named in Flags are compiled in.  The parse is iterative,
+	// so nesting depth is limited only by memory.
+	template<typename Handler, unsigned int Flags = eDefaultParseFlags>
+	class BasicParser
+	{
+	public:
+		explicit BasicParser(Handler& handler) : handler(handler) { cursor.reset(nullptr, 0); }
+
+		// parse a whole document: one value surrounded by optional whitespace
+		bool parse(const char * src, size_t size);
+		bool parse(const std::string& src)		{ return parse(src.data(), src.size()); }
+
+		// parse a run of a container's elements (members for an object) with no brackets,
+		// such as a slice of a huge array.  The handler gets no start or end event for the
+		// container itself, so it should already have one open.
+		bool parseElements(const char * src, size_t size, bool isObject);
+
+		const std::string& getError() const		{ return cursor.errorMsg; }
+		size_t getOffset() const				{ return cursor.offset; }	// where the error was found
+
+	private:
+		BasicParser(const BasicParser&);
+		BasicParser& operator=(const BasicParser&);
+
+		bool values(size_t outer);
+		bool scalar();
+		bool key();
+		bool stopped()							{ return cursor.error("Stopped by handler."); }
+
+		Handler& handler;
+		Detail::Cursor<Flags> cursor;
+		std::vector<char> stack;					// '{' or '[' for each open container
+		std::vector<std::set<std::string> > seen;	// keys of each open object (eRejectDuplicateKeys)
+	};
+
+	template<typename Handler, unsigned int Flags>
+	bool BasicParser<Handler, Flags>::parse(const char * src, size_t size)
+	{
+		cursor.reset(src, size);
+		stack.clear();
+		seen.clear();
+
+		cursor.skipSpace();
+		return values(0) && (cursor.atEnd() || cursor.error("Unexpected characters after the document."));
+	}
+
+	template<typename Handler, unsigned int Flags>
+	bool BasicParser<Handler, Flags>::parseElements(const char * src, size_t size, bool isObject)
+	{
+		cursor.reset(src, size);
+		stack.assign(1, isObject ? '{' : '[');
+		seen.clear();
+		if((Flags & eRejectDuplicateKeys) && isObject) seen.push_back(std::set<std::string>());
+
+		cursor.skipSpace();
+		if(isObject && !key()) return false;
+		return values(1);
+	}
+
+	// values until only the outer containers (those opened before the text) are left
+	template<typename Handler, unsigned int Flags>
+	bool BasicParser<Handler, Flags>::values(size_t outer)
+	{
+		for(;;)
+		{
+			// a value, or the start of a container's contents
+			char c = cursor.peek();
+			if(c == '{' || c == '[')
+			{
+				bool isObject = c == '{';
+				if(!(isObject ? handler.startObject() : handler.startArray())) return stopped();
+				stack.push_back(c);
+				if((Flags & eRejectDuplicateKeys) && isObject) seen.push_back(std::set<std::string>());
+				++cursor.itr;
+				cursor.skipSpace();
+				if(cursor.peek() != (isObject ? '}' : ']'))
+				{
+					if(isObject && !key()) return false;
+					continue;
+				}
+				// empty, closed below
+			}
+			else if(!scalar())
+			{
+				return false;
+			}
+
+			// after a value: close containers, move on to the next element or finish
+			for(;;)
+			{
+				cursor.skipSpace();
+				if(stack.size() == outer)
+				{
+					if(outer == 0 || cursor.atEnd()) return true;
+					if(cursor.peek() != ',') return cursor.error("Expected ',' or the end of the elements.");
+				}
+				char open = stack.back();
+				if(cursor.peek() == ',')
+				{
+					++cursor.itr;
+					cursor.skipSpace();
+					if(open == '{' && !key()) return false;
+					break;
+				}
+				if(cursor.peek() != (open == '{' ? '}' : ']')) return cursor.error("Expected ',' or the end of the container.");
+				++cursor.itr;
+				stack.pop_back();
+				if((Flags & eRejectDuplicateKeys) && open == '{') seen.pop_back();
+				if(!(open == '{' ? handler.endObject() : handler.endArray())) return stopped();
+			}
+		}
+	}
+
+	template<typename Handler, unsigned int Flags>
+	bool BasicParser<Handler, Flags>::scalar()
+	{
+		const char * data;
+		size_t size;
+		bool isInteger;
+		int integer;
+		double real;
+		if(cursor.atEnd()) return cursor.error("Unexpected end of document.");
+		switch(cursor.peek())
+		{
+		case '"':	return cursor.string(data, size) && (handler.string(data, size) || stopped());
+		case 't':	return cursor.literal("true", 4) && (handler.boolean(true) || stopped());
+		case 'f':	return cursor.literal("false", 5) && (handler.boolean(false) || stopped());
+		case 'n':	return cursor.literal("null", 4) && (handler.null() || stopped());
+		default:
+			if(!cursor.number(isInteger, integer, real)) return false;
+			return (isInteger ? handler.integer(integer) : handler.number(real)) || stopped();
+		}
+	}
+
+	// a key and its colon
+	template<typename Handler, unsigned int Flags>
+	bool BasicParser<Handler, Flags>::key()
+	{
+		const char * data;
+		size_t size;
+		if(cursor.peek() != '"') return cursor.error("Expected a key.");
+		if(!cursor.string(data, size)) return false;
+		if((Flags & eRejectDuplicateKeys) && !seen.back().insert(std::string(data, size)).second)
+		{
+			return cursor.error("Duplicate key in object.");
+		}
+		if(!handler.key(data, size)) return stopped();
+		cursor.skipSpace();
+		if(cursor.peek() != ':') return cursor.error("Expected ':' after key.");
+		++cursor.itr;
+		cursor.skipSpace();
+		return true;
+	}
+
+	// pull parser: the caller asks for each value in the order it expects them
+	template<unsigned int Flags = eDefaultParseFlags>
+	class BasicReader
+	{
+	public:
+		BasicReader(const char * src, size_t size) : first(false) { cursor.reset(src, size); }
+		explicit BasicReader(const std::string& src) : first(false) { cursor.reset(src.data(), src.size()); }
+
+		// scalars
+		bool isNull()							{ cursor.skipSpace(); return cursor.peek() == 'n'; }
+		bool isObject()							{ cursor.skipSpace(); return cursor.peek() == '{'; }
+		bool isArray()							{ cursor.skipSpace(); return cursor.peek() == '['; }
+		bool readNull()							{ cursor.skipSpace(); return cursor.literal("null", 4); }
+		bool readBool(bool& value);
+		bool readInt(int& value);
+		bool readDouble(double& value);
+		bool readFloat(float& value)			{ double d; if(!readDouble(d)) return false; value = (float) d; return true; }
+		bool readString(std::string& value);
+		bool readString(const char *& data, size_t& size)	{ cursor.skipSpace(); return cursor.string(data, size); }
+
+		// containers: call nextKey / nextElement before each member, they return false once
+		// the container has been closed (or on an error, see failed())
+		bool startObject()						{ return open('{'); }
+		bool nextKey(const char *& data, size_t& size);
+		bool startArray()						{ return open('['); }
+		bool nextElement();
+
+		bool skipValue()						{ return cursor.skipValue(); }
+		bool skipValue(const char *& data, size_t& size)	{ cursor.skipSpace(); data = cursor.itr; if(!cursor.skipValue()) return false; size = cursor.itr - data; return true; }	// and give its text
+
+		// check nothing but whitespace is left
+		bool finish()							{ cursor.skipSpace(); return failed() ? false : cursor.atEnd() || cursor.error("Unexpected characters after the document."); }
+
+		bool failed() const						{ return !cursor.errorMsg.empty(); }
+		const std::string& getError() const		{ return cursor.errorMsg; }
+		size_t getOffset() const				{ return cursor.offset; }
+
+	private:
+		bool open(char bracket);
+		bool next(char close);
+
+		Detail::Cursor<Flags> cursor;
+		bool first;		// no comma before the next member
+	};
+
+	template<unsigned int Flags>
+	bool BasicReader<Flags>::readBool(bool& value)
+	{
+		cursor.skipSpace();
+		if(cursor.peek() == 't' && cursor.literal("true", 4)) value = true;
+		else if(cursor.peek() == 'f' && cursor.literal("false", 5)) value = false;
+		else return cursor.error("Expected a bool.");
+		return true;
+	}
+	template<unsigned int Flags>
+	bool BasicReader<Flags>::readInt(int& value)
+	{
+		bool isInteger;
+		double real;
+		cursor.skipSpace();
+		if(!cursor.number(isInteger, value, real)) return false;
+		return isInteger || cursor.error("Expected an int.");
+	}
+	template<unsigned int Flags>
+	bool BasicReader<Flags>::readDouble(double& value)
+	{
+		bool isInteger;
+		int integer;
+		cursor.skipSpace();
+		if(!cursor.number(isInteger, integer, value)) return false;
+		if(isInteger) value = integer;
+		return true;
+	}
+	template<unsigned int Flags>
+	bool BasicReader<Flags>::readString(std::string& value)
+	{
+		const char * data;
+		size_t size;
+		if(!readString(data, size)) return false;
+		value.assign(data, size);
+		return true;
+	}
+	template<unsigned int Flags>
+	bool BasicReader<Flags>::open(char bracket)
+	{
+		cursor.skipSpace();
+		if(cursor.peek() != bracket) return cursor.error(bracket == '{' ? "Expected an object." : "Expected an array.");
+		++cursor.itr;
+		first = true;
+		return true;
+	}
+	template<unsigned int Flags>
+	bool BasicReader<Flags>::next(char close)
+	{
+		if(failed()) return false;
+		cursor.skipSpace();
+		if(cursor.peek() == close)
+		{
+			++cursor.itr;
+			first = false;	// the container just closed was a member of its parent
+			return false;
+		}
+		if(!first)
+		{
+			if(cursor.peek() != ',') return cursor.error("Expected ',' or the end of the container.");
+			++cursor.itr;
+			cursor.skipSpace();
+		}
+		first = false;
+		return true;
+	}
+	template<unsigned int Flags>
+	bool BasicReader<Flags>::nextKey(const char *& data, size_t& size)
+	{
+		if(!next('}')) return false;
+		if(cursor.peek() != '"') return cursor.error("Expected a key.");
+		if(!cursor.string(data, size)) return false;
+		cursor.skipSpace();
+		if(cursor.peek() != ':') return cursor.error("Expected ':' after key.");
+		++cursor.itr;
+		return true;
+	}
+	template<unsigned int Flags>
+	bool BasicReader<Flags>::nextElement()
+	{
+		return next(']');
+	}
+
+	typedef BasicReader<> Reader;
+
+	// JSON Pointer (RFC 6901), e.g. "/a/b/3/c".  The path is split and unescaped once, and
+	// each step knows up front whether it can index an array, so resolving it against
+	// many documents only does the lookups.
+	class Pointer
+	{
+	public:
+		explicit Pointer(const std::string& path);	// check valid() for malformed paths
+
+		bool valid() const						{ return ok; }
+		size_t depth() const					{ return steps.size(); }
+
+		// the value the pointer refers to, or null if it isn't there
+		const Value * resolve(const Value& root) const;
+
+		// the text of the value within the JSON src, found without building a tree: members
+		// off the path are skipped, not parsed.  False if it isn't there or the text before
+		// it is malformed.
+		bool resolve(const char * src, size_t size, Span<char>& text) const;
+		bool resolve(const std::string& src, Span<char>& text) const	{ return resolve(src.data(), src.size(), text); }
+		bool resolve(std::string&& src, Span<char>& text) const = delete;	// the text would outlive src
+
+	private:
+		struct Step
+		{
+			std::string key;
+			unsigned int index;
+			bool isIndex;		// the key is also an array index ("-" and leading zeros aren't)
+		};
+
+		friend class Projection;
+		friend class LineFilter;
+		friend class PersistentValue;
+
+		std::vector<Step> steps;
+		bool ok;
+	};
+
+	// the paths (JSON Pointers) to keep when parsing with parse(src, projection)
+	class Projection
+	{
+	public:
+		Projection(std::initializer_list<const char *> paths);
+		explicit Projection(const std::vector<std::string>& paths);
+
+		bool valid() const						{ return ok; }
+
+	private:
+		friend UniqueValue parse(const std::string& src, const Projection& projection);
+
+		// a trie of the paths' steps, nodes[0] is the document
+		struct Node
+		{
+			bool whole;			// a path ends here, so keep everything below
+			std::vector<std::pair<Pointer::Step, unsigned int>> children;
+		};
+
+		void add(const std::string& path);
+
+		std::vector<Node> nodes;
+		bool ok;
+	};
+
+	// parse only the values on the projection's paths, and the containers leading to them.
+	// Everything else is skipped without being parsed or allocated.  Array elements before
+	// a kept one become nulls so indexes still line up.  (prints any error to stderr and
+	// returns null)
+	UniqueValue parse(const std::string& src, const Projection& projection);
+
+	// JSONPath query, compiled once into a plan and then run over any number of documents,
+	// either value trees or raw text.  Supports names, wildcards, indexes (negative from
+	// the end), slices, unions, recursive descent and filters:
+	//
+	//	$.orders[?(@.total > 100 && @.state != 'void')].id
+	//	$..author
+	//	$.items[-2:]
+	//
+	// Filters compare typed values (numbers as numbers, strings as bytes) and a bare path
+	// tests for existence; containers never compare equal.  Matches come out once each, in
+	// document order (for a tree that puts object members in key order), and paths may
+	// have at most 63 segments.
+	class Path
+	{
+	public:
+		explicit Path(const std::string& expression);	// check valid() for errors
+		~Path();
+
+		bool valid() const						{ return error.empty(); }
+		const std::string& getError() const		{ return error; }
+
+		// matches in a value tree, the vector is cleared first so it can be reused
+		void select(const Value& root, std::vector<const Value *>& matches) const;
+		std::vector<const Value *> select(const Value& root) const;
+
+		// the text of each match in the JSON src, found without building a tree.  False if
+		// src is malformed where the query had to look.
+		bool select(const char * src, size_t size, std::vector<Span<char>>& matches) const;
+		bool select(const std::string& src, std::vector<Span<char>>& matches) const	{ return select(src.data(), src.size(), matches); }
+		bool select(std::string&& src, std::vector<Span<char>>& matches) const = delete;	// the text would outlive src
+
+	private:
+		Path(const Path&);
+		Path& operator=(const Path&);
+
+		struct Plan;
+		std::unique_ptr<Plan> plan;
+		std::string error;
+	};
+
+	// Keeps the lines of NDJSON (one document per line) whose value at a JSON Pointer
+	// equals a scalar, without building trees:
+	//
+	//	LineFilter errors("/status", "\"error\"");
+	//	errors.select(chunk, lines);
+	//
+	// Each line is first searched for the key and value bytes and dropped if either is
+	// missing; only the survivors are scanned along the path, skipping everything off it.
+	// Values compare as in Path filters, so 1 matches 1.0.  Only the path is checked, a
+	// line that is malformed elsewhere can still match.
+	class LineFilter
+	{
+	public:
+		LineFilter(const std::string& path, const std::string& value);	// value is JSON text, check valid()
+
+		bool valid() const						{ return ok; }
+
+		bool matches(const char * line, size_t size) const;
+
+		// appends the matching lines (without their line breaks) and returns how many bytes
+		// were whole lines.  Unless last is set a trailing line with no newline is left for
+		// the next chunk, so a big file can be filtered a buffer at a time.
+		size_t select(const char * data, size_t size, std::vector<Span<char>>& lines, bool last = true) const;
+		size_t select(const std::string& data, std::vector<Span<char>>& lines) const	{ return select(data.data(), data.size(), lines); }
+		size_t select(std::string&& data, std::vector<Span<char>>& lines) const = delete;	// the lines would outlive data
+
+	private:
+		Pointer pointer;
+		std::string value;
+		std::string keyNeedle;		// the last key as it's usually written, or empty
+		std::string valueNeedle;	// likewise the value; numbers have too many spellings
+		bool ok;
+	};
+
+	// An immutable value where an edit gives a new value sharing everything it didn't
+	// touch, so keeping old versions around costs only what changed:
+	//
+	//	Json::PersistentValue next = doc.set("/users/7/name", "kim");	// doc is unchanged
+	//
+	// Objects are hash array mapped tries and arrays are tries of 32 element chunks, so
+	// set() copies O(log n) small nodes.  Removing from the middle of an array copies the
+	// elements after it.  Values can be read from any number of threads; sameAs() tells
+	// whether two values are the very same node, so unchanged subtrees of two versions
+	// can be skipped without comparing them.
+	class PersistentValue
+	{
+	public:
+		PersistentValue();							// null
+		PersistentValue(int value);
+		PersistentValue(float value);
+		PersistentValue(bool value);
+		PersistentValue(const std::string& value);
+		PersistentValue(const char * value);
+		explicit PersistentValue(const Value& val);	// copies the tree, bytes become base64url text
+
+		static PersistentValue emptyObject();
+		static PersistentValue emptyArray();
+
+		bool isNull() const;
+		bool isInt() const;
+		bool isFloat() const;
+		bool isString() const;
+		bool isBool() const;
+		bool isObject() const;
+		bool isArray() const;
+
+		int asInt() const;
+		float asFloat() const;
+		bool asBool() const;
+		const std::string& asString() const;
+
+		// children, null when missing
+		unsigned int size() const;
+		PersistentValue get(const std::string& key) const;
+		PersistentValue operator[](const std::string& key) const		{ return get(key); }
+		PersistentValue operator[](unsigned int index) const;
+		PersistentValue at(const Pointer& path) const;
+
+		// members in no particular order
+		void forEachMember(const std::function<void(const std::string& key, const PersistentValue& value)>& visit) const;
+
+		// a new value with the one at path replaced or added (an array index may be the size
+		// or "-" to append).  The parent must exist; if it doesn't, or the path is invalid,
+		// the result is this value, which sameAs() will show.
+		PersistentValue set(const Pointer& path, const PersistentValue& value) const;
+		PersistentValue set(const std::string& path, const PersistentValue& value) const		{ return set(Pointer(path), value); }
+		PersistentValue remove(const Pointer& path) const;
+		PersistentValue remove(const std::string& path) const	{ return remove(Pointer(path)); }
+
+		bool sameAs(const PersistentValue& other) const			{ return node == other.node; }
+
+		UniqueValue toValue() const;
+		void write(Writer& writer) const;	// objects in key order, as for value trees
+		std::string toString() const;
+
+		struct Node;
+
+	private:
+		explicit PersistentValue(std::shared_ptr<const Node> node) : node(std::move(node)) {}
+
+		static bool assign(const PersistentValue& val, const Pointer& path, size_t step, const PersistentValue& value, bool remove, PersistentValue& rtn);
+
+		std::shared_ptr<const Node> node;
+	};
+
+	// A document one writer edits while any number of readers each see a consistent
+	// version.  Every edit makes a new version of the persistent value and publishes it
+	// with one atomic swap; a reader pins the version current when it calls read() and
+	// keeps traversing it however many edits follow.  Readers never wait for the writer
+	// and take no reference counts to get in.  Versions no reader can still see are freed
+	// by a background thread (or by collect() when there isn't one), using the same
+	// epoch based reclamation as SharedSnapshot.
+	class VersionedDocument
+	{
+		struct State;
+		struct Record
+		{
+			PersistentValue root;
+			unsigned long long number;
+		};
+
+	public:
+		class Version
+		{
+		public:
+			Version(Version&& other);
+			~Version();
+
+			const PersistentValue& root() const				{ return record->root; }
+			unsigned long long number() const				{ return record->number; }	// counts the edits
+
+		private:
+			friend class VersionedDocument;
+			explicit Version(State * state);
+			Version(const Version&);
+			Version& operator=(const Version&);
+
+			std::atomic<unsigned int> * counter;	// where this reader is counted
+			const Record * record;
+		};
+
+		explicit VersionedDocument(const PersistentValue& root = PersistentValue::emptyObject(), bool collectInBackground = true);
+		~VersionedDocument();	// no reader may still hold a version
+
+		Version read() const;
+
+		// edits, each published as a new version.  False if the path doesn't lead anywhere
+		// (see PersistentValue::set), in which case nothing is published.
+		bool add(const std::string& path, const PersistentValue& value);
+		bool remove(const std::string& path);
+
+		// several edits published as one version, edit returns the new root
+		bool update(const std::function<PersistentValue(const PersistentValue& root)>& edit);
+
+		// free the versions no reader can still see, returns how many are left
+		size_t collect();
+
+	private:
+		VersionedDocument(const VersionedDocument&);
+		VersionedDocument& operator=(const VersionedDocument&);
+
+		std::unique_ptr<State> state;
+	};
+
+	//////////////////////////////////////////////////////////////////////////////////////
+	// Struct binding
+	// Describe a struct once with its members and key names:
+	//
+	//	struct Point { int x; int y; std::string label; };
+	//	JSON_BIND(Point, JSON_FIELD(Point, x), JSON_FIELD(Point, y), JSON_FIELD(Point, label))
+	//
+	// and Json::parseInto(src, point) fills it straight from the text with no value
+	// tree in between.  Members may be ints, floats, doubles, bools, strings, other bound
+	// structs, or std::vectors / std::maps (with string keys) of those.  Keys are matched
+	// with a perfect hash worked out at compile time; unknown keys are skipped and
+	// missing ones leave the member alone.
+	//////////////////////////////////////////////////////////////////////////////////////
+	template<typename T> struct Binding;	// specialised by JSON_BIND
+
+	template<typename T, typename M>
+	struct Field
+	{
+		const char * name;
+		M T::* member;
+	};
+	template<typename T, typename M>
+	constexpr Field<T, M> field(const char * name, M T::* member) { return Field<T, M>{ name, member }; }
+
+#define JSON_FIELD(Type, member) Json::field(#member, &Type::member)
+#define JSON_BIND(Type, ...) \
+	namespace Json { template<> struct Binding<Type> { static constexpr auto fields() { return std::make_tuple(__VA_ARGS__); } }; }
+
+	namespace Detail
+	{
+		constexpr size_t length(const char * str)
+		{
+			size_t len = 0;
+			while(str[len]) ++len;
+			return len;
+		}
+		constexpr unsigned int hashKey(const char * data, size_t size, unsigned int seed)
+		{
+			unsigned int hash = 2166136261u ^ seed;
+			for(size_t i = 0; i < size; ++i) hash = (hash ^ (unsigned char) data[i]) * 16777619u;
+			return hash ^ (hash >> 15);
+		}
+		constexpr size_t slotsFor(size_t count)
+		{
+			size_t slots = 2;
+			while(slots < count * 2) slots *= 2;
+			return slots;
+		}
+
+		// maps each key to its own slot, so a lookup is one hash and one compare
+		template<size_t Count>
+		struct PerfectHash
+		{
+			static constexpr size_t slots = slotsFor(Count);
+
+			unsigned int seed;
+			int slot[slots];	// field index, or -1
+
+			int find(const char * data, size_t size) const { return slot[hashKey(data, size, seed) & (slots - 1)]; }
+		};
+
+		template<size_t Count>
+		constexpr PerfectHash<Count> makePerfectHash(const char * const * names)
+		{
+			PerfectHash<Count> table{};
+			for(unsigned int seed = 0; ; ++seed)
+			{
+				bool collision = false;
+				for(size_t i = 0; i < table.slots; ++i) table.slot[i] = -1;
+				for(size_t i = 0; i < Count && !collision; ++i)
+				{
+					int& slot = table.slot[hashKey(names[i], length(names[i]), seed) & (table.slots - 1)];
+					collision = slot != -1;
+					slot = (int) i;
+				}
+				if(!collision)
+				{
+					table.seed = seed;
+					return table;
+				}
+			}
+		}
+
+		template<typename T>
+		struct BindingTable
+		{
+			typedef decltype(Binding<T>::fields()) Fields;
+			static constexpr size_t count = std::tuple_size<Fields>::value;
+
+			template<size_t... I>
+			static constexpr PerfectHash<count> build(std::index_sequence<I...>)
+			{
+				const char * names[] = { std::get<I>(Binding<T>::fields()).name... };
+				return makePerfectHash<count>(names);
+			}
+			static constexpr PerfectHash<count> hash = build(std::make_index_sequence<count>());
+		};
+		template<typename T>
+		constexpr PerfectHash<BindingTable<T>::count> BindingTable<T>::hash;
+
+		template<unsigned int Flags> bool read(BasicReader<Flags>& reader, int& value)			{ return reader.readInt(value); }
+		template<unsigned int Flags> bool read(BasicReader<Flags>& reader, float& value)		{ return reader.readFloat(value); }
+		template<unsigned int Flags> bool read(BasicReader<Flags>& reader, double& value)		{ return reader.readDouble(value); }
+		template<unsigned int Flags> bool read(BasicReader<Flags>& reader, bool& value)			{ return reader.readBool(value); }
+		template<unsigned int Flags> bool read(BasicReader<Flags>& reader, std::string& value)	{ return reader.readString(value); }
+		template<unsigned int Flags, typename T> bool read(BasicReader<Flags>& reader, std::vector<T>& value);
+		template<unsigned int Flags, typename T> bool read(BasicReader<Flags>& reader, std::map<std::string, T>& value);
+		template<unsigned int Flags, typename T> bool read(BasicReader<Flags>& reader, T& value);
+
+		template<unsigned int Flags, typename T>
+		bool read(BasicReader<Flags>& reader, std::vector<T>& value)
+		{
+			value.clear();
+			if(!reader.startArray()) return false;
+			while(reader.nextElement())
+			{
+				value.push_back(T());
+				if(!read(reader, value.back())) return false;
+			}
+			return !reader.failed();
+		}
+		template<unsigned int Flags, typename T>
+		bool read(BasicReader<Flags>& reader, std::map<std::string, T>& value)
+		{
+			const char * key;
+			size_t size;
+			value.clear();
+			if(!reader.startObject()) return false;
+			while(reader.nextKey(key, size))
+			{
+				if(!read(reader, value[std::string(key, size)])) return false;
+			}
+			return !reader.failed();
+		}
+
+		template<unsigned int Flags, typename T, size_t I>
+		bool readField(BasicReader<Flags>& reader, T& value)
+		{
+			return read(reader, value.*(std::get<I>(Binding<T>::fields()).member));
+		}
+		template<unsigned int Flags, typename T, size_t... I>
+		bool readField(BasicReader<Flags>& reader, T& value, int index, std::index_sequence<I...>)
+		{
+			typedef bool (*ReadField)(BasicReader<Flags>&, T&);
+			static const ReadField table[] = { &readField<Flags, T, I>... };
+			return table[index](reader, value);
+		}
+		template<typename T, size_t... I>
+		bool keyMatches(int index, const char * data, size_t size, std::index_sequence<I...>)
+		{
+			static const char * const names[] = { std::get<I>(Binding<T>::fields()).name... };
+			return strlen(names[index]) == size && memcmp(names[index], data, size) == 0;
+		}
+
+		// bound structs
+		template<unsigned int Flags, typename T>
+		bool read(BasicReader<Flags>& reader, T& value)
+		{
+			typedef BindingTable<T> Table;
+			const char * key;
+			size_t size;
+			if(!reader.startObject()) return false;
+			while(reader.nextKey(key, size))
+			{
+				int index = Table::hash.find(key, size);
+				bool ok = index >= 0 && keyMatches<T>(index, key, size, std::make_index_sequence<Table::count>())
+					? readField(reader, value, index, std::make_index_sequence<Table::count>())
+					: reader.skipValue();
+				if(!ok) return false;
+			}
+			return !reader.failed();
+		}
+	}
+
+	// fill a bound struct (or vector / map of them) straight from JSON text
+	template<typename T>
+	bool parseInto(const std::string& src, T& value, std::string& error)
+	{
+		Reader reader(src);
+		if(Detail::read(reader, value) && reader.finish())
+		{
+			return true;
+		}
+		error = reader.getError();
+		return false;
+	}
+	template<typename T>
+	bool parseInto(const std::string& src, T& value)
+	{
+		std::string error;
+		return parseInto(src, value, error);
+	}
+
+	namespace Detail
+	{
+		// "key": fragments for every field of a bound struct, escaped at compile time
+		constexpr size_t escapedLength(const char * str)
+		{
+			size_t len = 0;
+			for(; *str; ++str)
+			{
+				unsigned char c = *str;
+				len += c == '"' || c == '\\' || c == '\b' || c == '\f' || c == '\n' || c == '\r' || c == '\t' ? 2 : c < 0x20 ? 6 : 1;
+			}
+			return len;
+		}
+
+		template<size_t Count, size_t Size>
+		struct KeyFragments
+		{
+			char text[Size];
+			size_t offset[Count + 1];	// fragment i is [offset[i], offset[i + 1])
+		};
+
+		template<size_t Count, size_t Size>
+		constexpr KeyFragments<Count, Size> makeKeyFragments(const char * const * names)
+		{
+			const char hex[] = "0123456789abcdef";
+			KeyFragments<Count, Size> fragments{};
+			size_t out = 0;
+			for(size_t i = 0; i < Count; ++i)
+			{
+				fragments.offset[i] = out;
+				fragments.text[out++] = '"';
+				for(const char * str = names[i]; *str; ++str)
+				{
+					unsigned char c = *str;
+					char shortForm = c == '"' ? '"' : c == '\\' ? '\\' : c == '\b' ? 'b' : c == '\f' ? 'f' : c == '\n' ? 'n' : c == '\r' ? 'r' : c == '\t' ? 't' : 0;
+					if(shortForm)
+					{
+						fragments.text[out++] = '\\';
+						fragments.text[out++] = shortForm;
+					}
+					else if(c < 0x20)
+					{
+						fragments.text[out++] = '\\';
+						fragments.text[out++] = 'u';
+						fragments.text[out++] = '0';
+						fragments.text[out++] = '0';
+						fragments.text[out++] = hex[c >> 4];
+						fragments.text[out++] = hex[c & 0xf];
+					}
+					else
+					{
+						fragments.text[out++] = c;
+					}
+				}
+				fragments.text[out++] = '"';
+				fragments.text[out++] = ':';
+			}
+			fragments.offset[Count] = out;
+			return fragments;
+		}
+
+		template<typename T>
+		struct KeyTable
+		{
+			static constexpr size_t count = BindingTable<T>::count;
+
+			template<size_t... I>
+			static constexpr size_t size(std::index_sequence<I...>)
+			{
+				const size_t lengths[] = { escapedLength(std::get<I>(Binding<T>::fields()).name)... };
+				size_t total = 0;
+				for(size_t len : lengths) total += len + 3;
+				return total;
+			}
+			static constexpr size_t bytes = size(std::make_index_sequence<count>());
+
+			template<size_t... I>
+			static constexpr KeyFragments<count, bytes> build(std::index_sequence<I...>)
+			{
+				const char * names[] = { std::get<I>(Binding<T>::fields()).name... };
+				return makeKeyFragments<count, bytes>(names);
+			}
+			static constexpr KeyFragments<count, bytes> fragments = build(std::make_index_sequence<count>());
+		};
+		template<typename T>
+		constexpr KeyFragments<KeyTable<T>::count, KeyTable<T>::bytes> KeyTable<T>::fragments;
+
+		inline void write(Writer& writer, int value)					{ writer.writeInt(value); }
+		inline void write(Writer& writer, float value)					{ writer.writeFloat(value); }
+		inline void write(Writer& writer, double value)					{ writer.writeDouble(value); }
+		inline void write(Writer& writer, bool value)					{ writer.writeBool(value); }
+		inline void write(Writer& writer, const std::string& value)		{ writer.writeString(value); }
+		template<typename T> void write(Writer& writer, const std::vector<T>& value);
+		template<typename T> void write(Writer& writer, const std::map<std::string, T>& value);
+		template<typename T> void write(Writer& writer, const T& value);
+
+		template<typename T>
+		void write(Writer& writer, const std::vector<T>& value)
+		{
+			writer.startArray();
+			for(auto& element : value) write(writer, element);
+			writer.endArray();
+		}
+		template<typename T>
+		void write(Writer& writer, const std::map<std::string, T>& value)
+		{
+			writer.startObject();
+			for(auto& member : value)
+			{
+				writer.writeKey(member.first);
+				write(writer, member.second);
+			}
+			writer.endObject();
+		}
+
+		template<typename T, size_t... I>
+		void writeFields(Writer& writer, const T& value, std::index_sequence<I...>)
+		{
+			typedef KeyTable<T> Keys;
+			const char * text = Keys::fragments.text;
+			const size_t * offset = Keys::fragments.offset;
+			int expand[] = { 0, (writer.writeRawKey(text + offset[I], offset[I + 1] - offset[I]), write(writer, value.*(std::get<I>(Binding<T>::fields()).member)), 0)... };
+			(void) expand;
+		}
+
+		// bound structs
+		template<typename T>
+		void write(Writer& writer, const T& value)
+		{
+			writer.startObject();
+			writeFields(writer, value, std::make_index_sequence<BindingTable<T>::count>());
+			writer.endObject();
+		}
+	}
+
+	// write a bound struct (or vector / map of them) without building a value tree
+	template<typename T>
+	void serialize(const T& value, Writer& writer)
+	{
+		Detail::write(writer, value);
+	}
+	template<typename T>
+	std::string serialize(const T& value)
+	{
+		std::string rtn;
+		{
+			Writer writer([&rtn](const char * data, size_t size) { rtn.append(data, size); return true; }, 4096);
+			Detail::write(writer, value);
+		}
+		return rtn;
+	}
+
+	namespace Detail
+	{
+		// compile time validation of JSON text (containers may nest 256 deep)
+		constexpr size_t invalid = (size_t) -1;
+
+		constexpr size_t skipSpace(const char * src, size_t size, size_t i)
+		{
+			while(i < size && isSpace(src[i])) ++i;
+			return i;
+		}
+		constexpr size_t skipString(const char * src, size_t size, size_t i)
+		{
+			if(i >= size || src[i] != '"') return invalid;
+			for(++i; i < size && src[i] != '"'; ++i)
+			{
+				if((unsigned char) src[i] < 0x20) return invalid;
+				if(src[i] == '\\')
+				{
+					if(++i == size) return invalid;
+					char c = src[i];
+					if(c == 'u')
+					{
+						for(int h = 0; h < 4; ++h)
+						{
+							char x = ++i < size ? src[i] : 0;
+							if(!isDigit(x) && !(x >= 'a' && x <= 'f') && !(x >= 'A' && x <= 'F')) return invalid;
+						}
+					}
+					else if(c != '"' && c != '\\' && c != '/' && c != 'b' && c != 'f' && c != 'n' && c != 'r' && c != 't')
+					{
+						return invalid;
+					}
+				}
+			}
+			return i < size ? i + 1 : invalid;
+		}
+		constexpr size_t skipDigits(const char * src, size_t size, size_t i)
+		{
+			if(i >= size || !isDigit(src[i])) return invalid;
+			while(i < size && isDigit(src[i])) ++i;
+			return i;
+		}
+		constexpr size_t skipNumber(const char * src, size_t size, size_t i)
+		{
+			if(i < size && src[i] == '-') ++i;
+			if(i < size && src[i] == '0') ++i;
+			else i = skipDigits(src, size, i);
+			if(i != invalid && i < size && src[i] == '.') i = skipDigits(src, size, i + 1);
+			if(i != invalid && i < size && (src[i] == 'e' || src[i] == 'E'))
+			{
+				++i;
+				if(i < size && (src[i] == '-' || src[i] == '+')) ++i;
+				i = skipDigits(src, size, i);
+			}
+			return i;
+		}
+		constexpr size_t skipLiteral(const char * src, size_t size, size_t i, const char * text)
+		{
+			for(; *text; ++text, ++i)
+			{
+				if(i >= size || src[i] != *text) return invalid;
+			}
+			return i;
+		}
+		constexpr size_t skipKey(const char * src, size_t size, size_t i)
+		{
+			i = skipSpace(src, size, skipString(src, size, i));
+			if(i >= size || src[i] != ':') return invalid;
+			return skipSpace(src, size, i + 1);
+		}
+
+		constexpr bool validate(const char * src, size_t size)
+		{
+			char stack[256] = {};
+			int depth = 0;
+			size_t i = skipSpace(src, size, 0);
+			for(;;)
+			{
+				if(i >= size) return false;
+				char c = src[i];
+				if(c == '{' || c == '[')
+				{
+					if(depth == 256) return false;
+					stack[depth++] = c;
+					i = skipSpace(src, size, i + 1);
+					if(i < size && src[i] == (c == '{' ? '}' : ']'))
+					{
+						// empty, closed below
+					}
+					else
+					{
+						if(c == '{') i = skipKey(src, size, i);
+						if(i == invalid) return false;
+						continue;
+					}
+				}
+				else
+				{
+					i = c == '"' ? skipString(src, size, i)
+						: c == 't' ? skipLiteral(src, size, i, "true")
+						: c == 'f' ? skipLiteral(src, size, i, "false")
+						: c == 'n' ? skipLiteral(src, size, i, "null")
+						: skipNumber(src, size, i);
+					if(i == invalid) return false;
+				}
+
+				for(;;)
+				{
+					i = skipSpace(src, size, i);
+					if(depth == 0) return i == size;
+					if(i >= size) return false;
+					char open = stack[depth - 1];
+					if(src[i] == ',')
+					{
+						i = skipSpace(src, size, i + 1);
+						if(open == '{') i = skipKey(src, size, i);
+						if(i == invalid) return false;
+						break;
+					}
+					if(src[i] != (open == '{' ? '}' : ']')) return false;
+					--depth;
+					++i;
+				}
+			}
+		}
+
+		// not constexpr, so reaching it while evaluating a literal stops the compile; a
+		// literal only checked at run time (not declared constexpr) reports it and aborts
+		void invalidJsonLiteral(const char * text, size_t size);
+	}
+
+	// JSON text that has been checked at compile time.  The document is parsed the first
+	// time it is used and then kept for the life of the program, so a program that never
+	// looks at a literal never pays for it, and later uses find it without a lock.
+	//
+	//	using namespace Json::Literals;
+	//	constexpr Json::Literal defaults = R"({"retries":3})"_json;
+	//	int retries = defaults->get("retries").asInt();
+	class Literal;
+	namespace Literals
+	{
+		constexpr Literal operator"" _json(const char * text, size_t size);
+	}
+
+	class Literal
+	{
+	public:
+		const Value& value() const;
+		const Value& operator*() const		{ return value(); }
+		const Value * operator->() const	{ return &value(); }
+
+		const char * data() const			{ return text; }
+		size_t length() const				{ return size; }
+
+	private:
+		// only for text that has been checked and lives as long as the program, since the
+		// document is kept under its address
+		constexpr Literal(const char * text, size_t size) : text(text), size(size) {}
+		friend constexpr Literal Literals::operator"" _json(const char * text, size_t size);
+
+		const char * text;
+		size_t size;
+	};
+
+	namespace Literals
+	{
+		constexpr Literal operator"" _json(const char * text, size_t size)
+		{
+			return Detail::validate(text, size) ? Literal(text, size) : (Detail::invalidJsonLiteral(text, size), Literal("null", 4));
+		}
+	}
 }
\ No newline at end of file
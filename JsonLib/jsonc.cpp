@@ -0,0 +1,46 @@
+// jsonc: compiles a JSON file into C++ source holding the document as static data
+//
+//	jsonc input.json output.cpp name
+//
+// then link output.cpp and declare  const Json::Value& name();  to use it.
+#include "Json.h"
+
+#include <stdio.h>
+#include <fstream>
+#include <sstream>
+
+int main(int argc, char * argv[])
+{
+	if(argc != 4)
+	{
+		fprintf(stderr, "usage: jsonc input.json output.cpp name\n");
+		return 2;
+	}
+
+	std::ifstream in(argv[1], std::ios::binary);
+	if(!in)
+	{
+		fprintf(stderr, "Error: can't read %s\n", argv[1]);
+		return 1;
+	}
+	std::stringstream ss;
+	ss << in.rdbuf();
+	std::string src = ss.str();
+
+	std::string error;
+	Json::UniqueValue val = Json::parse(src, error);
+	if(!val)
+	{
+		fprintf(stderr, "Error: %s\n", error.c_str());
+		return 1;
+	}
+
+	std::ofstream out(argv[2], std::ios::binary);
+	out << Json::generateSource(*val, argv[3]);
+	if(!out)
+	{
+		fprintf(stderr, "Error: can't write %s\n", argv[2]);
+		return 1;
+	}
+	return 0;
+}
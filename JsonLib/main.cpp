@@ -1,5 +1,10 @@
 #include "Json.h"
 
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <thread>
+
 #define CATCH_CONFIG_MAIN
 #include "Catch.h"
 
@@ -42,3 +47,1093 @@ TEST_CASE( "Take a large object and query it", "[json/query]" )
 	REQUIRE((*val)["Name"].isString());
 	REQUIRE((*val)["name"].isNull());
 }
+
+TEST_CASE( "Homogeneous arrays are packed", "[json/arrays/packed]" )
+{
+	Json::UniqueValue val = Json::parse("{\"ints\":[1,2,3],\"floats\":[1.5,2.5],\"bools\":[true,false,true],\"mixed\":[1,2.5,\"three\"]}");
+	const Json::Value& ints = val->get("ints");
+	REQUIRE(ints.size() == 3);
+	REQUIRE(ints.asIntSpan().size == 3);
+	REQUIRE(ints.asIntSpan()[2] == 3);
+	REQUIRE(ints.asFloatSpan().empty());
+	REQUIRE(ints[1].isInt());
+	REQUIRE(ints[1].asInt() == 2);
+	REQUIRE(val->get("floats").asFloatSpan().size == 2);
+	REQUIRE(val->get("floats")[0].asFloat() == 1.5f);
+	REQUIRE(val->get("bools")[1].isBool());
+	REQUIRE(!val->get("bools")[1].asBool());
+	REQUIRE(val->get("mixed").asIntSpan().empty());
+	REQUIRE(val->get("mixed")[2].asString() == "three");
+	REQUIRE(test("{\"key0\":[1,2,3],\"key1\":[1.5,2.5],\"key2\":[true,false]}"));
+
+	// const reads leave the array packed, and can come from several threads at once
+	REQUIRE(ints.asIntSpan().size == 3);
+	std::vector<std::thread> readers;
+	std::atomic<int> total(0);
+	for(int t = 0; t < 4; ++t) readers.emplace_back([&ints, &total]() { for(unsigned int i = 0; i < ints.size(); ++i) total += ints[i].asInt(); });
+	for(auto& reader : readers) reader.join();
+	REQUIRE(total == 24);
+	REQUIRE(Json::freeze(*val)->root()["ints"][2].asInt() == 3);
+
+	// so do reads through a non-const reference, and each element keeps its box
+	Json::Value& floats = val->get("floats");
+	REQUIRE(floats[0].asFloat() == 1.5f);
+	REQUIRE(&floats[0] == &floats[0]);
+	REQUIRE(floats.asFloatSpan().size == 2);
+
+	// adding an element of another type unpacks the array
+	Json::Value& arr = val->get("ints");
+	arr.add(Json::newString("four"));
+	REQUIRE(arr.size() == 4);
+	REQUIRE(arr.asIntSpan().empty());
+	REQUIRE(arr[0].asInt() == 1);
+	REQUIRE(arr.toString() == "[1,2,3,\"four\"]");
+}
+
+TEST_CASE( "Aggregate numeric arrays", "[json/arrays/aggregate]" )
+{
+	Json::UniqueValue val = Json::parse("{\"ints\":[4,-2,7,1,9,3],\"floats\":[1.5,-0.5,2.5,4.5,0.5],\"mixed\":[1,\"x\",2.5,null,-3],\"none\":[\"x\"],\"bools\":[true,false]}");
+	const Json::Value& ints = val->get("ints");
+	REQUIRE(Json::count(ints) == 6);
+	REQUIRE(Json::sum(ints) == 22.0);
+	REQUIRE(Json::minimum(ints) == -2.0);
+	REQUIRE(Json::maximum(ints) == 9.0);
+
+	const Json::Value& floats = val->get("floats");
+	REQUIRE(Json::sum(floats) == 8.5);
+	REQUIRE(Json::minimum(floats) == -0.5);
+	REQUIRE(Json::maximum(floats) == 4.5);
+	REQUIRE(Json::mean(floats) == 1.7);
+
+	const Json::Value& mixed = val->get("mixed");
+	REQUIRE(Json::count(mixed) == 3);
+	REQUIRE(Json::sum(mixed) == 0.5);
+	REQUIRE(Json::minimum(mixed) == -3.0);
+	REQUIRE(Json::maximum(mixed) == 2.5);
+
+	REQUIRE(Json::count(val->get("none")) == 0);
+	REQUIRE(Json::mean(val->get("none")) != Json::mean(val->get("none")));
+	REQUIRE(Json::count(val->get("bools")) == 0);
+	REQUIRE(Json::histogram(val->get("bools"), 0.0, 1.0, 2)[1] == 0);
+
+	std::vector<unsigned int> buckets = Json::histogram(ints, 0.0, 10.0, 2);
+	REQUIRE(buckets.size() == 2);
+	REQUIRE(buckets[0] == 3);
+	REQUIRE(buckets[1] == 2);
+}
+
+TEST_CASE( "Stream values through a bounded writer", "[json/writer]" )
+{
+	std::string src = "{\"key0\":[1,2,3],\"key1\":{\"key2\":\"astring\",\"key3\":[true,null,1.5]}}";
+	Json::UniqueValue val = Json::parse(src);
+
+	// a tiny buffer forces many flushes
+	std::string out;
+	size_t largest = 0;
+	{
+		Json::Writer writer([&](const char * data, size_t size) { out.append(data, size); largest = std::max(largest, size); return true; }, 16);
+		writer.write(*val);
+	}
+	REQUIRE(out == src);
+	REQUIRE(largest <= 16);
+
+	std::stringstream ss;
+	{
+		Json::Writer writer(Json::streamSink(ss));
+		writer.startObject();
+		writer.writeKey("list");
+		writer.startArray();
+		writer.writeInt(1);
+		writer.writeString("two");
+		writer.startObject();
+		writer.endObject();
+		writer.writeNull();
+		writer.endArray();
+		writer.writeKey("flag");
+		writer.writeBool(false);
+		writer.endObject();
+	}
+	REQUIRE(ss.str() == "{\"list\":[1,\"two\",{},null],\"flag\":false}");
+
+	// a failing sink stops the output
+	Json::Writer broken([](const char *, size_t) { return false; }, 16);
+	broken.write(*val);
+	REQUIRE(!broken.good());
+}
+
+TEST_CASE( "Strings are escaped and unescaped", "[json/strings/escapes]" )
+{
+	REQUIRE(test("{\"key0\":\"a\\\"quote\\\\and\\nnewline\\u0001\"}"));
+	Json::UniqueValue val = Json::parse("{\"key0\":\"tab\\there\\/\\u00e9\\ud83d\\ude00\"}");
+	REQUIRE(val->get("key0").asString() == "tab\there/\xc3\xa9\xf0\x9f\x98\x80");
+}
+
+TEST_CASE( "Gather large strings without copying", "[json/writer/gather]" )
+{
+	std::string big(5000, 'x');
+	std::string src = "{\"big\":\"" + big + "\",\"escaped\":\"" + big + "\\n\",\"small\":\"abc\"}";
+	Json::UniqueValue val = Json::parse(src);
+
+	Json::GatherList list(*val, 1024);
+	std::string joined;
+	bool referenced = false;
+	for(auto& chunk : list.chunks())
+	{
+		joined.append(chunk.data, chunk.size);
+		referenced |= chunk.data == val->get("big").asString().data();
+	}
+	REQUIRE(joined == src);
+	REQUIRE(list.size() == src.size());
+	REQUIRE(referenced);
+	REQUIRE(list.chunks().size() == 3);
+
+	// bytes are encoded into a temporary, so they are always copied
+	Json::UniqueValue bytes(Json::newArray());
+	bytes->add(Json::newBytes(std::string(3000, '\x5a')));
+	Json::GatherList encoded(*bytes, 1024);
+	std::string text;
+	for(auto& chunk : encoded.chunks()) text.append(chunk.data, chunk.size);
+	REQUIRE(text == bytes->toString());
+	REQUIRE(encoded.chunks().size() == 1);
+}
+
+TEST_CASE( "Measure and serialize into a caller's buffer", "[json/writer/measure]" )
+{
+	std::string src = "{\"key0\":[1,-22,333],\"key1\":{\"key2\":\"a\\\"b\\u0001\",\"key3\":[true,null,1.5]},\"key4\":-0.25}";
+	Json::UniqueValue val = Json::parse(src);
+	REQUIRE(Json::measure(*val) == src.size());
+
+	std::vector<char> buf(src.size(), '#');
+	REQUIRE(Json::serializeInto(*val, &buf[0], 10) == src.size());
+	REQUIRE(std::string(&buf[0], 10) == src.substr(0, 10));
+	REQUIRE(Json::serializeInto(*val, &buf[0], buf.size()) == src.size());
+	REQUIRE(std::string(buf.begin(), buf.end()) == src);
+}
+
+TEST_CASE( "Parallel serialisation matches the serial writer", "[json/writer/parallel]" )
+{
+	Json::UniqueValue root(Json::newObject());
+	Json::Value * records = Json::newArray();
+	for(int i = 0; i < 5000; ++i)
+	{
+		Json::Value * record = Json::newObject();
+		record->add("id", Json::newInt(i));
+		record->add("name", Json::newString("record \"" + std::to_string(i) + "\""));
+		records->add(record);
+	}
+	Json::Value * numbers = Json::newArray();
+	for(int i = 0; i < 3000; ++i)
+	{
+		numbers->add(Json::newFloat(i * 0.5f));
+	}
+	Json::Value * wide = Json::newObject();
+	for(int i = 0; i < 2500; ++i)
+	{
+		wide->add("key" + std::to_string(i), Json::newInt(i));
+	}
+	wide->add("key1000", numbers);
+	root->add("records", records);
+	root->add("wide", wide);
+	root->add("small", Json::newBool(true));
+
+	std::string serial = root->toString();
+	REQUIRE(Json::toStringParallel(*root, 4) == serial);
+	REQUIRE(Json::toStringParallel(*root, 1) == serial);
+	REQUIRE(Json::toStringParallel(root->get("records"), 3) == root->get("records").toString());
+	REQUIRE(Json::toStringParallel(root->get("small")) == "true");
+
+	std::string streamed;
+	REQUIRE(Json::writeParallel(*root, [&](const char * data, size_t size) { streamed.append(data, size); return true; }));
+	REQUIRE(streamed == serial);
+}
+
+TEST_CASE( "Thread pools run every index once, nested batches included", "[json/executor]" )
+{
+	Json::ThreadPool pool(4);
+	REQUIRE(pool.concurrency() == 4);
+
+	std::vector<int> hits(10000, 0);
+	pool.run(hits.size(), [&](size_t begin, size_t end) { for(size_t i = begin; i < end; ++i) ++hits[i]; }, 64);
+	REQUIRE(std::count(hits.begin(), hits.end(), 1) == (long) hits.size());
+
+	std::atomic<size_t> total(0);
+	pool.run(16, [&](size_t begin, size_t end)
+	{
+		for(size_t i = begin; i < end; ++i)
+		{
+			pool.run(100, [&](size_t first, size_t last) { total += last - first; });
+		}
+	});
+	REQUIRE(total == 1600);
+
+	// a replacement default executor is what the parallel writer uses
+	struct Serial : Json::Executor
+	{
+		unsigned int concurrency() const override			{ return 1; }
+		void run(size_t count, const Task& task, size_t) override	{ ++batches; task(0, count); }
+		int batches = 0;
+	} serial;
+	Json::UniqueValue val = Json::parse("[1,2,3]");
+	Json::setDefaultExecutor(&serial);
+	REQUIRE(Json::toStringParallel(*val) == "[1,2,3]");
+	Json::setDefaultExecutor(nullptr);
+	REQUIRE(serial.batches == 1);
+	REQUIRE(&Json::defaultExecutor() != &serial);
+}
+
+TEST_CASE( "Parallel parsing matches the serial parser", "[json/parallel]" )
+{
+	// strings full of the characters the chunk scan has to get right
+	std::string records = "[";
+	for(int i = 0; i < 20000; ++i)
+	{
+		if(i) records += ",\n ";
+		records += "{\"id\":" + std::to_string(i) + ",\"text\":\"a, \\\"b\\\" [c] {d} \\\\\",\"list\":[" + std::to_string(i) + ",1.5,[true]]}";
+	}
+	records += "]";
+	std::string numbers = "[";
+	for(int i = 0; i < 200000; ++i) numbers += (i ? "," : "") + std::to_string(i * 7);
+	numbers += "]";
+	std::string object = "{";
+	for(int i = 0; i < 60000; ++i) object += (i ? ",\"k" : "\"k") + std::to_string(i % 45000) + "\":[\"}\",\"" + std::to_string(i) + "\"]";
+	object += "}";
+
+	Json::ThreadPool pool(4);
+	for(auto src : { &records, &numbers, &object })
+	{
+		REQUIRE(src->size() > (1 << 20));
+		Json::UniqueValue parallel = Json::parseParallel(*src, pool);
+		REQUIRE(parallel->toString() == Json::parse(*src)->toString());
+	}
+	REQUIRE(Json::parseParallel(numbers, pool)->asIntSpan().size == 200000);
+
+	// errors anywhere fall back to the serial parser and its message
+	std::string bad = numbers;
+	bad[bad.size() / 2] = ':';
+	REQUIRE(Json::parseParallel(bad, pool)->isNull());
+	bad = records;
+	bad.insert(bad.size() / 3, "\"");
+	REQUIRE(Json::parseParallel(bad, pool)->isNull());
+	REQUIRE(Json::parseParallel("[1,2]", pool)->toString() == "[1,2]");
+}
+
+namespace
+{
+	// records the events it sees as a compact string
+	struct EventLog : public Json::BaseHandler
+	{
+		std::string log;
+		bool null()										{ log += "n"; return true; }
+		bool boolean(bool value)						{ log += value ? "t" : "f"; return true; }
+		bool integer(int value)							{ log += "i" + std::to_string(value); return true; }
+		bool number(double value)						{ log += "d" + std::to_string(value); return true; }
+		bool string(const char * data, size_t size)		{ log += "s" + std::string(data, size); return true; }
+		bool key(const char * data, size_t size)		{ log += "k" + std::string(data, size); return true; }
+		bool startObject()								{ log += "{"; return true; }
+		bool endObject()								{ log += "}"; return true; }
+		bool startArray()								{ log += "["; return true; }
+		bool endArray()									{ log += "]"; return true; }
+	};
+
+	template<unsigned int Flags>
+	std::string events(const std::string& src)
+	{
+		EventLog handler;
+		Json::BasicParser<EventLog, Flags> parser(handler);
+		return parser.parse(src) ? handler.log : "error: " + parser.getError();
+	}
+}
+
+TEST_CASE( "Policy based SAX parser", "[json/parser/sax]" )
+{
+	const unsigned int defaults = Json::eDefaultParseFlags;
+	REQUIRE(events<defaults>(" {\"a\" : [1, -2, true, null, {}, []], \"b\":\"x\"} ") == "{ka[i1i-2tn{}[]]kbsx}");
+	REQUIRE(events<defaults>("[1.5e2, 2E-1, 3000000000]") == "[d150.000000d0.200000d3000000000.000000]");
+	REQUIRE(events<defaults>("\"top level\"") == "stop level");
+
+	// escapes are only decoded when asked for
+	REQUIRE(events<defaults>("[\"a\\nb\"]") == "[sa\nb]");
+	REQUIRE(events<0>("[\"a\\nb\"]") == "[sa\\nb]");
+
+	// utf-8 validation
+	REQUIRE(events<0>("[\"\xc3\x28\"]") == "[s\xc3\x28]");
+	REQUIRE(events<Json::eValidateUtf8>("[\"\xc3\x28\"]").find("error") == 0);
+	REQUIRE(events<Json::eValidateUtf8>("[\"\xc3\xa9\"]") == "[s\xc3\xa9]");
+
+	// duplicate keys
+	REQUIRE(events<defaults>("{\"a\":1,\"a\":2}") == "{kai1kai2}");
+	REQUIRE(events<Json::eRejectDuplicateKeys>("{\"a\":1,\"a\":2}") == "error: Duplicate key in object.");
+	REQUIRE(events<Json::eRejectDuplicateKeys>("{\"a\":{\"a\":1},\"b\":2}") == "{ka{kai1}kbi2}");
+
+	REQUIRE(events<Json::eFastNumbers>("[0.25]") == "[d0.250000]");
+
+	// malformed documents
+	REQUIRE(events<defaults>("{\"a\":1,}").find("error") == 0);
+	REQUIRE(events<defaults>("[1 2]").find("error") == 0);
+	REQUIRE(events<defaults>("[01]").find("error") == 0);
+	REQUIRE(events<defaults>("{\"a\":1} x").find("error") == 0);
+	REQUIRE(events<defaults>("[\"open").find("error") == 0);
+	REQUIRE(events<defaults>("").find("error") == 0);
+
+	REQUIRE(Json::parse("[1,2,3]")->toString() == "[1,2,3]");
+	REQUIRE(Json::parse("{\"a\":1,}")->isNull());
+
+	std::string error;
+	REQUIRE(!Json::parse("[1 2]", error));
+	REQUIRE(error.find("(at offset 3)") != std::string::npos);
+	REQUIRE(Json::parse("null", error)->isNull());
+}
+
+namespace
+{
+	struct Point
+	{
+		int x;
+		int y;
+		std::string label;
+	};
+
+	struct Shape
+	{
+		Shape() : closed(false), scale(1.0) {}
+		std::string name;
+		bool closed;
+		double scale;
+		std::vector<Point> points;
+		std::map<std::string, float> weights;
+	};
+}
+
+JSON_BIND(Point, JSON_FIELD(Point, x), JSON_FIELD(Point, y), JSON_FIELD(Point, label))
+JSON_BIND(Shape, JSON_FIELD(Shape, name), JSON_FIELD(Shape, closed), JSON_FIELD(Shape, scale), JSON_FIELD(Shape, points), JSON_FIELD(Shape, weights))
+
+TEST_CASE( "Parse straight into bound structs", "[json/binding/parse]" )
+{
+	Shape shape;
+	REQUIRE(Json::parseInto("{\"name\":\"tri\\nangle\",\"closed\":true,\"unknown\":{\"a\":[1,{\"b\":\"]\"}]},"
+		"\"points\":[{\"x\":1,\"y\":2,\"label\":\"a\"},{\"y\":4,\"x\":3}],\"weights\":{\"w0\":0.5,\"w1\":2}}", shape));
+	REQUIRE(shape.name == "tri\nangle");
+	REQUIRE(shape.closed);
+	REQUIRE(shape.scale == 1.0);
+	REQUIRE(shape.points.size() == 2);
+	REQUIRE(shape.points[0].x == 1);
+	REQUIRE(shape.points[0].label == "a");
+	REQUIRE(shape.points[1].x == 3);
+	REQUIRE(shape.points[1].y == 4);
+	REQUIRE(shape.weights["w1"] == 2.0f);
+
+	std::vector<Point> points;
+	REQUIRE(Json::parseInto("[{\"x\":5,\"y\":6,\"label\":\"\"}]", points));
+	REQUIRE(points.size() == 1);
+	REQUIRE(points[0].y == 6);
+
+	std::string error;
+	Point point;
+	REQUIRE(!Json::parseInto("{\"x\":\"five\"}", point, error));
+	REQUIRE(error == "Unexpected character.");
+	REQUIRE(!Json::parseInto("{\"x\":1.5}", point, error));
+	REQUIRE(!Json::parseInto("{\"x\":1} trailing", point, error));
+	REQUIRE(!Json::parseInto("[{\"x\":1}", points, error));
+}
+
+namespace
+{
+	struct Odd
+	{
+		int value;
+	};
+}
+
+namespace Json
+{
+	// a key that needs escaping
+	template<> struct Binding<Odd> { static constexpr auto fields() { return std::make_tuple(Json::field("say \"hi\"\n", &Odd::value)); } };
+}
+
+TEST_CASE( "Serialise bound structs without a value tree", "[json/binding/serialize]" )
+{
+	Shape shape;
+	shape.name = "quad";
+	shape.closed = true;
+	shape.scale = 0.1;
+	Point a = { 1, 2, "a" };
+	Point b = { -3, 4, "\"b\"" };
+	shape.points.push_back(a);
+	shape.points.push_back(b);
+	shape.weights["w0"] = 0.5f;
+
+	std::string text = Json::serialize(shape);
+	REQUIRE(text == "{\"name\":\"quad\",\"closed\":true,\"scale\":0.10000000000000001,"
+		"\"points\":[{\"x\":1,\"y\":2,\"label\":\"a\"},{\"x\":-3,\"y\":4,\"label\":\"\\\"b\\\"\"}],\"weights\":{\"w0\":0.5}}");
+
+	// and it reads back the same
+	Shape copy;
+	REQUIRE(Json::parseInto(text, copy));
+	REQUIRE(copy.scale == 0.1);
+	REQUIRE(Json::serialize(copy) == text);
+
+	Odd odd = { 7 };
+	REQUIRE(Json::serialize(odd) == "{\"say \\\"hi\\\"\\n\":7}");
+	REQUIRE(Json::serialize(std::vector<Point>()) == "[]");
+}
+
+using namespace Json::Literals;
+
+TEST_CASE( "JSON literals are checked at compile time", "[json/literals]" )
+{
+	static_assert(Json::Detail::validate("{\"a\":[1,-2.5e3,true,null,\"s\\n\\u00e9\"],\"b\":{}}", 45), "valid");
+	static_assert(!Json::Detail::validate("{\"a\":}", 6), "missing value");
+	static_assert(!Json::Detail::validate("[1,]", 4), "trailing comma");
+	static_assert(!Json::Detail::validate("[01]", 4), "leading zero");
+	static_assert(!Json::Detail::validate("{\"a\" 1}", 7), "missing colon");
+	static_assert(!Json::Detail::validate("[1] [2]", 7), "two documents");
+
+	constexpr Json::Literal config = R"({"retries":3,"hosts":["a","b"]})"_json;
+	REQUIRE(config->get("retries").asInt() == 3);
+	REQUIRE((*config)["hosts"].size() == 2);
+	REQUIRE(&config.value() == &config.value());
+
+	// a literal made each time round is still parsed once, whichever thread gets there first
+	std::vector<const Json::Value *> docs(4);
+	std::vector<std::thread> threads;
+	for(size_t t = 0; t < docs.size(); ++t) threads.emplace_back([&docs, t]() { auto doc = R"([1,2,3])"_json; docs[t] = &doc.value(); });
+	for(auto& thread : threads) thread.join();
+	REQUIRE(docs[0]->size() == 3);
+	REQUIRE(std::count(docs.begin(), docs.end(), docs[0]) == 4);
+}
+
+namespace
+{
+	// what jsonc writes for {"a":[1,2.5],"b":"hi","c":null}
+	const char strings[] = { 'a', 'b', 'h', 'i', 'c' };
+	extern const Json::StaticValue nodes[];
+	const Json::StaticValue nodes[] =
+	{
+		{ Json::StaticValue::Key{ nullptr, 0 }, Json::StaticValue::eObject, nodes + 1, 3 },
+		{ Json::StaticValue::Key{ strings + 0, 1 }, Json::StaticValue::eArray, nodes + 4, 2 },
+		{ Json::StaticValue::Key{ strings + 1, 1 }, strings + 2, 2 },
+		{ Json::StaticValue::Key{ strings + 4, 1 } },
+		{ Json::StaticValue::Key{ nullptr, 0 }, 1 },
+		{ Json::StaticValue::Key{ nullptr, 0 }, 2.5f },
+	};
+}
+
+TEST_CASE( "Static values and generated source", "[json/static]" )
+{
+	const Json::Value& doc = nodes[0];
+	REQUIRE(doc.isObject());
+	REQUIRE(doc.size() == 3);
+	REQUIRE(doc["a"][1].asFloat() == 2.5f);
+	REQUIRE(doc["b"].asString() == "hi");
+	REQUIRE(&doc["b"].asString() == &doc["b"].asString());
+	REQUIRE(doc["c"].isNull());
+	REQUIRE(doc["missing"].isNull());
+	REQUIRE(doc.toString() == "{\"a\":[1,2.5],\"b\":\"hi\",\"c\":null}");
+	REQUIRE(Json::toStringParallel(doc, 2) == doc.toString());
+	REQUIRE(Json::toStringParallel(doc["a"], 2) == "[1,2.5]");
+
+	std::string source = Json::generateSource(*Json::parse("{\"b\":\"hi\",\"a\":[1,2.5],\"c\":null}"), "table");
+	REQUIRE(source.find("const Json::Value& table()") != std::string::npos);
+	REQUIRE(source.find("{ K{ strings + 0, 1 }, V::eArray, nodes + 4, 2 }") != std::string::npos);
+	REQUIRE(source.find("{ K{ nullptr, 0 }, 2.5f }") != std::string::npos);
+	REQUIRE(source.find("strings + 2, 2 }") != std::string::npos);
+}
+
+TEST_CASE( "Snapshots map a saved value without parsing", "[json/snapshot]" )
+{
+	std::string src = "{\"name\":\"cfg\",\"on\":true,\"ratio\":0.25,\"ports\":[80,443,-1],\"none\":null,\"hosts\":{";
+	for(int i = 0; i < 20; ++i)
+	{
+		src += (i ? ",\"h" : "\"h") + std::to_string(i) + "\":" + std::to_string(i * 10);
+	}
+	src += "}}";
+	Json::UniqueValue val = Json::parse(src);
+
+	const char * path = "snapshot_test.bin";
+	REQUIRE(Json::saveSnapshot(*val, path));
+	{
+		std::unique_ptr<Json::Snapshot> snapshot = Json::openSnapshot(path);
+		REQUIRE(snapshot);
+		Json::SnapshotNode root = snapshot->root();
+		REQUIRE(root.toString() == val->toString());
+		REQUIRE(root["name"].asString() == "cfg");
+		REQUIRE(root["on"].asBool());
+		REQUIRE(root["ratio"].asFloat() == 0.25f);
+		REQUIRE(root["ports"].size() == 3);
+		REQUIRE(root["ports"][2].asInt() == -1);
+		REQUIRE(root["ports"][3].isNull());
+		REQUIRE(root["none"].isNull());
+		REQUIRE(root["missing"]["deeper"].isNull());
+
+		// large enough to have a hash index
+		Json::SnapshotNode hosts = root["hosts"];
+		REQUIRE(hosts.size() == 20);
+		for(int i = 0; i < 20; ++i)
+		{
+			REQUIRE(hosts["h" + std::to_string(i)].asInt() == i * 10);
+		}
+		REQUIRE(hosts["h20"].isNull());
+	}
+
+	// a damaged one whose inner array points back at the root
+	{
+		REQUIRE(Json::saveSnapshot(*Json::parse("[[1]]"), path));
+		FILE * file = fopen(path, "r+b");
+		std::vector<unsigned int> words(64);
+		size_t count = fread(&words[0], sizeof(unsigned int), words.size(), file);
+		size_t inner = 0;
+		while(inner + 2 < count && !(words[inner] == Json::StaticValue::eArray && words[inner + 1] == 2)) ++inner;
+		REQUIRE(count > inner + 2);
+		words[inner + 1] = 0;
+		fseek(file, 0, SEEK_SET);
+		fwrite(&words[0], sizeof(unsigned int), count, file);
+		fclose(file);
+		std::unique_ptr<Json::Snapshot> snapshot = Json::openSnapshot(path);
+		REQUIRE(snapshot->root().toString() == "[[null]]");
+	}
+
+	// not a snapshot
+	{
+		FILE * file = fopen(path, "wb");
+		fputs("{\"a\":1}", file);
+		fclose(file);
+	}
+	REQUIRE(!Json::openSnapshot(path));
+	remove(path);
+	REQUIRE(!Json::openSnapshot(path));
+}
+
+TEST_CASE( "Frozen values are shared with readers while new ones are published", "[json/snapshot/shared]" )
+{
+	Json::UniqueValue val = Json::parse("{\"version\":0,\"copy\":0,\"hosts\":[\"a\",\"b\"]}");
+	std::unique_ptr<Json::Snapshot> frozen = Json::freeze(*val);
+	REQUIRE(frozen->root().toString() == val->toString());
+	REQUIRE(frozen->root()["hosts"][1].asString() == "b");
+
+	Json::SharedSnapshot shared(std::move(frozen));
+	std::atomic<bool> done(false);
+	std::atomic<int> torn(0);
+	std::vector<std::thread> readers;
+	for(int r = 0; r < 4; ++r)
+	{
+		readers.push_back(std::thread([&]()
+		{
+			int last = 0;
+			while(!done)
+			{
+				Json::SharedSnapshot::ReadGuard guard = shared.read();
+				int version = guard.root()["version"].asInt();
+				if(version < last || guard.root()["copy"].asInt() != version) ++torn;
+				last = version;
+			}
+		}));
+	}
+	for(int i = 1; i <= 300; ++i)
+	{
+		val->add("version", Json::newInt(i));
+		val->add("copy", Json::newInt(i));
+		shared.publish(Json::freeze(*val));
+	}
+	done = true;
+	for(auto& reader : readers) reader.join();
+
+	REQUIRE(torn == 0);
+	REQUIRE(shared.reclaim() == 0);
+	REQUIRE(shared.read().root()["version"].asInt() == 300);
+
+	// a reader holding on keeps its snapshot alive
+	Json::SharedSnapshot::ReadGuard old = shared.read();
+	shared.publish(Json::freeze(*Json::parse("{\"version\":301}")));
+	REQUIRE(shared.reclaim() == 1);
+	REQUIRE(old.root()["version"].asInt() == 300);
+	{
+		Json::SharedSnapshot::ReadGuard moved(std::move(old));
+	}
+	REQUIRE(shared.reclaim() == 0);
+}
+
+TEST_CASE( "MessagePack to and from values", "[json/msgpack]" )
+{
+	Json::UniqueValue val = Json::parse("{\"a\":[1,-1,-33,200,70000,-200,-70000],\"b\":[0.5,1.5],\"c\":\"hi\",\"d\":[true,null,\"x\",{}],\"e\":[]}");
+	std::string packed = Json::toMsgPack(*val);
+	REQUIRE(Json::fromMsgPack(packed)->toString() == val->toString());
+
+	// the smallest encodings
+	REQUIRE(Json::toMsgPack(*Json::parse("[1,-1,200,-200]")) == std::string("\x94\x01\xff\xcc\xc8\xd1\xff\x38", 8));
+	REQUIRE(Json::toMsgPack(*Json::parse("{\"k\":true}")) == "\x81\xa1k\xc3");
+
+	// formats toMsgPack doesn't write
+	REQUIRE(Json::fromMsgPack(std::string("\xcf\x00\x00\x00\x00\x00\x00\x00\x07", 9))->asInt() == 7);
+	REQUIRE(Json::fromMsgPack(std::string("\xd3\xff\xff\xff\xff\xff\xff\xff\xfe", 9))->asInt() == -2);
+	REQUIRE(Json::fromMsgPack(std::string("\xcf\x00\x00\x00\x01\x00\x00\x00\x00", 9))->asFloat() == 4294967296.0f);
+	REQUIRE(Json::fromMsgPack("\xc4\x02hi")->asBytes() == "hi");
+
+	REQUIRE(Json::fromMsgPack("\x92\x01")->isNull());			// truncated
+	REQUIRE(Json::fromMsgPack("\x81\x01\x02")->isNull());		// integer key
+	REQUIRE(Json::fromMsgPack("\xc3\xc3")->isNull());			// trailing bytes
+}
+
+TEST_CASE( "JSON text transcodes to MessagePack", "[json/msgpack]" )
+{
+	std::string src = "{\"a\":[1,2,{\"b\":null}],\"c\":1e300,\"d\":[],\"e\":\"s\\n\"}";
+	std::string packed;
+	REQUIRE(Json::jsonToMsgPack(src, packed));
+	REQUIRE(packed.substr(0, 5) == std::string("\xdf\x00\x00\x00\x04", 5));
+	REQUIRE(Json::fromMsgPack(packed)->toString() == Json::parse(src)->toString());
+
+	std::string error;
+	REQUIRE(!Json::jsonToMsgPack("[1,", packed, error));
+	REQUIRE(!error.empty());
+}
+
+TEST_CASE( "Benchmark transcoding against parse and serialise", "[.][benchmark]" )
+{
+	std::string src = "[";
+	for(int i = 0; i < 100000; ++i)
+	{
+		src += (i ? ",{\"id\":" : "{\"id\":") + std::to_string(i) + ",\"name\":\"item\",\"tags\":[\"a\",\"b\"],\"price\":" + std::to_string(i) + ".5}";
+	}
+	src += "]";
+
+	std::string packed;
+	auto start = std::chrono::steady_clock::now();
+	REQUIRE(Json::jsonToMsgPack(src, packed));
+	auto transcoded = std::chrono::steady_clock::now();
+	packed = Json::toMsgPack(*Json::parse(src));
+	auto converted = std::chrono::steady_clock::now();
+
+	WARN("transcode: " << std::chrono::duration_cast<std::chrono::milliseconds>(transcoded - start).count() << "ms, "
+		"parse then toMsgPack: " << std::chrono::duration_cast<std::chrono::milliseconds>(converted - transcoded).count() << "ms");
+}
+
+TEST_CASE( "CBOR to and from values", "[json/cbor]" )
+{
+	Json::UniqueValue val = Json::parse("{\"a\":[1,-1,24,-25,70000,-2147483648],\"b\":[0.5,0.1,65504,1e-7],\"c\":\"hi\",\"d\":[true,null,{}],\"e\":[]}");
+	val->add("raw", Json::newBytes(std::string("\x00\xff\x10", 3)));
+	std::string encoded = Json::toCbor(*val);
+	Json::UniqueValue decoded = Json::fromCbor(encoded);
+	REQUIRE(decoded->toString() == val->toString());
+	REQUIRE(decoded->get("raw").asBytes() == std::string("\x00\xff\x10", 3));
+	REQUIRE(val->get("raw").toString() == "\"AP8Q\"");
+
+	// shortest heads, and half precision when it's exact
+	REQUIRE(Json::toCbor(*Json::parse("[23,24,-24,-25]")) == "\x84\x17\x18\x18\x37\x38\x18");
+	REQUIRE(Json::toCbor(*Json::parse("[1.5,0.1]")) == std::string("\x82\xf9\x3e\x00\xfa\x3d\xcc\xcc\xcd", 9));
+
+	// indefinite lengths, chunked strings, tags, float 64 and big ints
+	REQUIRE(Json::fromCbor("\xbf\x61k\x9f\x01\xff\xff")->toString() == "{\"k\":[1]}");
+	REQUIRE(Json::fromCbor("\x7f\x62" "ab\x61" "c\xff")->asString() == "abc");
+	REQUIRE(Json::fromCbor("\xc1\x1a\x51\x4b\x67\xb0")->asInt() == 1363896240);
+	REQUIRE(Json::fromCbor(std::string("\xfb\x3f\xf8\x00\x00\x00\x00\x00\x00", 9))->asFloat() == 1.5f);
+	REQUIRE(Json::fromCbor(std::string("\x1b\x00\x00\x00\x01\x00\x00\x00\x00", 9))->isFloat());
+
+	REQUIRE(Json::fromCbor("\x82\x01")->isNull());			// truncated
+	REQUIRE(Json::fromCbor("\xa1\x01\x02")->isNull());		// integer key
+	REQUIRE(Json::fromCbor("\x1c")->isNull());				// reserved
+}
+
+TEST_CASE( "CBOR views reference the buffer", "[json/cbor]" )
+{
+	Json::UniqueValue val = Json::parse("{\"name\":\"sensor\",\"readings\":[1,2.5,-3],\"ok\":true,\"none\":null}");
+	std::string encoded = Json::toCbor(*val);
+	Json::CborView view = Json::viewCbor(encoded);
+	REQUIRE(view.isObject());
+	REQUIRE(view.size() == 4);
+	REQUIRE(view.toString() == val->toString());
+	REQUIRE(view["name"].asText().data > encoded.data());
+	REQUIRE(view["name"].asText().data < encoded.data() + encoded.size());
+	REQUIRE(view["name"].asString() == "sensor");
+	REQUIRE(view["readings"][1].asFloat() == 2.5f);
+	REQUIRE(view["readings"][2].asInt() == -3);
+	REQUIRE(view["readings"][3].isNull());
+	REQUIRE(view["ok"].asBool());
+	REQUIRE(view["missing"].isNull());
+	REQUIRE(std::string(view[2].key().data, view[2].key().size) == "ok");
+
+	// indefinite containers and tags
+	std::string streamed("\xbf\x61k\x9f\xc1\x01\x42\x00\x01\xff\x61z\xf5\xff", 14);
+	Json::CborView indefinite = Json::viewCbor(streamed);
+	REQUIRE(indefinite.size() == 2);
+	REQUIRE(indefinite["k"].size() == 2);
+	REQUIRE(indefinite["k"][0].asInt() == 1);
+	REQUIRE(indefinite["k"][1].asBytes().size == 2);
+	REQUIRE(indefinite["z"].asBool());
+	REQUIRE(indefinite.toString() == "{\"k\":[1,\"AAE\"],\"z\":true}");
+
+	// chunked strings can't be viewed in place
+	std::string chunked("\x7f\x61" "a\xff");
+	REQUIRE(Json::viewCbor(chunked).isNull());
+}
+
+TEST_CASE( "JSON Pointers resolve against values and text", "[json/pointer]" )
+{
+	std::string src = "{\"a\":{\"b\":[10,20,{\"c\":\"deep\"}],\"x/y\":1,\"m~n\":2,\"\":3,\"07\":4},\"skip\":{\"big\":[1,2,[3,{}]]},\"z\":null}";
+	Json::UniqueValue doc = Json::parse(src);
+
+	const char * paths[] = { "", "/a/b/2/c", "/a/b/1", "/a/x~1y", "/a/m~0n", "/a/", "/a/07", "/z" };
+	const char * expect[] = { nullptr, "\"deep\"", "20", "1", "2", "3", "4", "null" };
+	for(int i = 0; i < 8; ++i)
+	{
+		Json::Pointer pointer(paths[i]);
+		REQUIRE(pointer.valid());
+		const Json::Value * val = pointer.resolve(*doc);
+		REQUIRE(val);
+		Json::Span<char> text;
+		REQUIRE(pointer.resolve(src, text));
+		std::string raw(text.data, text.size);
+		if(expect[i])
+		{
+			REQUIRE(val->toString() == expect[i]);
+			REQUIRE(raw == expect[i]);
+		}
+		else
+		{
+			REQUIRE(raw == src);
+		}
+	}
+
+	// missing, and indexes that aren't
+	const char * missing[] = { "/nope", "/a/b/3", "/a/b/-", "/a/b/01", "/a/b/2/c/d", "/z/0" };
+	for(const char * path : missing)
+	{
+		Json::Pointer pointer(path);
+		Json::Span<char> text;
+		REQUIRE(!pointer.resolve(*doc));
+		REQUIRE(!pointer.resolve(src, text));
+	}
+
+	REQUIRE(!Json::Pointer("a/b").valid());
+	REQUIRE(!Json::Pointer("/a~2").valid());
+	REQUIRE(Json::Pointer("/a/b/3/c").depth() == 4);
+
+	// the raw lookup stops once it has the value, so what follows needn't be valid
+	std::string truncated = "{\"a\":[1] , oops";
+	Json::Span<char> text;
+	REQUIRE(Json::Pointer("/a").resolve(truncated, text));
+	REQUIRE(std::string(text.data, text.size) == "[1]");
+}
+
+namespace
+{
+	// the text of every match separated by spaces, from the tree and from the raw source
+	// (which must agree)
+	std::string query(const std::string& path, const std::string& src)
+	{
+		Json::Path compiled(path);
+		REQUIRE(compiled.valid());
+		Json::UniqueValue doc = Json::parse(src);
+		std::string fromTree;
+		for(const Json::Value * val : compiled.select(*doc)) fromTree += (fromTree.empty() ? "" : " ") + val->toString();
+
+		std::vector<Json::Span<char>> spans;
+		REQUIRE(compiled.select(src, spans));
+		std::string fromText;
+		for(auto& span : spans) fromText += (fromText.empty() ? "" : " ") + Json::parse(std::string(span.data, span.size))->toString();
+		REQUIRE(fromText == fromTree);
+		return fromTree;
+	}
+}
+
+TEST_CASE( "JSONPath queries over values and text", "[json/path]" )
+{
+	std::string store = "{\"orders\":[{\"id\":1,\"total\":50,\"state\":\"paid\"},{\"id\":2,\"total\":150,\"state\":\"void\"},"
+		"{\"id\":3,\"total\":250.5,\"state\":\"paid\",\"note\":{\"id\":9}}],\"owner\":{\"id\":7,\"name\":\"o\"}}";
+
+	REQUIRE(query("$.orders[?(@.total > 100)].id", store) == "2 3");
+	REQUIRE(query("$.orders[?(@.total > 100 && @.state != 'void')].id", store) == "3");
+	REQUIRE(query("$.orders[?(@.state == \"paid\" || !(@.total < 200))].id", store) == "1 3");
+	REQUIRE(query("$.orders[?@.note].id", store) == "3");
+	REQUIRE(query("$.orders[?(@.total >= $.orders[1].total)].id", store) == "2 3");
+	REQUIRE(query("$.orders[?(@.state > 'p')].id", store) == "1 2 3");
+	REQUIRE(query("$.orders[?(@.total == '50')].id", store).empty());	// no conversions between types
+
+	REQUIRE(query("$..id", store) == "1 2 3 9 7");
+	REQUIRE(query("$.owner.*", store) == "7 \"o\"");
+	REQUIRE(query("$['owner']['name']", store) == "\"o\"");
+	REQUIRE(query("$", "[1]") == "[1]");
+
+	std::string numbers = "[0,1,2,3,4,5,6,7,8,9]";
+	REQUIRE(query("$[1]", numbers) == "1");
+	REQUIRE(query("$[-1]", numbers) == "9");
+	REQUIRE(query("$[0,3,-2]", numbers) == "0 3 8");
+	REQUIRE(query("$[7:]", numbers) == "7 8 9");
+	REQUIRE(query("$[:2]", numbers) == "0 1");
+	REQUIRE(query("$[1:8:3]", numbers) == "1 4 7");
+	REQUIRE(query("$[-3:-1]", numbers) == "7 8");
+	REQUIRE(query("$[::-4]", numbers) == "1 5 9");		// document order
+	REQUIRE(query("$[?(@ >= 8)]", numbers) == "8 9");
+	REQUIRE(query("$[20]", numbers).empty());
+	REQUIRE(query("$..[0]", "[[1,[2]],[3]]") == "[1,[2]] 1 2 3");
+
+	const char * invalid[] = { "orders", "$.", "$[", "$[?(@.a ==)]", "$['a]", "$[1:2:x]", "$[?(1)]" };
+	for(const char * path : invalid)
+	{
+		REQUIRE(!Json::Path(path).valid());
+	}
+	REQUIRE(Json::Path("$.a").getError().empty());
+
+	std::vector<Json::Span<char>> spans;
+	std::string broken = "{\"a\":[1,2";
+	REQUIRE(!Json::Path("$.a[*]").select(broken, spans));
+}
+
+TEST_CASE( "Benchmark repeated JSONPath plans", "[.][benchmark]" )
+{
+	std::string src = "{\"orders\":[";
+	for(int i = 0; i < 10000; ++i)
+	{
+		src += (i ? ",{\"id\":" : "{\"id\":") + std::to_string(i) + ",\"total\":" + std::to_string(i % 300) + ",\"lines\":[1,2,3]}";
+	}
+	src += "]}";
+	Json::UniqueValue doc = Json::parse(src);
+	Json::Path path("$.orders[?(@.total > 100)].id");
+
+	std::vector<const Json::Value *> matches;
+	auto start = std::chrono::steady_clock::now();
+	for(int run = 0; run < 100; ++run) path.select(*doc, matches);
+	auto tree = std::chrono::steady_clock::now();
+
+	std::vector<int> loop;
+	for(int run = 0; run < 100; ++run)
+	{
+		loop.clear();
+		const Json::Value& orders = (*doc)["orders"];
+		for(unsigned int i = 0; i < orders.size(); ++i)
+		{
+			if(orders[i]["total"].isInt() && orders[i]["total"].asInt() > 100) loop.push_back(orders[i]["id"].asInt());
+		}
+	}
+	auto byHand = std::chrono::steady_clock::now();
+
+	std::vector<Json::Span<char>> spans;
+	for(int run = 0; run < 10; ++run) path.select(src, spans);
+	auto text = std::chrono::steady_clock::now();
+	REQUIRE(matches.size() == loop.size());
+	REQUIRE(spans.size() == loop.size());
+
+	using std::chrono::microseconds;
+	WARN("plan over tree: " << std::chrono::duration_cast<microseconds>(tree - start).count() / 100 << "us, "
+		"hand written loop: " << std::chrono::duration_cast<microseconds>(byHand - tree).count() / 100 << "us, "
+		"plan over text: " << std::chrono::duration_cast<microseconds>(text - byHand).count() / 10 << "us per run");
+}
+
+TEST_CASE( "Projections parse only the declared paths", "[json/projection]" )
+{
+	std::string src = "{\"user\":{\"id\":42,\"name\":\"n\",\"tags\":[\"a\",\"b\"]},\"event\":{\"ts\":1.5,\"kind\":{\"x\":[1,2]}},"
+		"\"items\":[{\"sku\":\"a\",\"qty\":1},{\"sku\":\"b\",\"qty\":2},{\"sku\":\"c\",\"qty\":3}],\"noise\":[\"\\\"]\",{\"}\":\"[\"}],\"n\":null}";
+
+	Json::UniqueValue doc = Json::parse(src, Json::Projection{ "/user/id", "/event/kind", "/items/1/sku", "/missing/key" });
+	REQUIRE(doc->toString() == "{\"event\":{\"kind\":{\"x\":[1,2]}},\"items\":[null,{\"sku\":\"b\"}],\"user\":{\"id\":42}}");
+
+	REQUIRE(Json::parse(src, Json::Projection{ "" })->toString() == Json::parse(src)->toString());
+	REQUIRE(Json::parse(src, Json::Projection{ "/n", "/user/id/deeper" })->toString() == "{\"n\":null,\"user\":{}}");
+	REQUIRE(Json::parse(src, Json::Projection{})->toString() == "{}");
+
+	// errors in skipped regions are still caught, as is anything after the document
+	REQUIRE(Json::parse("{\"a\":1,\"b\":[1,2}", Json::Projection{ "/a" })->isNull());
+	REQUIRE(Json::parse("{\"a\":[1,]}", Json::Projection{ "/a" })->isNull());
+	REQUIRE(Json::parse("{\"a\":1} x", Json::Projection{ "/a" })->isNull());
+	REQUIRE(!Json::Projection{ "no/slash" }.valid());
+}
+
+TEST_CASE( "Line filters keep the matching NDJSON records", "[json/ndjson]" )
+{
+	std::string log =
+		"{\"ts\":1,\"status\":\"error\",\"msg\":\"disk\"}\n"
+		"{\"ts\":2,\"status\":\"ok\",\"msg\":\"error\"}\r\n"
+		"\n"
+		"{\"ts\":3,\"msg\":\"x\",\"status\":\"\\u0065rror\"}\n"
+		"{\"ts\":4,\"detail\":{\"status\":\"error\"}}\n"
+		"{\"ts\":5,\"status\":\"error\"";
+
+	Json::LineFilter errors("/status", "\"error\"");
+	REQUIRE(errors.valid());
+	std::vector<Json::Span<char>> lines;
+	REQUIRE(errors.select(log, lines) == log.size());
+	REQUIRE(lines.size() == 3);
+	REQUIRE(std::string(lines[0].data, lines[0].size) == "{\"ts\":1,\"status\":\"error\",\"msg\":\"disk\"}");
+	REQUIRE(std::string(lines[1].data, lines[1].size) == "{\"ts\":3,\"msg\":\"x\",\"status\":\"\\u0065rror\"}");
+	REQUIRE(std::string(lines[2].data, lines[2].size) == "{\"ts\":5,\"status\":\"error\"");
+
+	// chunked input keeps the partial last line for the next buffer
+	lines.clear();
+	size_t used = errors.select(log.data(), log.size(), lines, false);
+	REQUIRE(used == log.find("{\"ts\":5"));
+	REQUIRE(lines.size() == 2);
+
+	// numbers compare by value, and the key search skips a long prefix 16 bytes at a time
+	Json::LineFilter second("/items/1/n", "2");
+	std::string padded = "{\"pad\":\"0123456789abcdef0123456789abcdef\",\"items\":[{\"n\":1},{\"n\":2.0}]}";
+	REQUIRE(second.matches(padded.data(), padded.size()));
+	REQUIRE(!second.matches("{\"items\":[{\"n\":2},{\"n\":1}]}", 27));
+	REQUIRE(Json::LineFilter("/on", "true").matches("{\"on\":true}", 11));
+	REQUIRE(!Json::LineFilter("/on", "true").matches("{\"on\":\"true\"}", 13));
+
+	REQUIRE(!Json::LineFilter("/a", "{}").valid());
+	REQUIRE(!Json::LineFilter("a", "1").valid());
+}
+
+TEST_CASE( "Persistent values share what an edit leaves alone", "[json/persistent]" )
+{
+	Json::UniqueValue tree = Json::parse("{\"name\":\"cfg\",\"users\":[{\"id\":1,\"name\":\"ann\"},{\"id\":2,\"name\":\"bo\"}],\"limits\":{\"cpu\":2,\"mem\":1.5}}");
+	Json::PersistentValue doc(*tree);
+	REQUIRE(doc.toString() == tree->toString());
+
+	Json::PersistentValue next = doc.set("/users/1/name", "kim");
+	REQUIRE(next.at(Json::Pointer("/users/1/name")).asString() == "kim");
+	REQUIRE(doc.at(Json::Pointer("/users/1/name")).asString() == "bo");
+	REQUIRE(next["limits"].sameAs(doc["limits"]));
+	REQUIRE(next["users"][0].sameAs(doc["users"][0]));
+	REQUIRE(!next["users"].sameAs(doc["users"]));
+
+	next = next.set("/users/-", Json::PersistentValue(*Json::parse("{\"id\":3}"))).set("/limits/disk", true).remove("/limits/cpu").remove("/users/0");
+	REQUIRE(next.toString() == "{\"limits\":{\"disk\":true,\"mem\":1.5},\"name\":\"cfg\",\"users\":[{\"id\":2,\"name\":\"kim\"},{\"id\":3}]}");
+	REQUIRE(next.toValue()->toString() == next.toString());
+
+	// bad paths leave the value as it was
+	REQUIRE(next.set("/missing/key", 1).sameAs(next));
+	REQUIRE(next.set("/users/9", 1).sameAs(next));
+	REQUIRE(next.set("/name/x", 1).sameAs(next));
+	REQUIRE(next.remove("/nothing").sameAs(next));
+
+	// enough members and elements for several levels of both tries
+	Json::PersistentValue wide = Json::PersistentValue::emptyObject();
+	Json::PersistentValue list = Json::PersistentValue::emptyArray();
+	for(int i = 0; i < 5000; ++i)
+	{
+		wide = wide.set("/k" + std::to_string(i), i);
+		list = list.set("/-", i);
+	}
+	Json::PersistentValue before = list;
+	list = list.set("/4321", -1);
+	REQUIRE(wide.size() == 5000);
+	REQUIRE(list.size() == 5000);
+	bool found = true;
+	for(int i = 0; i < 5000; ++i)
+	{
+		found = found && wide["k" + std::to_string(i)].asInt() == i && list[i].asInt() == (i == 4321 ? -1 : i) && before[i].asInt() == i;
+	}
+	REQUIRE(found);
+	for(int i = 0; i < 5000; i += 2) wide = wide.remove("/k" + std::to_string(i));
+	REQUIRE(wide.size() == 2500);
+	REQUIRE(wide["k2"].isNull());
+	REQUIRE(wide["k4999"].asInt() == 4999);
+	REQUIRE(list.remove("/0")[0].asInt() == 1);
+	REQUIRE(list.remove("/0").size() == 4999);
+}
+
+TEST_CASE( "Versioned documents give readers consistent versions", "[json/versioned]" )
+{
+	Json::VersionedDocument doc(Json::PersistentValue(*Json::parse("{\"a\":0,\"b\":0,\"log\":[]}")));
+	std::atomic<bool> done(false);
+	std::atomic<int> torn(0);
+	std::vector<std::thread> readers;
+	for(int r = 0; r < 4; ++r)
+	{
+		readers.push_back(std::thread([&]()
+		{
+			unsigned long long last = 0;
+			while(!done)
+			{
+				Json::VersionedDocument::Version version = doc.read();
+				const Json::PersistentValue& root = version.root();
+				// a and b are always written together, and the log has one entry per pair
+				int a = root["a"].asInt();
+				if(a != root["b"].asInt() || root["log"].size() != (unsigned int) a || version.number() < last) ++torn;
+				last = version.number();
+			}
+		}));
+	}
+	bool published = true;
+	for(int i = 1; i <= 500; ++i)
+	{
+		published = doc.update([i](const Json::PersistentValue& root) { return root.set("/a", i).set("/b", i).set("/log/-", i); }) && published;
+	}
+	done = true;
+	for(auto& reader : readers) reader.join();
+	REQUIRE(published);
+	REQUIRE(torn == 0);
+
+	Json::VersionedDocument::Version pinned = doc.read();
+	REQUIRE(doc.add("/c", "new"));
+	REQUIRE(doc.remove("/a"));
+	REQUIRE(!doc.remove("/missing"));
+	REQUIRE(!doc.add("/x/y", 1));
+	REQUIRE(pinned.number() == 500);
+	REQUIRE(pinned.root()["a"].asInt() == 500);
+	REQUIRE(doc.read().number() == 502);
+	REQUIRE(doc.read().root().toString().substr(0, 23) == "{\"b\":500,\"c\":\"new\",\"log");
+
+	// without the background thread versions are freed as edits are made
+	Json::VersionedDocument quiet(Json::PersistentValue::emptyObject(), false);
+	for(int i = 0; i < 10; ++i) quiet.add("/n", i);
+	REQUIRE(quiet.collect() == 0);
+}
+
+TEST_CASE( "Deep trees are freed without recursion, and big ones in the background", "[json/reclaim]" )
+{
+	// deep enough to overflow the stack if each level were freed inside its parent
+	{
+		Json::UniqueValue deep(Json::newArray());
+		Json::Value * level = deep.get();
+		for(int i = 0; i < 1000000; ++i)
+		{
+			Json::Value * next = i % 2 ? Json::newArray() : Json::newObject();
+			level->isArray() ? level->add(next) : level->add("k", next);
+			level = next;
+		}
+	}
+
+	std::string src = "[";
+	for(int i = 0; i < 20000; ++i) src += (i ? ",{\"id\":" : "{\"id\":") + std::to_string(i) + ",\"tags\":[\"a\",\"b\"]}";
+	src += "]";
+	Json::Reclaimer reclaimer;
+	reclaimer.dispose(Json::parse(src));
+	reclaimer.dispose(nullptr);
+	reclaimer.drain();
+	{
+		Json::DeferredValue doc(Json::parse(src).release());
+		REQUIRE(doc->size() == 20000);
+	}
+	Json::backgroundReclaimer().drain();
+}
+
+TEST_CASE( "Values are pooled per thread and come back when freed", "[json/pool]" )
+{
+	auto inUse = []()
+	{
+		size_t total = 0;
+		for(auto& stats : Json::poolStats()) total += stats.inUse;
+		return total;
+	};
+	size_t before = inUse();
+
+	// churn reuses blocks rather than carving new ones
+	auto churn = []()
+	{
+		auto doc = Json::parse("{\"a\":1,\"b\":[1,\"x\",{\"c\":null}]}");
+		for(int i = 0; i < 1000; ++i)
+		{
+			doc->add(std::to_string(i % 50), Json::newString("value"));
+			doc->remove(std::to_string((i + 25) % 50));
+		}
+		return doc->size();
+	};
+	auto blocks = []()
+	{
+		size_t total = 0;
+		for(auto& stats : Json::poolStats()) total += stats.blocks;
+		return total;
+	};
+	churn();
+	REQUIRE(inUse() == before);
+	size_t carved = blocks();
+	churn();
+	REQUIRE(blocks() == carved);
+
+	// freed on another thread, then handed back to this one's pool
+	Json::Value * doc = Json::parse("[{\"a\":1},{\"b\":2},\"three\"]").release();
+	REQUIRE(inUse() > before);
+	std::thread([doc]() { delete doc; }).join();
+	REQUIRE(inUse() == before);
+}